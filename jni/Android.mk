@@ -17,18 +17,40 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_MODULE    := test2
-LOCAL_SRC_FILES := main.c ft.c fake_dlfcn.c
+LOCAL_SRC_FILES := android.c main.c log.c metrics.c source.c ft.c linebreak.c sched.c grid.c doc.c surface.c fake_dlfcn.c
 LOCAL_CFLAGS	+= -Wall -O2 -g
 ifdef TESTCPP
 LOCAL_SRC_FILES += testcpp.cpp
 LOCAL_CFLAGS	+= -DTESTCPP
 endif
 LOCAL_CFLAGS	+= -DHANDLE_UNICODE=1
+ifdef SHAPING
+LOCAL_SRC_FILES += shape.c
+LOCAL_CFLAGS	+= -DSHAPING
+endif
+ifdef ZERO_COPY
+LOCAL_CFLAGS	+= -DZERO_COPY
+endif
+ifdef SHARED_ATLAS
+LOCAL_SRC_FILES += atlas.c
+LOCAL_CFLAGS	+= -DSHARED_ATLAS
+endif
+ifdef TRACING
+LOCAL_SRC_FILES += trace.c
+LOCAL_CFLAGS	+= -DTRACING
+endif
 LOCAL_LDLIBS    := -llog -landroid
 LOCAL_STATIC_LIBRARIES := android_native_app_glue
 LOCAL_C_INCLUDES := $(LOCAL_PATH)/include/freetype
 include $(BUILD_SHARED_LIBRARY)
 
+# Reads the metrics page of a running app: "test2_metrics <pid>", see metrics_cli.c
+include $(CLEAR_VARS)
+LOCAL_MODULE    := test2_metrics
+LOCAL_SRC_FILES := metrics_cli.c
+LOCAL_CFLAGS	+= -Wall -O2
+include $(BUILD_EXECUTABLE)
+
 $(call import-module,android/native_app_glue)
 
 
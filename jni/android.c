@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <jni.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dlfcn.h>
+
+#include <android_native_app_glue.h>
+#include <android/looper.h>
+#include <sys/system_properties.h>
+
+#include "main.h"
+
+/* Android backend: the native activity drives the app core in main.c
+   and frames go to its window through a surface. */
+
+/* Android window. Surface::lock() copies whatever it can of the previous frame into
+   the buffer and grows the rectangle to the whole buffer when it cannot, so buffers are
+   either current outside the rectangle (age 1) or undefined. */
+
+struct window_surface {
+    struct surface s;
+    struct android_app *app;		/* app->window goes away between TERM_WINDOW and INIT_WINDOW */
+    int fmt;
+};
+
+static int window_lock(struct surface *s, struct surface_buffer *buf, struct rect *dirty)
+{
+    struct window_surface *ws = (struct window_surface *) s;
+    ANativeWindow_Buffer buffer;
+    ARect bounds = { dirty->left, dirty->top, dirty->right, dirty->bottom };
+
+	if(!ws->app->window) {
+	    log_error("%s called with null window", __func__);
+	    return -1;
+	}
+	if(ANativeWindow_setBuffersGeometry(ws->app->window, 0, 0, ws->fmt) != 0) {
+	    log_error("Failed to set buffer format");
+	    return -1;
+	}
+	if(ANativeWindow_lock(ws->app->window, &buffer, &bounds) < 0) {
+	    log_error("Unable to lock window buffer");
+	    return -1;
+	}
+	buf->bits = buffer.bits;
+	buf->width = buffer.width;
+	buf->height = buffer.height;
+	buf->stride = buffer.stride;
+	buf->fmt = buffer.format;
+	buf->age = (bounds.left == dirty->left && bounds.top == dirty->top
+		&& bounds.right == dirty->right && bounds.bottom == dirty->bottom) ? 1 : 0;
+	dirty->left = bounds.left;
+	dirty->top = bounds.top;
+	dirty->right = bounds.right;
+	dirty->bottom = bounds.bottom;
+
+    return 0;
+}
+
+static void window_post(struct surface *s)
+{
+    ANativeWindow_unlockAndPost(((struct window_surface *) s)->app->window);
+}
+
+static void window_destroy(struct surface *s)
+{
+    free(s);
+}
+
+static struct surface *window_surface_create(struct android_app *app, int fmt)
+{
+    struct window_surface *ws = (struct window_surface *) calloc(1, sizeof(struct window_surface));
+	if(!ws) {
+	    log_error("no memory for window surface");
+	    return 0;
+	}
+	ws->s.lock = window_lock;
+	ws->s.post = window_post;
+	ws->s.destroy = window_destroy;
+	ws->app = app;
+	ws->fmt = fmt;
+
+    return &ws->s;
+}
+
+/* Vsyncs from the Choreographer of app_thread, which gets a looper of its own for it on the
+   first vsync() call. The Choreographer needs API 24, 29 for 64-bit frame times on 32-bit
+   ABIs, so it is looked up at run time; without it frames are paced by a 60 Hz timer.
+   The display period is taken as the shortest time seen between two frame callbacks. */
+
+typedef void (*frame_callback)(long frame_time, void *data);
+typedef void (*frame_callback64)(int64_t frame_time, void *data);
+
+struct choreographer_clock {
+    struct frame_clock c;
+    struct frame_clock *timer;		/* for now() and sleep() */
+    void *choreographer;
+    void *(*get_instance)(void);
+    void (*post)(void *choreographer, frame_callback cb, void *data);
+    void (*post64)(void *choreographer, frame_callback64 cb, void *data);
+    int64_t frame_time, last;		/* of the frame called back for, 0 while waiting; of the one before */
+};
+
+#define DEFAULT_PERIOD	16666667	/* 60 Hz until measured */
+
+static void on_frame64(int64_t frame_time, void *data)
+{
+    ((struct choreographer_clock *) data)->frame_time = frame_time;
+}
+
+static void on_frame(long frame_time, void *data)
+{
+    struct choreographer_clock *cc = (struct choreographer_clock *) data;
+    /* a 32-bit long wraps every 4 s, the callback runs right after the vsync anyway */
+    cc->frame_time = sizeof(long) < 8 ? (int64_t) cc->timer->now(cc->timer) : frame_time;
+}
+
+static uint64_t choreographer_now(struct frame_clock *c)
+{
+    struct frame_clock *timer = ((struct choreographer_clock *) c)->timer;
+    return timer->now(timer);
+}
+
+static int choreographer_sleep(struct frame_clock *c, uint64_t t, sem_t *wake)
+{
+    struct frame_clock *timer = ((struct choreographer_clock *) c)->timer;
+    return timer->sleep(timer, t, wake);
+}
+
+static uint64_t choreographer_vsync(struct frame_clock *c)
+{
+    struct choreographer_clock *cc = (struct choreographer_clock *) c;
+    int64_t d;
+
+	if(cc->get_instance) {		/* first call */
+	    ALooper_prepare(0);
+	    if(!(cc->choreographer = cc->get_instance())) log_info("no Choreographer, pacing frames by a timer");
+	    cc->get_instance = 0;
+	}
+	if(!cc->choreographer) return cc->timer->vsync(cc->timer);
+	cc->frame_time = 0;
+	if(cc->post64) cc->post64(cc->choreographer, on_frame64, cc);
+	else cc->post(cc->choreographer, on_frame, cc);
+	while(!cc->frame_time)
+	    if(ALooper_pollOnce(-1, 0, 0, 0) == ALOOPER_POLL_ERROR) {
+		log_error("%s: looper failed", __func__);
+		return choreographer_now(c);
+	    }
+	d = cc->frame_time - cc->last;
+	if(cc->last && d < c->period && d > c->period / 3) c->period = d;
+	cc->last = cc->frame_time;
+    return cc->frame_time;
+}
+
+static void choreographer_destroy(struct frame_clock *c)
+{
+    struct choreographer_clock *cc = (struct choreographer_clock *) c;
+    cc->timer->destroy(cc->timer);
+    free(cc);
+}
+
+static struct frame_clock *choreographer_clock_create(void)
+{
+    struct choreographer_clock *cc;
+    void *lib = dlopen("libandroid.so", RTLD_NOW);
+    void *get_instance = lib ? dlsym(lib, "AChoreographer_getInstance") : 0;
+    void *post64 = lib ? dlsym(lib, "AChoreographer_postFrameCallback64") : 0;
+    void *post = lib ? dlsym(lib, "AChoreographer_postFrameCallback") : 0;
+
+	if(!get_instance || (!post && !post64)) {
+	    log_info("no Choreographer, pacing frames by a timer");
+	    return mono_clock_create(DEFAULT_PERIOD);
+	}
+	if(!(cc = (struct choreographer_clock *) calloc(1, sizeof(struct choreographer_clock)))
+		|| !(cc->timer = mono_clock_create(DEFAULT_PERIOD))) {
+	    log_error("no memory for clock");
+	    free(cc);
+	    return 0;
+	}
+	cc->c.period = DEFAULT_PERIOD;
+	cc->c.now = choreographer_now;
+	cc->c.sleep = choreographer_sleep;
+	cc->c.vsync = choreographer_vsync;
+	cc->c.destroy = choreographer_destroy;
+	cc->get_instance = (void *(*)(void)) get_instance;
+	cc->post = (void (*)(void *, frame_callback, void *)) post;
+	cc->post64 = (void (*)(void *, frame_callback64, void *)) post64;
+
+    return &cc->c;
+}
+
+static void done(struct android_app *app)
+{
+    app_destroy((struct ctx *) app->userData);
+    app->userData = 0;
+#ifdef TRACING
+    trace_stop();
+#endif
+    log_flush();
+    ANativeActivity_finish(app->activity);
+}
+
+static void init_window(struct android_app *app)
+{
+    struct ctx *ctx = (struct ctx *) app->userData;
+    ANativeWindow_Buffer buffer;
+    struct surface *s;
+
+    if(ctx->surface) return;
+
+    log_info(__func__);
+    if(ANativeWindow_setBuffersGeometry(app->window, 0, 0, ctx->fmt) != 0) {
+	log_error("Failed to set buffer format");
+	done(app);
+	return;
+    }
+    if(ANativeWindow_lock(app->window, &buffer, 0) < 0) {
+	log_error("Unable to lock window buffer");
+	done(app);
+	return;
+    }
+    ANativeWindow_unlockAndPost(app->window);
+    s = window_surface_create(app, ctx->fmt);
+    if(!s || app_start(ctx, s, buffer.width, buffer.height, buffer.stride) != 0) done(app);
+}
+
+#define TOUCH_BATCH	32		/* samples of a motion event passed on, the latest ones */
+
+/* A motion event carries the samples since the last one it was batched with; they all go
+   to app_thread in one go, which is where anything is drawn for them */
+
+static int32_t handle_input(struct android_app* app, AInputEvent* event)
+{
+    struct ctx* ctx = (struct ctx*) app->userData;
+    struct touch t[TOUCH_BATCH];
+    int k, n, m = 0;
+
+    if(!ctx || AInputEvent_getType(event) != AINPUT_EVENT_TYPE_MOTION) return 0;
+    n = AMotionEvent_getHistorySize(event);
+    for(k = n > TOUCH_BATCH - 1 ? n - (TOUCH_BATCH - 1) : 0; k < n; k++, m++) {
+	t[m].x = AMotionEvent_getHistoricalX(event, 0, k);
+	t[m].y = AMotionEvent_getHistoricalY(event, 0, k);
+	t[m].t = AMotionEvent_getHistoricalEventTime(event, k);
+    }
+    t[m].x = AMotionEvent_getX(event, 0);
+    t[m].y = AMotionEvent_getY(event, 0);
+    t[m].t = AMotionEvent_getEventTime(event);	/* same clock as CLOCK_MONOTONIC */
+    app_touch(ctx, t, m + 1);
+    return 1;
+}
+
+static void handle_cmd(struct android_app* app, int32_t cmd)
+{
+    struct ctx* ctx = (struct ctx*) app->userData;
+
+    if(!ctx) return;
+    switch(cmd) {
+	case APP_CMD_INIT_WINDOW:
+	    log_info("APP_CMD_INIT_WINDOW");
+	    init_window(app);
+	    if(app->userData) app_resume(ctx);
+	    break;
+	case APP_CMD_WINDOW_REDRAW_NEEDED:
+	case APP_CMD_WINDOW_RESIZED:
+	    app_redraw(ctx);
+	    log_info("APP_CMD_WINDOW_RESIZED/REDRAW_NEEDED");
+	    break;
+	case APP_CMD_TERM_WINDOW:
+	    log_info("APP_CMD_TERM_WINDOW");
+	    app_pause(ctx);		/* the glue drops app->window as soon as this returns */
+	    break;
+	default:
+	    log_info("APP_CMD_%d", cmd);
+	    break;
+    }
+}
+
+#ifdef TESTCPP
+extern int test_cplusplus();
+#endif
+
+
+void android_main(struct android_app* app)
+{
+    struct ctx *ctx = 0;
+    struct frame_clock *clock;
+    int ident, events, dpi;
+    struct android_poll_source* source;
+    char prop_density[PROP_VALUE_MAX], prop_stats[PROP_VALUE_MAX];
+#ifdef TRACING
+    static char trace_file[PROP_VALUE_MAX];	/* e.g. /data/data/<package>/files/trace.json */
+#endif
+
+    app_dummy();
+
+#ifdef __arm__
+    log_info("starting arm code");
+#elif defined(__aarch64__)
+    log_info("starting aarch64 code");
+#else
+#error "Arch unknown, please port me"
+#endif
+
+#ifdef TESTCPP
+    test_cplusplus();
+#endif
+
+    if(__system_property_get("ro.sf.lcd_density", prop_density) < 0
+	|| sscanf(prop_density, "%d", &dpi) != 1) {
+	log_info("failed to find screen density, assuming 480");
+	dpi = 480;
+    }
+#ifdef TRACING
+    if(__system_property_get("debug.test2.trace", trace_file) > 0) trace_start(trace_file);
+#endif
+
+    ctx = app_create(dpi, WINDOW_FORMAT_RGB_565); // WINDOW_FORMAT_RGBA_8888;
+    if(!ctx) {
+    	ANativeActivity_finish(app->activity);
+	return;
+    }
+    /* e.g. "adb shell setprop debug.test2.stats 10" logs the text engine counters every 10 s */
+    if(__system_property_get("debug.test2.stats", prop_stats) > 0) ctx->stats_period = atof(prop_stats) * 1e9;
+    ctx->metrics = metrics_create(0);	/* a memfd, for test2_metrics <pid> */
+    if((clock = choreographer_clock_create())) {
+	ctx->clock->destroy(ctx->clock);
+	ctx->clock = clock;
+    }
+
+    app->onAppCmd = handle_cmd;
+    app->onInputEvent = handle_input;
+    app->userData = ctx;
+
+    while(1) {
+	while((ident = ALooper_pollAll(-1, NULL, &events, (void**)&source)) >= 0) {
+	    if(source) source->process(app, source);
+	    if(app->destroyRequested != 0) {
+		if(app->userData) {
+		    app_stop((struct ctx *) app->userData);
+		    done(app);
+		}
+		log_info("destroyed.");
+		return;
+	    }
+	}
+    }
+}
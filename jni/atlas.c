@@ -0,0 +1,374 @@
+
+#define _GNU_SOURCE		/* struct ucred */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+#include "main.h"
+
+/* Shared glyph atlas.
+   One process publishes its glyph cache for a given (face, size, dpi, subpixel phases) as a sealed
+   read-only memfd segment and hands out the descriptor over an abstract unix socket
+   whose name is derived from the key. Other processes map the segment and only rasterize
+   the glyphs it lacks. Segment layout: header, glyph table sorted by char, bitmap data.
+   Any process can reach an abstract socket, so both ends check who the other is
+   (see peer_trusted()), and a segment is only used once every glyph in it is within bounds. */
+
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING	0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS		(1024 + 9)
+#define F_GET_SEALS		(1024 + 10)
+#define F_SEAL_SEAL		0x0001
+#define F_SEAL_SHRINK		0x0002
+#define F_SEAL_GROW		0x0004
+#define F_SEAL_WRITE		0x0008
+#endif
+#define ATLAS_SEALS	(F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+
+#define ATLAS_MAGIC	0x534c5441	/* "ATLS" */
+#define ATLAS_VERSION	4
+
+struct atlas_hdr {
+    uint32_t magic, version;
+    char face[128];
+    int32_t size, dpi, phases;
+    uint32_t nglyphs;
+    uint32_t data_off;		/* offset of bitmap data */
+    uint64_t total;		/* segment size */
+};
+
+struct atlas {
+    const struct atlas_hdr *hdr;	/* read-only mapping */
+    const struct atlas_glyph *glyphs;
+    size_t size;
+    int fd;			/* memfd, kept open by the publisher only */
+    int sock;			/* rendezvous socket, publisher only */
+    pthread_t server;
+};
+
+static int atlas_memfd(const char *name, unsigned flags)
+{
+#ifdef __NR_memfd_create
+    return syscall(__NR_memfd_create, name, flags);	/* no wrapper in older bionic */
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Abstract socket name: FNV-1a hash of the key, so that equal keys meet at the same address */
+
+static socklen_t atlas_addr(struct sockaddr_un *addr, const char *face, int size, int dpi, int phases)
+{
+    uint32_t h = 2166136261u;
+    const char *s;
+    int len;
+
+	for(s = face; *s; s++) h = (h ^ (uint8_t) *s) * 16777619u;
+	h = (h ^ size) * 16777619u;
+	h = (h ^ dpi) * 16777619u;
+	h = (h ^ phases) * 16777619u;
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, APP_TAG "-atlas-%08x", h);
+
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+/* Android uids: user * AID_USER_OFFSET + app id, isolated services get app ids of their own */
+#define AID_USER_OFFSET		100000
+#define AID_ISOLATED_START	99000
+#define AID_ISOLATED_END	99999
+
+static inline int isolated_uid(uid_t uid)
+{
+    return uid % AID_USER_OFFSET >= AID_ISOLATED_START && uid % AID_USER_OFFSET <= AID_ISOLATED_END;
+}
+
+/* Whether to share a segment with the process at the other end of "sock".
+   The segment is sealed read-only and validated before use, so a peer can only ever
+   map immutable glyph data; the check keeps other apps from getting at our glyphs
+   or handing us theirs. Trusted are processes of our own uid and, on Android, the
+   isolated services of the same device user: an isolated service runs under an uid
+   of its own that tells nothing about the app that started it, so it trusts the
+   publishers of that user, and they trust it. */
+
+static int peer_trusted(int sock)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    uid_t uid = geteuid();
+	if(getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 || len != sizeof(cred)) return 0;
+	if(cred.uid == uid) return 1;
+#ifdef __ANDROID__
+	if(cred.uid / AID_USER_OFFSET == uid / AID_USER_OFFSET && (isolated_uid(cred.uid) || isolated_uid(uid))) return 1;
+#endif
+    return 0;
+}
+
+static int atlas_valid(const struct atlas_hdr *hdr, size_t size, const char *face, int size_pt, int dpi, int phases)
+{
+    const struct atlas_glyph *g = (const struct atlas_glyph *) (hdr + 1);
+    uint32_t k;
+
+	if(size < sizeof(*hdr) || hdr->magic != ATLAS_MAGIC || hdr->version != ATLAS_VERSION) return 0;
+	if(hdr->total != size || hdr->size != size_pt || hdr->dpi != dpi || hdr->phases != phases) return 0;
+	if(strncmp(hdr->face, face, sizeof(hdr->face)) != 0) return 0;
+	if(hdr->nglyphs > (size - sizeof(*hdr)) / sizeof(*g)) return 0;
+	if(hdr->data_off < sizeof(*hdr) + hdr->nglyphs * sizeof(*g) || hdr->data_off > size) return 0;
+	/* each bitmap, width bytes of rows rows pitch bytes apart, in the data area */
+	for(k = 0; k < hdr->nglyphs; k++, g++)
+	    if(g->width < 0 || g->rows < 0 || g->pitch < g->width || g->offs > size - hdr->data_off
+		|| (uint64_t) g->pitch * g->rows > size - hdr->data_off - g->offs) return 0;
+
+    return 1;
+}
+
+static struct atlas *atlas_map(int fd, const char *face, int size, int dpi, int phases)
+{
+    struct atlas *at;
+    struct stat st;
+    void *p;
+
+	if(fstat(fd, &st) != 0 || st.st_size <= 0) return 0;
+	/* refuse segments the owner could still modify under us */
+	if((fcntl(fd, F_GET_SEALS) & ATLAS_SEALS) != ATLAS_SEALS) {
+	    log_error("atlas segment not sealed");
+	    return 0;
+	}
+	p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(p == MAP_FAILED) return 0;
+	if(!atlas_valid((struct atlas_hdr *) p, st.st_size, face, size, dpi, phases)) {
+	    log_error("atlas segment for %s/%d/%d is invalid", face, size, dpi);
+	    munmap(p, st.st_size);
+	    return 0;
+	}
+	at = (struct atlas *) calloc(1, sizeof(struct atlas));
+	if(!at) {
+	    munmap(p, st.st_size);
+	    return 0;
+	}
+	at->hdr = (const struct atlas_hdr *) p;
+	at->glyphs = (const struct atlas_glyph *) (at->hdr + 1);
+	at->size = st.st_size;
+	at->fd = -1;
+	at->sock = -1;
+
+    return at;
+}
+
+/* Connect to the publisher for this key and map its segment */
+
+struct atlas *atlas_attach(const char *face, int size, int dpi, int phases)
+{
+    struct sockaddr_un addr;
+    socklen_t len = atlas_addr(&addr, face, size, dpi, phases);
+    struct atlas *at = 0;
+    char dummy;
+    struct iovec iov = { &dummy, 1 };
+    union { struct cmsghdr hdr; char buf[CMSG_SPACE(sizeof(int))]; } cbuf;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int sock, fd = -1;
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(sock < 0) return 0;
+	if(connect(sock, (struct sockaddr *) &addr, len) != 0) {
+	    log_debug("no atlas published for %s/%d/%d", face, size, dpi);
+	    close(sock);
+	    return 0;
+	}
+	if(!peer_trusted(sock)) {
+	    log_error("atlas for %s/%d/%d published by an untrusted uid, not used", face, size, dpi);
+	    close(sock);
+	    return 0;
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.buf;
+	msg.msg_controllen = sizeof(cbuf.buf);
+	if(recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) > 0) {
+	    cmsg = CMSG_FIRSTHDR(&msg);
+	    if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	close(sock);
+	if(fd < 0) {
+	    log_error("atlas publisher sent no descriptor");
+	    return 0;
+	}
+	at = atlas_map(fd, face, size, dpi, phases);
+	close(fd);	/* the mapping keeps the segment alive */
+	if(at) log_info("attached to shared atlas %s/%d/%d: %d glyphs, %d bytes",
+		face, size, dpi, at->hdr->nglyphs, (int) at->size);
+
+    return at;
+}
+
+static void *atlas_server(void *arg)
+{
+    struct atlas *at = (struct atlas *) arg;
+    char dummy = 0;
+    struct iovec iov = { &dummy, 1 };
+    union { struct cmsghdr hdr; char buf[CMSG_SPACE(sizeof(int))]; } cbuf;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int peer;
+
+	while((peer = accept(at->sock, 0, 0)) >= 0) {
+	    if(!peer_trusted(peer)) {
+		log_error("atlas: refused a process of an untrusted uid");
+		close(peer);
+		continue;
+	    }
+	    memset(&msg, 0, sizeof(msg));
+	    msg.msg_iov = &iov;
+	    msg.msg_iovlen = 1;
+	    msg.msg_control = cbuf.buf;
+	    msg.msg_controllen = sizeof(cbuf.buf);
+	    cmsg = CMSG_FIRSTHDR(&msg);
+	    cmsg->cmsg_level = SOL_SOCKET;
+	    cmsg->cmsg_type = SCM_RIGHTS;
+	    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	    memcpy(CMSG_DATA(cmsg), &at->fd, sizeof(int));
+	    if(sendmsg(peer, &msg, MSG_NOSIGNAL) < 0) log_error("atlas: sendmsg failed: %s", strerror(errno));
+	    close(peer);
+	}
+
+    return 0;
+}
+
+static int glyph_cmp(const void *a, const void *b)
+{
+    const struct atlas_glyph *ga = (const struct atlas_glyph *) a, *gb = (const struct atlas_glyph *) b;
+    if(ga->gid != gb->gid) return ga->gid < gb->gid ? -1 : 1;
+    return ga->dx - gb->dx;
+}
+
+/* Publish "n" glyphs whose bitmaps are in "data" (glyph offsets relative to it).
+   Returns the published atlas, or the one found at the rendezvous if another process won the race. */
+
+struct atlas *atlas_publish(const char *face, int size, int dpi, int phases,
+	const struct atlas_glyph *glyphs, int n, const uint8_t *data, size_t data_size)
+{
+    struct sockaddr_un addr;
+    socklen_t len = atlas_addr(&addr, face, size, dpi, phases);
+    struct atlas_hdr *hdr = MAP_FAILED;
+    struct atlas_glyph *g;
+    struct atlas *at = 0;
+    size_t total;
+    int fd = -1, sock = -1;
+
+#define fatal(fmt,args...) do { log_error(fmt,##args); goto err_exit; } while(0)
+
+	if(strlen(face) >= sizeof(hdr->face)) fatal("atlas: face name too long");
+	total = sizeof(*hdr) + n * sizeof(*glyphs) + data_size;
+
+	fd = atlas_memfd(APP_TAG "-atlas", MFD_ALLOW_SEALING);
+	if(fd < 0) fatal("atlas: memfd_create failed: %s", strerror(errno));
+	if(ftruncate(fd, total) != 0) fatal("atlas: ftruncate failed: %s", strerror(errno));
+	hdr = (struct atlas_hdr *) mmap(0, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(hdr == MAP_FAILED) fatal("atlas: mmap failed: %s", strerror(errno));
+
+	hdr->magic = ATLAS_MAGIC;
+	hdr->version = ATLAS_VERSION;
+	strcpy(hdr->face, face);
+	hdr->size = size;
+	hdr->dpi = dpi;
+	hdr->phases = phases;
+	hdr->nglyphs = n;
+	hdr->data_off = sizeof(*hdr) + n * sizeof(*glyphs);
+	hdr->total = total;
+	g = (struct atlas_glyph *) (hdr + 1);
+	memcpy(g, glyphs, n * sizeof(*glyphs));
+	qsort(g, n, sizeof(*g), glyph_cmp);
+	memcpy((uint8_t *) hdr + hdr->data_off, data, data_size);
+
+	/* the writable mapping must be gone before F_SEAL_WRITE is accepted */
+	munmap(hdr, total);
+	hdr = MAP_FAILED;
+	if(fcntl(fd, F_ADD_SEALS, ATLAS_SEALS) != 0) fatal("atlas: sealing failed: %s", strerror(errno));
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(sock < 0) fatal("atlas: socket failed: %s", strerror(errno));
+	if(bind(sock, (struct sockaddr *) &addr, len) != 0) {
+	    if(errno == EADDRINUSE) {	/* somebody else was faster */
+		close(sock);
+		close(fd);
+		return atlas_attach(face, size, dpi, phases);
+	    }
+	    fatal("atlas: bind failed: %s", strerror(errno));
+	}
+	if(listen(sock, 8) != 0) fatal("atlas: listen failed: %s", strerror(errno));
+
+	at = atlas_map(fd, face, size, dpi, phases);
+	if(!at) fatal("atlas: failed to map published segment");
+	at->fd = fd;
+	at->sock = sock;
+	if(pthread_create(&at->server, 0, atlas_server, at) != 0) {
+	    at->sock = -1;
+	    fatal("atlas: failed to start server thread");
+	}
+	log_info("published shared atlas %s/%d/%d/%d: %d glyphs, %d bytes", face, size, dpi, phases, n, (int) total);
+
+    return at;
+
+    err_exit:
+	if(hdr != MAP_FAILED) munmap(hdr, total);
+	if(sock >= 0) close(sock);
+	if(at) {
+	    at->fd = -1;
+	    atlas_detach(at);
+	}
+	if(fd >= 0) close(fd);
+    return 0;
+
+#undef fatal
+}
+
+void atlas_detach(struct atlas *at)
+{
+    if(!at) return;
+    if(at->sock >= 0) {
+	shutdown(at->sock, SHUT_RDWR);	/* wakes up accept() */
+	pthread_join(at->server, 0);
+	close(at->sock);
+    }
+    if(at->fd >= 0) close(at->fd);
+    munmap((void *) at->hdr, at->size);
+    free(at);
+}
+
+const struct atlas_glyph *atlas_lookup(const struct atlas *at, uint32_t gid, int dx)
+{
+    int lo = 0, hi = at->hdr->nglyphs - 1;
+
+	while(lo <= hi) {
+	    int mid = (lo + hi) / 2;
+	    const struct atlas_glyph *g = &at->glyphs[mid];
+	    if(g->gid == gid && g->dx == dx) return g;
+	    if(g->gid < gid || (g->gid == gid && g->dx < dx)) lo = mid + 1;
+	    else hi = mid - 1;
+	}
+
+    return 0;
+}
+
+const uint8_t *atlas_data(const struct atlas *at, const struct atlas_glyph *g)
+{
+    return (const uint8_t *) at->hdr + at->hdr->data_off + g->offs;
+}
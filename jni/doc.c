@@ -0,0 +1,506 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "main.h"
+
+/* Documents: UTF-8 text files too big to lay out whole, shown a viewport at a time.
+   The file is mapped and a thread walks it once, wrapping it at the document width the
+   way ft_get_string_metrics() would, at break opportunities (see linebreak.c), without
+   kerning. It records where each screen line starts and how wide it is. Lines are
+   published as they are found, so the start of the text can be shown while the rest is
+   indexed, and the index never moves: it is kept in chunks of DOC_CHUNK lines. Drawing
+   only lays out the lines in the viewport.
+   Advances come from the glyph caches in ft.c. FreeType belongs to the thread that draws,
+   so the indexer does not call it. It reads a table of advances instead. When it meets
+   a char the table does not have yet, it waits for doc_pump() to measure the char from the
+   drawing thread. The table starts with ASCII and Latin-1 filled in.
+   Reflow is by paragraph: wrapping starts over at each newline. A new width indexes
+   the text again from the start in the background, and doc_draw_at() wraps the
+   paragraphs in view itself until the index reaches them. Text appended to the file
+   only has the last paragraph indexed again, see doc_refresh(). */
+
+#define DOC_CHUNK	65536			/* index entries per chunk, a power of 2 */
+#define DOC_ADV_CHARS	0x30000			/* chars with a slot in the advance table, others measure as U+FFFD */
+#define DOC_SCAN_BACK	65536			/* bytes searched back for the start of a paragraph */
+
+struct doc_line {
+    uint32_t offs;		/* byte offset of the first char */
+    int32_t width;		/* pen advance of the line without trailing spaces, 26.6 */
+};
+
+struct doc {
+    struct ctx *ctx;
+    const uint8_t *data;	/* the file, mapped */
+    size_t size;
+    int fd;
+    int width;			/* wrap width in pixels */
+    atomic_short *adv;		/* advance of each char below DOC_ADV_CHARS, 26.6, -1 until measured */
+    struct doc_line **chunks;	/* line k is chunks[k / DOC_CHUNK][k % DOC_CHUNK] */
+    atomic_uint nlines;		/* lines indexed so far; the start of the one after the last is set too */
+    atomic_int done;		/* 1 once all of the text is indexed, -1 if that failed */
+    pthread_t thread;
+    int running;		/* the indexer was started and not joined yet */
+    atomic_int stop;		/* tells it to return */
+    pthread_mutex_t mutex;
+    pthread_cond_t measured;
+    uint32_t want;		/* char the indexer waits for, 0 for none */
+    char *line;			/* text of the line being drawn */
+    size_t line_size;
+};
+
+static inline struct doc_line *line_at(const struct doc *d, unsigned k)
+{
+    return &d->chunks[k / DOC_CHUNK][k % DOC_CHUNK];
+}
+
+/* Next char of d->data at "p", U+FFFD for a malformed sequence. Returns its length. */
+
+static int next_char(const struct doc *d, size_t p, uint32_t *ch)
+{
+    const uint8_t *s = d->data + p;
+    size_t left = d->size - p;
+    uint32_t c = s[0];
+    int k, n = c < 0x80 ? 1 : c < 0xc2 ? 0 : c < 0xe0 ? 2 : c < 0xf0 ? 3 : c < 0xf5 ? 4 : 0;
+
+	if(n <= 1 || n > left) {
+	    *ch = n == 1 ? c : 0xfffd;
+	    return 1;
+	}
+	c &= 0x7f >> n;
+	for(k = 1; k < n; k++) {
+	    if((s[k] & 0xc0) != 0x80) {
+		*ch = 0xfffd;
+		return k;
+	    }
+	    c = c << 6 | (s[k] & 0x3f);
+	}
+	/* overlong forms, surrogates and beyond U+10FFFF */
+	if((n == 3 && (c < 0x800 || (c >= 0xd800 && c < 0xe000))) || (n == 4 && (c < 0x10000 || c > 0x10ffff))) c = 0xfffd;
+	*ch = c;
+    return n;
+}
+
+/* What a char is measured and drawn as: controls as a space, anything else as itself */
+
+static inline uint32_t shown_char(uint32_t c)
+{
+    return c < 0x20 || c == 0x7f ? ' ' : c;
+}
+
+/* Store the advance of "c" measured in the drawing thread */
+
+static void set_advance(struct doc *d, uint32_t c, int a)
+{
+    atomic_store_explicit(&d->adv[c], a < 0 ? 0 : a > INT16_MAX ? INT16_MAX : a, memory_order_relaxed);
+}
+
+/* Advance of "c". The thread that draws ("owner" set) measures a char the table lacks
+   itself, the indexer waits for doc_pump(). -1 once the indexer is stopped. */
+
+static int advance(struct doc *d, uint32_t c, int owner)
+{
+    int a;
+	if(c >= DOC_ADV_CHARS) c = 0xfffd;
+	if((a = atomic_load_explicit(&d->adv[c], memory_order_relaxed)) >= 0) return a;
+	pthread_mutex_lock(&d->mutex);
+	if(owner) {
+	    set_advance(d, c, ft_get_advance(d->ctx, c));
+	    pthread_cond_broadcast(&d->measured);
+	} else d->want = c;
+	while((a = atomic_load_explicit(&d->adv[c], memory_order_relaxed)) < 0 && !atomic_load(&d->stop))
+	    pthread_cond_wait(&d->measured, &d->mutex);
+	pthread_mutex_unlock(&d->mutex);
+    return a;
+}
+
+/* Wrap the text from "p", where a line starts, at d->width the way wrap_line() in ft.c does:
+   returns where the next line starts and puts the width of this one in "width".
+   "lb" holds the break state at p and is moved on. -1 once the indexer is stopped. */
+
+static ssize_t break_line(struct doc *d, size_t p, struct lb_state *lb, int *width, int owner)
+{
+    size_t s = p, brk = 0;
+    struct lb_state at_p, at_brk;
+    int w = 0, wd = 0, brk_wd = 0, max = d->width << 6, n, a, opp;	/* 26.6 */
+    uint32_t c;
+
+	while(p < d->size) {
+	    at_p = *lb;
+	    n = next_char(d, p, &c);
+	    opp = lb_next(lb, c);
+	    if(lb_hard(c)) {
+		p += n;
+		if(c == '\r' && p < d->size && d->data[p] == '\n') lb_next(lb, d->data[p++]);
+		break;
+	    }
+	    if(p != s && opp == LB_ALLOW) {
+		brk = p;
+		at_brk = at_p;
+		brk_wd = wd;
+	    }
+	    if((a = advance(d, shown_char(c), owner)) < 0) return -1;
+	    if(p != s && c != ' ' && w + a > max) {	/* wrap at the last opportunity, or before this char */
+		if(brk) {
+		    p = brk;
+		    *lb = at_brk;
+		    wd = brk_wd;
+		} else *lb = at_p;
+		break;
+	    }
+	    w += a;
+	    if(c != ' ') wd = w;	/* trailing spaces hang */
+	    p += n;
+	}
+	*width = wd;
+
+    return p;
+}
+
+/* Record that line "k" is "width" wide and line k + 1 starts at "next" */
+
+static int add_line(struct doc *d, unsigned k, int width, size_t next)
+{
+    unsigned c = (k + 1) / DOC_CHUNK;
+	line_at(d, k)->width = width;
+	if(!d->chunks[c] && !(d->chunks[c] = (struct doc_line *) malloc(DOC_CHUNK * sizeof(struct doc_line)))) {
+	    log_error("no memory for the index of line %u", k + 1);
+	    return -1;
+	}
+	line_at(d, k + 1)->offs = next;
+	atomic_store_explicit(&d->nlines, k + 1, memory_order_release);
+    return 0;
+}
+
+/* Index the text from the last line indexed on, which starts a paragraph */
+
+static void *indexer(void *arg)
+{
+    struct doc *d = (struct doc *) arg;
+    unsigned k = atomic_load_explicit(&d->nlines, memory_order_relaxed);
+    size_t p = line_at(d, k)->offs;
+    ssize_t next;
+    struct lb_state lb;
+    int wd;
+
+	lb_init(&lb);
+	while(p < d->size) {
+	    if((next = break_line(d, p, &lb, &wd, 0)) < 0) return 0;	/* stopped */
+	    if(add_line(d, k++, wd, next) != 0) goto failed;
+	    p = next;
+	}
+	if(!k && add_line(d, 0, 0, 0) != 0) goto failed;	/* an empty file is an empty line */
+	atomic_store(&d->done, 1);
+	return 0;
+
+    failed:
+	atomic_store(&d->done, -1);
+	return 0;
+}
+
+/* Index from line "k" on, which starts at byte "p" at the start of a paragraph */
+
+static int start_indexer(struct doc *d, unsigned k, size_t p)
+{
+	line_at(d, k)->offs = p;
+	atomic_store_explicit(&d->nlines, k, memory_order_release);
+	atomic_store(&d->done, 0);
+	atomic_store(&d->stop, 0);
+	if(pthread_create(&d->thread, 0, indexer, d) != 0) {
+	    log_error("failed to start indexing");
+	    atomic_store(&d->done, -1);
+	    return -1;
+	}
+	d->running = 1;
+    return 0;
+}
+
+static void stop_indexer(struct doc *d)
+{
+	if(!d->running) return;
+	pthread_mutex_lock(&d->mutex);
+	atomic_store(&d->stop, 1);
+	pthread_cond_broadcast(&d->measured);
+	pthread_mutex_unlock(&d->mutex);
+	pthread_join(d->thread, 0);
+	d->running = 0;
+	d->want = 0;
+}
+
+/* Measure the char the indexer waits for. To be called by the thread that draws with
+   d->ctx, e.g. once a frame. Returns 1 if a char was measured. */
+
+int doc_pump(struct doc *d)
+{
+    uint32_t c;
+    int a;
+	pthread_mutex_lock(&d->mutex);
+	c = d->want;
+	pthread_mutex_unlock(&d->mutex);
+	if(!c) return 0;
+	a = ft_get_advance(d->ctx, c);	/* a char that fails here is not drawn either */
+	pthread_mutex_lock(&d->mutex);
+	set_advance(d, c, a);
+	d->want = 0;
+	pthread_cond_broadcast(&d->measured);
+	pthread_mutex_unlock(&d->mutex);
+    return 1;
+}
+
+/* Open "file" wrapped at "width" pixels and start indexing it */
+
+struct doc *doc_open(struct ctx *c, const char *file, int width)
+{
+    struct doc *d = (struct doc *) calloc(1, sizeof(struct doc));
+    struct stat st;
+    int k;
+
+	if(!d) {
+	    log_error("no memory for document");
+	    return 0;
+	}
+	d->ctx = c;
+	d->width = width;
+	pthread_mutex_init(&d->mutex, 0);
+	pthread_cond_init(&d->measured, 0);
+	if((d->fd = open(file, O_RDONLY)) < 0 || fstat(d->fd, &st) != 0) {
+	    log_error("failed to open %s", file);
+	    goto failed;
+	}
+	if(st.st_size >= UINT32_MAX) {
+	    log_error("%s is too big", file);
+	    goto failed;
+	}
+	d->size = st.st_size;
+	if(d->size && (d->data = (const uint8_t *) mmap(0, d->size, PROT_READ, MAP_PRIVATE, d->fd, 0)) == MAP_FAILED) {
+	    log_error("failed to map %s", file);
+	    d->data = 0;
+	    goto failed;
+	}
+	d->adv = (atomic_short *) malloc(DOC_ADV_CHARS * sizeof(atomic_short));
+	/* a line is at least a byte, and there is the start of the line after the last */
+	d->chunks = (struct doc_line **) calloc(d->size / DOC_CHUNK + 2, sizeof(struct doc_line *));
+	if(!d->adv || !d->chunks || !(d->chunks[0] = (struct doc_line *) malloc(DOC_CHUNK * sizeof(struct doc_line)))) {
+	    log_error("no memory for the index of %s", file);
+	    goto failed;
+	}
+	for(k = 0; k < DOC_ADV_CHARS; k++) atomic_init(&d->adv[k], -1);
+	for(k = 0x20; k < 0x100; k++)
+	    if(k < 0x7f || k >= 0xa0) set_advance(d, k, ft_get_advance(c, k));
+	set_advance(d, 0xfffd, ft_get_advance(c, 0xfffd));
+	if(start_indexer(d, 0, 0) != 0) goto failed;
+	return d;
+
+    failed:
+	doc_close(d);
+	return 0;
+}
+
+void doc_close(struct doc *d)
+{
+    size_t k;
+	if(!d) return;
+	stop_indexer(d);
+	if(d->fd >= 0) close(d->fd);
+	if(d->chunks) for(k = 0; k < d->size / DOC_CHUNK + 2; k++) free(d->chunks[k]);
+	free(d->chunks);
+	free((void *) d->adv);
+	free(d->line);
+	if(d->data) munmap((void *) d->data, d->size);
+	pthread_mutex_destroy(&d->mutex);
+	pthread_cond_destroy(&d->measured);
+	free(d);
+}
+
+/* Wrap at "width" pixels from now on. The index is built again from the start in the
+   background; until it reaches what is shown, doc_draw_at() wraps that itself. */
+
+int doc_set_width(struct doc *d, int width)
+{
+	if(width == d->width) return 0;
+	stop_indexer(d);
+	d->width = width;
+    return start_indexer(d, 0, 0);
+}
+
+/* Pick up text appended to the file. The last paragraph indexed may go on in it, so the
+   index is cut back to where that paragraph starts and goes on from there; the lines
+   before it stay. Returns 1 if there was new text, -1 if the file shrank or cannot be mapped. */
+
+int doc_refresh(struct doc *d)
+{
+    struct stat st;
+    const uint8_t *data;
+    struct doc_line **chunks;
+    size_t p, end, n = d->size / DOC_CHUNK + 2, grown;
+    unsigned k;
+
+	if(fstat(d->fd, &st) != 0 || (size_t) st.st_size < d->size) return -1;
+	if((size_t) st.st_size == d->size) return 0;
+	if(st.st_size >= UINT32_MAX) {
+	    log_error("document got too big");
+	    return -1;
+	}
+	stop_indexer(d);	/* before anything it reads changes */
+	grown = st.st_size / DOC_CHUNK + 2;
+	if(!(chunks = (struct doc_line **) realloc(d->chunks, grown * sizeof(struct doc_line *)))) {
+	    log_error("no memory for the index");
+	    goto resume;
+	}
+	memset(chunks + n, 0, (grown - n) * sizeof(struct doc_line *));
+	d->chunks = chunks;
+	if((data = (const uint8_t *) mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, d->fd, 0)) == MAP_FAILED) {
+	    log_error("failed to map the document");
+	    goto resume;
+	}
+	if(d->data) munmap((void *) d->data, d->size);
+	d->data = data;
+	d->size = st.st_size;
+	/* the index ends at a line start, back to the start of its paragraph */
+	end = p = line_at(d, doc_lines(d, 0))->offs;
+	while(p > 0 && d->data[p - 1] != '\n') p--;
+	k = p < end || !p ? doc_find(d, p) : doc_lines(d, 0);
+	return start_indexer(d, k, p) != 0 ? -1 : 1;
+
+    resume:	/* from where it stopped */
+	k = doc_lines(d, 0);
+	start_indexer(d, k, line_at(d, k)->offs);
+	return -1;
+}
+
+/* Lines indexed so far, and in "done" whether that is all of them (-1 if indexing failed) */
+
+unsigned doc_lines(struct doc *d, int *done)
+{
+    if(done) *done = atomic_load(&d->done);
+    return atomic_load_explicit(&d->nlines, memory_order_acquire);
+}
+
+/* Byte offset of line "k", the size of the text for the end of the last one */
+
+size_t doc_line_offset(struct doc *d, unsigned k)
+{
+    unsigned n = doc_lines(d, 0);
+    return line_at(d, k < n ? k : n)->offs;
+}
+
+/* Line holding byte "offs", by bisection of the lines indexed so far */
+
+unsigned doc_find(struct doc *d, size_t offs)
+{
+    unsigned lo = 0, hi = doc_lines(d, 0), mid;
+	if(!hi) return 0;
+	while(hi - lo > 1) {	/* line lo starts at or before offs */
+	    mid = lo + (hi - lo) / 2;
+	    if(line_at(d, mid)->offs <= offs) lo = mid;
+	    else hi = mid;
+	}
+    return lo;
+}
+
+/* Blank the viewport of "rows" lines at y and clip to it. The last line's descenders reach
+   into the row below, so that is in it too. The caller's clip goes to "clip". */
+
+static void open_view(struct doc *d, int y, int rows, struct rect *clip)
+{
+    struct ctx *c = d->ctx;
+    int k, bpp = c->fmt == WINDOW_FORMAT_RGB_565 ? 2 : 4, bottom = y + (rows + 1) * ft_get_line_height(c);
+    struct rect view = c->clip;		/* within the caller's clip */
+
+	*clip = view;
+	if(view.top < y) view.top = y;
+	if(view.bottom > bottom) view.bottom = bottom;
+	ft_set_clip(c, &view);
+	for(k = view.top; k < view.bottom; k++)
+	    memset((uint8_t *) c->buffer + (buffer_row(c, k) * c->stride + view.left) * bpp, 0, (view.right - view.left) * bpp);
+	if(view.top < view.bottom) mark_dirty(c, view.left, view.top, view.right - view.left, view.bottom - view.top);
+}
+
+/* Draw the line from byte "p" to "end" at x, y */
+
+static int draw_line(struct doc *d, size_t p, size_t end, int x, int y)
+{
+    char *s;
+    uint32_t ch;
+
+	if(3 * (end - p) + 1 > d->line_size) {	/* U+FFFD is 3 bytes, for a byte at worst */
+	    free(d->line);
+	    d->line_size = 3 * (end - p) + 1;
+	    if(!(d->line = (char *) malloc(d->line_size))) {
+		d->line_size = 0;
+		log_error("no memory for a line");
+		return -1;
+	    }
+	}
+	/* the text as the indexer measured it, well-formed for mbstowcs(), without the break ending it */
+	for(s = d->line; p < end; ) {
+	    int len = next_char(d, p, &ch);
+	    p += len;
+	    if(lb_hard(ch)) continue;
+	    ch = shown_char(ch);
+	    if(ch == 0xfffd) {
+		memcpy(s, "\xef\xbf\xbd", 3);
+		s += 3;
+	    } else if(ch < 0x80) *s++ = ch;
+	    else {
+		memcpy(s, d->data + p - len, len);
+		s += len;
+	    }
+	}
+	*s = 0;
+    return s > d->line ? ft_render_string(d->ctx, d->line, x, y, 0) : 0;
+}
+
+/* Draw "rows" lines from line "first" on at x, y, a line height apart, over what was there.
+   Lines not indexed yet are left blank. */
+
+int doc_draw(struct doc *d, unsigned first, int x, int y, int rows)
+{
+    int k, height = ft_get_line_height(d->ctx);
+    unsigned n = doc_lines(d, 0);
+    struct rect clip;
+
+	open_view(d, y, rows, &clip);
+	for(k = 0; k < rows && first + k < n; k++)
+	    if(draw_line(d, line_at(d, first + k)->offs, line_at(d, first + k + 1)->offs, x, y + k * height) != 0) break;
+	ft_set_clip(d->ctx, &clip);
+    return k < rows && first + k < n ? -1 : 0;
+}
+
+/* Draw "rows" lines from the one holding byte "offs" on, like doc_draw(). Offsets stay put
+   when the width changes, line numbers do not. Where the index does not reach yet, the
+   paragraphs in view are wrapped here and now, from the start of the one holding offs;
+   one longer than DOC_SCAN_BACK before offs is taken to start there. */
+
+int doc_draw_at(struct doc *d, size_t offs, int x, int y, int rows)
+{
+    int j, k, wd, height = ft_get_line_height(d->ctx);
+    unsigned n = doc_lines(d, 0);
+    size_t p, start[rows + 1];
+    ssize_t next;
+    struct lb_state lb;
+    struct rect clip;
+
+	if(offs > d->size) offs = d->size;
+	if(offs < line_at(d, n)->offs || atomic_load(&d->done) == 1) return doc_draw(d, doc_find(d, offs), x, y, rows);
+	for(p = offs; p > 0 && offs - p < DOC_SCAN_BACK && d->data[p - 1] != '\n'; p--) ;
+	while(p < offs && (d->data[p] & 0xc0) == 0x80) p++;	/* not in the middle of a char */
+	lb_init(&lb);
+	/* lines up to the one holding offs, then the ones in view */
+	while((next = break_line(d, p, &lb, &wd, 1)) >= 0 && (size_t) next <= offs && (size_t) next < d->size) p = next;
+	for(start[0] = p, k = 0; k < rows && next >= 0 && p < d->size; k++) {
+	    if(k && (next = break_line(d, p, &lb, &wd, 1)) < 0) break;
+	    start[k + 1] = p = next;
+	}
+	open_view(d, y, rows, &clip);
+	for(j = 0; j < k; j++)
+	    if(draw_line(d, start[j], start[j + 1], x, y + j * height) != 0) break;
+	ft_set_clip(d->ctx, &clip);
+    return j < k ? -1 : 0;
+}
@@ -1,19 +1,21 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <elf.h>
-#include <android/log.h>
-
-#define TAG_NAME	"test2:fake_dlfcn"
-
-#define log_info(fmt,args...) __android_log_print(ANDROID_LOG_INFO, TAG_NAME, (const char *) fmt, ##args)
-#define log_err(fmt,args...) __android_log_print(ANDROID_LOG_ERROR, TAG_NAME, (const char *) fmt, ##args)
 
+#define LOG_TAG		"test2:fake_dlfcn"
 #ifdef LOG_DBG
-#define log_dbg log_info
-#else
-#define log_dbg(...)
+#define LOG_LEVEL	LOG_LEVEL_DEBUG
 #endif
+#include "log.h"
+#include "trace.h"
+#include "metrics.h"
+
+#define log_err		log_error
+#define log_dbg		log_debug
 
 #ifdef __arm__
 #define Elf_Ehdr Elf32_Ehdr
@@ -57,6 +59,8 @@ void *fake_dlopen(const char *libpath, int flags)
     int k, fd = -1, found = 0;
     void *shoff;
     Elf_Ehdr *elf = MAP_FAILED;
+    uint64_t t0 = metrics_ns();
+    TRACE_SCOPE(__func__);
 
 #define fatal(fmt,args...) do { log_err(fmt,##args); goto err_exit; } while(0)
 
@@ -134,6 +138,7 @@ void *fake_dlopen(const char *libpath, int flags)
 #undef fatal
 
 	log_dbg("%s: ok, dynsym = %p, dynstr = %p", libpath, ctx->dynsym, ctx->dynstr);
+	metrics_dlopen(metrics_ns() - t0, 0);
 	
     return ctx;
 
@@ -141,6 +146,7 @@ void *fake_dlopen(const char *libpath, int flags)
 	if(fd >= 0) close(fd);
 	if(elf != MAP_FAILED) munmap(elf, size);
 	fake_dlclose(ctx);
+	metrics_dlopen(metrics_ns() - t0, 1);
     return 0;
 }
 
@@ -1,4 +1,8 @@
-#include <jni.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
 #include <errno.h>
 #include <dlfcn.h>
 #include <ctype.h>
@@ -7,45 +11,113 @@
 #ifdef HANDLE_UNICODE
 #include <wchar.h>
 #endif
-#include <android_native_app_glue.h>
 
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <elf.h>
+#include <math.h>
+#include <time.h>
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
+#include FT_OUTLINE_H
 
 #include "main.h"
 
 struct bitmap {
-#ifdef HANDLE_UNICODE
-   FT_ULong c;
-#else
-   char c;
-#endif
+   uint32_t key;	/* face index << KEY_FACE_SHIFT | glyph index */
+   int dx;		/* subpixel offset it was rendered at, 26.6 */
    int width, rows, pitch;
-   int left, top, advance;
+   int left, top, advance;	/* advance in 26.6 */
    uint8_t *buffer;	
+#ifdef SHARED_ATLAS
+   int shared;		/* buffer lives in the shared atlas segment */
+#endif
    struct bitmap *next;
 };
 
+/* Glyph caches are hash tables keyed by glyph key and offset, chained through bitmap->next */
+struct glyph_cache {
+    struct bitmap **buckets;
+    int size, count;
+    size_t bytes;		/* of its entries and the bitmaps they own */
+};
+
+/* Hot range of the kerning matrix: printable ASCII and basic Cyrillic */
+#define KERN_HOT	192
+
+struct kern_pair {
+    uint64_t key;		/* left << 32 | right, 0 if the slot is free */
+    int32_t  val;
+};
+
+struct glyph_advance {
+    uint32_t key;		/* glyph key + 1, 0 if the slot is free */
+    int32_t  bmp, sdf;		/* advance of its bitmap and of its distance field at the face size, 26.6 */
+};
+
+/* Two-level table of glyph indices for the chars a face maps, one page per 256 chars.
+   Page 0 maps nothing, so a zero index also tells that the face lacks the char. */
+struct cmap {
+    uint16_t top[0x110000 >> 8];
+    uint16_t (*pages)[256];
+    int npages;
+};
+
+struct fallback {
+    char *fname;
+    FT_Face face;		/* opened when a char first needs it */
+    struct cmap *cmap;
+    int failed;			/* could not be opened */
+};
+
 struct ft_ctx {
     void *ftlib;		/* handle to libft2.so */
+    atomic_ullong *counters;	/* of the struct ctx, see ft_get_stats() */
     FT_Library  library;	/* ft2 initialised */
     FT_Face face;		/* current face for output */
+    struct cmap *cmap;		/* its chars to glyph indices */
+    struct fallback *fallback;	/* faces tried in order for chars it lacks */
+    int  nfallback;
     int	 fsize;			/* its point size */	
+    int  dpi;
     int  height;		/* baseline-to-baseline distance in pixels */	
     int  maxwd;			/* width of widest character in face */
-    struct bitmap *bmp_cache;
+    int  phases;		/* horizontal glyph positions per pixel, 1 = whole pixels */
+    struct glyph_cache bmp_cache;
+    int  sdf_size;		/* point size to scale to in SDF mode, 0 if off */
+    struct glyph_cache sdf_cache;	/* distance fields rendered at fsize, advance in 26.6 */
+    int  kerning;		/* apply pair kerning */
+    int16_t *kern_hot;		/* KERN_HOT x KERN_HOT matrix of adjustments, 26.6 */
+    uint8_t kern_rows[KERN_HOT / 8];	/* matrix rows filled in so far */
+    struct kern_pair *kern_map;	/* memoized adjustments for other pairs */
+    int  kern_size, kern_used;
+    struct glyph_advance *adv_map;	/* advances of the glyphs looked up, see key_advance() */
+    int  adv_size, adv_used;
+    char *fname;		/* current face file */
+#ifdef SHARED_ATLAS
+    struct atlas *atlas;	/* shared glyphs for fname/fsize/dpi/phases */
+#endif
+#ifdef SHAPING
+    struct shaper *shaper;	/* HarfBuzz for fname/fsize, null if unavailable */
+    int  shaping;		/* shape text with it */
+    struct shaped_glyph *para;	/* glyphs of the paragraph laid out, in logical order */
+    int  para_size;
+    int  *order;		/* display order of a line of them, see line_order() */
+    int  order_size;
+#endif
 #define ADD_FUNC(A) typeof(&A) A
 #include "ft_functions.inc"
 };
 
+static const char *default_fallbacks[] = DEFAULT_FALLBACKS;
+
 int ft_init(struct ctx *c) 
 {
     struct ft_ctx *ctx;
+    int k;
+    TRACE_SCOPE(__func__);
 
     if(c->fctx) {	
 	log_error("initialised already");
@@ -57,6 +129,12 @@ int ft_init(struct ctx *c)
 	return -1;
     }	
     c->fctx = ctx;
+    ctx->counters = c->counters;
+    ctx->phases = SUBPIXEL_PHASES;
+    ctx->kerning = 1;
+#ifdef SHAPING
+    ctx->shaping = 1;
+#endif
 
 #ifdef __arm__
     ctx->ftlib = fake_dlopen("/system/lib/libft2.so", RTLD_NOW);
@@ -87,22 +165,276 @@ int ft_init(struct ctx *c)
 	log_error("failed to set default face " DEFAULT_FACE);
 	return -1;
     }	
+    for(k = 0; default_fallbacks[k]; k++) ft_add_fallback(c, default_fallbacks[k]);
     log_info("ft_init: success");
     return 0;
 }
 
+static inline uint64_t clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Glyph caches */
+
+static inline unsigned cache_slot(const struct glyph_cache *cache, uint32_t key, int dx)
+{
+    return ((key ^ (uint32_t) dx << 26) * 2654435761u) >> 8 & (cache->size - 1);
+}
+
+static struct bitmap *cache_find(const struct glyph_cache *cache, uint32_t key, int dx)
+{
+    struct bitmap *bmp;
+	if(!cache->size) return 0;
+	for(bmp = cache->buckets[cache_slot(cache, key, dx)]; bmp; bmp = bmp->next)
+	    if(bmp->key == key && bmp->dx == dx) return bmp;
+    return 0;
+}
+
+/* Bytes "bmp" takes up in a cache */
+
+static inline size_t bitmap_bytes(const struct bitmap *bmp)
+{
+#ifdef SHARED_ATLAS
+    if(bmp->shared) return sizeof(struct bitmap);
+#endif
+    return sizeof(struct bitmap) + bmp->pitch * bmp->rows;
+}
+
+/* Free "bmp" and its buffer, unless that is in the shared atlas */
+
+static void bitmap_free(struct bitmap *bmp)
+{
+#ifdef SHARED_ATLAS
+    if(!bmp->shared)
+#endif
+    free(bmp->buffer);
+    free(bmp);
+}
+
+/* Insert "bmp", rehashing into twice the buckets once there are more entries than buckets.
+   Returns -1 when there is no memory for the first buckets; "bmp" is then still the caller's. */
+
+static int cache_add(struct ft_ctx *ctx, struct glyph_cache *cache, struct bitmap *bmp)
+{
+    unsigned slot;
+	if(cache->count >= cache->size) {
+	    int k, size = cache->size ? cache->size * 2 : 256;
+	    struct bitmap **buckets = (struct bitmap **) calloc(size, sizeof(struct bitmap *));
+	    if(buckets) {
+		struct glyph_cache grown = { buckets, size, cache->count, cache->bytes };
+		for(k = 0; k < cache->size; k++) {
+		    struct bitmap *b, *next;
+		    for(b = cache->buckets[k]; b; b = next) {
+			next = b->next;
+			slot = cache_slot(&grown, b->key, b->dx);
+			b->next = buckets[slot];
+			buckets[slot] = b;
+		    }
+		}
+		free(cache->buckets);
+		*cache = grown;
+	    } else if(!cache->size) {
+		log_error("no memory for glyph cache");
+		return -1;
+	    }	/* otherwise just let the chains get longer */
+	}
+	slot = cache_slot(cache, bmp->key, bmp->dx);
+	bmp->next = cache->buckets[slot];
+	cache->buckets[slot] = bmp;
+	cache->count++;
+	cache->bytes += bitmap_bytes(bmp);
+	stat_add(ctx->counters, FT_STAT_GLYPH_ENTRIES, 1);
+	stat_add(ctx->counters, FT_STAT_GLYPH_BYTES, bitmap_bytes(bmp));
+    return 0;
+}
+
+static void cache_flush(struct ft_ctx *ctx, struct glyph_cache *cache)
+{
+    struct bitmap *bmp, *next_bmp;
+    int k;
+	stat_add(ctx->counters, FT_STAT_GLYPH_EVICTIONS, cache->count);
+	stat_add(ctx->counters, FT_STAT_GLYPH_ENTRIES, -(unsigned long long) cache->count);
+	stat_add(ctx->counters, FT_STAT_GLYPH_BYTES, -(unsigned long long) cache->bytes);
+	for(k = 0; k < cache->size; k++)
+	    for(bmp = cache->buckets[k]; bmp; bmp = next_bmp) {
+		next_bmp = bmp->next;
+		bitmap_free(bmp);
+	    }
+	free(cache->buckets);
+	memset(cache, 0, sizeof(*cache));
+}
+
+static void flush_cache(struct ft_ctx *ctx)
+{
+	cache_flush(ctx, &ctx->sdf_cache);
+	free(ctx->kern_hot);
+	free(ctx->kern_map);
+	ctx->kern_hot = 0;
+	ctx->kern_map = 0;
+	ctx->kern_size = ctx->kern_used = 0;
+	memset(ctx->kern_rows, 0, sizeof(ctx->kern_rows));
+	free(ctx->adv_map);
+	ctx->adv_map = 0;
+	ctx->adv_size = ctx->adv_used = 0;
+	cache_flush(ctx, &ctx->bmp_cache);
+#ifdef SHARED_ATLAS
+	atlas_detach(ctx->atlas);
+	ctx->atlas = 0;
+#endif
+}
+
+/* Char to glyph mapping and font fallback.
+   The Unicode cmap of each face is walked once when the face is opened into a table of
+   glyph indices, so finding the glyph for a char takes two loads instead of a charmap lookup,
+   and chars that share a glyph share its cache entries, the glyph caches being keyed by glyph.
+   Fallback faces are only opened once a char missing from all the faces before them shows up.
+   The face index is kept in bits 24-30 of glyph cache keys, 0 being the current face. */
+
+#define KEY_FACE_SHIFT	24
+#define KEY_GLYPH	0xffffffu
+
+static void free_cmap(struct cmap *cmap)
+{
+    if(!cmap) return;
+    free(cmap->pages);
+    free(cmap);
+}
+
+static struct cmap *build_cmap(struct ft_ctx *ctx, FT_Face face)
+{
+    struct cmap *cmap = (struct cmap *) calloc(1, sizeof(struct cmap));
+    FT_ULong c;
+    FT_UInt gid;
+    int size = 16;
+
+	if(!cmap || !(cmap->pages = calloc(size, sizeof(*cmap->pages)))) {
+	    log_error("no memory for cmap");
+	    free(cmap);
+	    return 0;
+	}
+	cmap->npages = 1;
+	for(c = ctx->FT_Get_First_Char(face, &gid); gid; c = ctx->FT_Get_Next_Char(face, c, &gid)) {
+	    if(c >= 0x110000 || gid > 0xffff) continue;
+	    if(!cmap->top[c >> 8]) {
+		if(cmap->npages == size) {
+		    void *pages = realloc(cmap->pages, 2 * size * sizeof(*cmap->pages));
+		    if(!pages) {
+			log_error("no memory for cmap");
+			free_cmap(cmap);
+			return 0;
+		    }
+		    cmap->pages = pages;
+		    size *= 2;
+		}
+		memset(cmap->pages[cmap->npages], 0, sizeof(*cmap->pages));
+		cmap->top[c >> 8] = cmap->npages++;
+	    }
+	    cmap->pages[cmap->top[c >> 8]][c & 0xff] = gid;
+	}
+	log_debug("cmap: %d pages, %d bytes", cmap->npages,
+		(int) (sizeof(struct cmap) + cmap->npages * sizeof(*cmap->pages)));
+
+    return cmap;
+}
+
+/* Glyph index of "c", 0 if the face lacks it */
+
+static inline FT_UInt cmap_lookup(const struct cmap *cmap, FT_ULong c)
+{
+    return cmap && c < 0x110000 ? cmap->pages[cmap->top[c >> 8]][c & 0xff] : 0;
+}
+
+static int open_fallback(struct ft_ctx *ctx, struct fallback *fb)
+{
+	if(ctx->FT_New_Face(ctx->library, fb->fname, 0, &fb->face) != 0) {
+	    log_error("failed to open fallback face %s", fb->fname);
+	    fb->face = 0;
+	    fb->failed = 1;
+	    return -1;
+	}
+	if(ctx->FT_Set_Char_Size(fb->face, ctx->fsize * 64, 0, ctx->dpi, ctx->dpi) != 0) {
+	    log_error("failed to set face size %d for %s", ctx->fsize, fb->fname);
+	    ctx->FT_Done_Face(fb->face);
+	    fb->face = 0;
+	    fb->failed = 1;
+	    return -1;
+	}
+	ctx->FT_Select_Charmap(fb->face, FT_ENCODING_UNICODE);
+	fb->cmap = build_cmap(ctx, fb->face);
+	log_info("fallback face %s opened", fb->fname);
+
+    return 0;
+}
+
+/* Glyph cache key for char "c": the first face in the chain that has it and its glyph there.
+   Zero (.notdef of the current face) if none has it. */
+
+static uint32_t glyph_key(struct ft_ctx *ctx, FT_ULong c)
+{
+    FT_UInt gid = cmap_lookup(ctx->cmap, c);
+    int k;
+	if(gid) return gid;
+	for(k = 0; k < ctx->nfallback; k++) {
+	    struct fallback *fb = &ctx->fallback[k];
+	    if(!fb->face && (fb->failed || open_fallback(ctx, fb) != 0)) continue;
+	    if((gid = cmap_lookup(fb->cmap, c))) return gid | (uint32_t) (k + 1) << KEY_FACE_SHIFT;
+	}
+    return 0;
+}
+
+static inline FT_Face key_face(struct ft_ctx *ctx, uint32_t key)
+{
+    int k = (key >> KEY_FACE_SHIFT) & 0x7f;
+    return k ? ctx->fallback[k - 1].face : ctx->face;
+}
+
+/* Append "file" to the chain of faces tried for chars the current one lacks */
+
+int ft_add_fallback(struct ctx *c, const char *file)
+{
+    struct ft_ctx *ctx = c->fctx;
+    struct fallback *fb;
+	if(ctx->nfallback == 0x7f) return -1;
+	fb = (struct fallback *) realloc(ctx->fallback, (ctx->nfallback + 1) * sizeof(struct fallback));
+	if(!fb) {
+	    log_error("no memory");
+	    return -1;
+	}
+	ctx->fallback = fb;
+	fb += ctx->nfallback;
+	memset(fb, 0, sizeof(*fb));
+	fb->fname = strdup(file);
+	if(!fb->fname) {
+	    log_error("no memory");
+	    return -1;
+	}
+	ctx->nfallback++;
+
+    return 0;
+}
+
 void ft_quit(struct ctx *c)
 {
     struct ft_ctx *ctx = c->fctx;
+    int k;
     if(!ctx) return;
-    if(ctx->bmp_cache) {
-	struct bitmap *bmp, *next_bmp;
-	for(bmp = ctx->bmp_cache; bmp; bmp = next_bmp) {
-	    next_bmp = bmp->next;
-	    free(bmp->buffer);
-	    free(bmp);
-	}
+    flush_cache(ctx);
+#ifdef SHAPING
+    shaper_destroy(ctx->shaper);
+    free(ctx->para);
+    free(ctx->order);
+#endif
+    free(ctx->fname);
+    for(k = 0; k < ctx->nfallback; k++) {
+	if(ctx->fallback[k].face) ctx->FT_Done_Face(ctx->fallback[k].face);
+	free_cmap(ctx->fallback[k].cmap);
+	free(ctx->fallback[k].fname);
     }
+    free(ctx->fallback);
+    free_cmap(ctx->cmap);
     if(ctx->FT_Done_Face && ctx->face) ctx->FT_Done_Face(ctx->face);	
     if(ctx->FT_Done_FreeType && ctx->library) ctx->FT_Done_FreeType(ctx->library);
     if(ctx->ftlib) fake_dlclose(ctx->ftlib);
@@ -116,6 +448,11 @@ void ft_quit(struct ctx *c)
 int ft_set_face(struct ctx *c, const char *new_face, int new_size)
 {
     struct  ft_ctx *ctx = c->fctx;
+    int k;
+    TRACE_SCOPE(__func__);
+    flush_cache(ctx);	/* bitmaps are only valid for the face and size they were rendered with */
+    free_cmap(ctx->cmap);
+    ctx->cmap = 0;
     if(ctx->face) ctx->FT_Done_Face(ctx->face);
     if(ctx->FT_New_Face(ctx->library, new_face, 0, &ctx->face) != 0) {
 	log_error("failed to open face %s", new_face);
@@ -129,6 +466,10 @@ int ft_set_face(struct ctx *c, const char *new_face, int new_size)
 #ifdef HANDLE_UNICODE
     ctx->FT_Select_Charmap(ctx->face, FT_ENCODING_UNICODE);	
 #endif
+    ctx->dpi = c->dpi;
+    ctx->cmap = build_cmap(ctx, ctx->face);
+    for(k = 0; k < ctx->nfallback; k++)	/* their cmaps stay valid, just follow the size */
+	if(ctx->fallback[k].face) ctx->FT_Set_Char_Size(ctx->fallback[k].face, ctx->fsize * 64, 0, c->dpi, c->dpi);
     log_debug("%08lX/%08lX u_p_EM %d, bbox %ld-%ld x %ld-%ld, asc=%d desc=%d, ht=%d",
 	ctx->face->face_flags,
 	ctx->face->style_flags,
@@ -140,29 +481,127 @@ int ft_set_face(struct ctx *c, const char *new_face, int new_size)
     ctx->height = glyph2screen(ctx->face->height);
     ctx->maxwd = glyph2screen(ctx->face->max_advance_width);
 
+    free(ctx->fname);
+    ctx->fname = strdup(new_face);
+    if(!ctx->fname) {
+	log_error("no memory");
+	return -1;
+    }
+#ifdef SHARED_ATLAS
+    ctx->atlas = atlas_attach(ctx->fname, ctx->fsize, c->dpi, ctx->phases);
+#endif
+#ifdef SHAPING
+    shaper_destroy(ctx->shaper);
+    ctx->shaper = shaper_create(ctx->fname, ctx->fsize * 64 * c->dpi / 72);
+#endif
     return 0;
 }
 
+/* Statistics */
+
+const char *const ft_stat_names[FT_STATS] = {
+    "glyph_hits", "glyph_misses", "glyph_evictions", "glyph_entries", "glyph_bytes",
+    "rasterized", "raster_ns", "strings_measured", "strings_rendered",
+    "pixels_565", "pixels_8888", "scroll_bytes", "presents", "present_bytes"
+};
+
+void ft_get_stats(struct ctx *c, struct ft_stats *st)
+{
+    int k;
+	for(k = 0; k < FT_STATS; k++) st->n[k] = atomic_load_explicit(&c->counters[k], memory_order_relaxed);
+}
+
+int ft_format_stats(const struct ft_stats *st, char *buf, size_t size)
+{
+    int k, len = 0, n;
+	if(size) buf[0] = 0;
+	for(k = 0; k < FT_STATS && len < (int) size; k++) {
+	    n = snprintf(buf + len, size - len, "%s%s=%llu", k ? " " : "", ft_stat_names[k], st->n[k]);
+	    if(n < 0) return -1;
+	    len += n;
+	}
+    return len < (int) size ? len : (int) size - 1;
+}
+
 /* Baseline-to-baseline distance in pixels for a given font and given screen dpi */
 int ft_get_line_height(struct ctx *c)
 { 
-    return c && c->fctx ? c->fctx->height : 0;	
+    if(!c || !c->fctx) return 0;
+    if(c->fctx->sdf_size) return c->fctx->height * c->fctx->sdf_size / c->fctx->fsize;
+    return c->fctx->height;	
+}
+
+/* Load the glyph for cache key "key" into the glyph slot of its face */
+
+static FT_GlyphSlot load_glyph(struct ft_ctx *ctx, uint32_t key, FT_Int32 flags)
+{
+    FT_Face face = key_face(ctx, key);
+    return ctx->FT_Load_Glyph(face, key & KEY_GLYPH, flags) ? 0 : face->glyph;
 }
 
-/* Return the bitmap cached for "c". If not in cache, first render and cache it. */
+/* Return the bitmap cached for glyph key "c" shifted right by "dx" (26.6). If not in cache, first render and cache it. 
+   With subpixel positioning the advance is the unhinted one so that the pen does not accumulate rounding errors. */
 
-static struct bitmap *get_char_bitmap(struct ft_ctx *ctx, FT_ULong c)
+static struct bitmap *get_char_bitmap(struct ft_ctx *ctx, uint32_t c, int dx)
 {
-    FT_GlyphSlot slot = ctx->face->glyph;
-    FT_Bitmap *bitmap = &slot->bitmap;
-    struct bitmap *bmp = ctx->bmp_cache, *last = 0;	
+    FT_GlyphSlot slot;
+    FT_Bitmap *bitmap;
+    struct bitmap *bmp = cache_find(&ctx->bmp_cache, c, dx);
+    uint64_t t;
 
-	for(bmp = ctx->bmp_cache; bmp; bmp = bmp->next) {
-	    if(bmp->c == c) return bmp; /* cache hit */
-	    last = bmp;
+	if(bmp) {	/* cache hit */
+	    TRACE_COUNT("glyph hits");
+	    stat_add(ctx->counters, FT_STAT_GLYPH_HITS, 1);
+	    return bmp;
 	}
-	if(ctx->FT_Load_Char(ctx->face, c, FT_LOAD_RENDER) != 0) {
-	    log_error("error rendering bitmap for char %ld", c);	
+	TRACE_COUNT("glyph misses");
+	stat_add(ctx->counters, FT_STAT_GLYPH_MISSES, 1);
+	TRACE_SCOPE("glyph miss");
+#ifdef SHARED_ATLAS
+	if(ctx->atlas && !(c >> KEY_FACE_SHIFT)) {	/* the atlas only has the current face */
+	    const struct atlas_glyph *g = atlas_lookup(ctx->atlas, c, dx);
+	    if(g) {	/* only the descriptor is private, bitmap stays in the shared segment */
+		bmp = (struct bitmap *) calloc(1, sizeof(struct bitmap));
+		if(!bmp) {
+		    log_error("no memory for bitmap");	
+		    return 0;
+		}
+		bmp->key = c;
+		bmp->dx = dx;
+		bmp->width = g->width;
+		bmp->rows = g->rows;
+		bmp->pitch = g->pitch;
+		bmp->left = g->left;
+		bmp->top = g->top;
+		bmp->advance = g->advance;
+		bmp->buffer = (uint8_t *) atlas_data(ctx->atlas, g);
+		bmp->shared = 1;
+		if(cache_add(ctx, &ctx->bmp_cache, bmp) != 0) {
+		    bitmap_free(bmp);	/* leaves the shared bitmap alone */
+		    return 0;
+		}
+		return bmp;
+	    }
+	}
+#endif
+	t = clock_ns();
+	if(ctx->phases > 1) {
+	    if(!(slot = load_glyph(ctx, c, FT_LOAD_DEFAULT))) {
+		log_error("error loading glyph %08x", c);	
+		return 0;
+	    }
+	    if(dx && slot->format == FT_GLYPH_FORMAT_OUTLINE) ctx->FT_Outline_Translate(&slot->outline, dx, 0);
+	    if(ctx->FT_Render_Glyph(slot, FT_RENDER_MODE_NORMAL) != 0) {
+		log_error("error rendering glyph %08x", c);	
+		return 0;
+	    }
+	} else if(!(slot = load_glyph(ctx, c, FT_LOAD_RENDER))) {
+	    log_error("error rendering glyph %08x", c);	
+	    return 0;
+	}
+	bitmap = &slot->bitmap;
+	if(bitmap->pixel_mode != FT_PIXEL_MODE_GRAY) {
+	    log_error("unsupported pixel mode %d for glyph %08x", bitmap->pixel_mode, c);
 	    return 0;
 	}
 	bmp = (struct bitmap *) calloc(1, sizeof(struct bitmap));
@@ -178,36 +617,907 @@ static struct bitmap *get_char_bitmap(struct ft_ctx *ctx, FT_ULong c)
 	    return 0;
 	}
 	memcpy(bmp->buffer, bitmap->buffer, bitmap->pitch * bitmap->rows);
-	bmp->c = c;
+	bmp->key = c;
+	bmp->dx = dx;
 	bmp->width = bitmap->width;
 	bmp->rows = bitmap->rows;
 	bmp->pitch = bitmap->pitch;
 	bmp->left = slot->bitmap_left;
 	bmp->top = slot->bitmap_top;
-	bmp->advance = (slot->advance.x >> 6);
+	bmp->advance = ctx->phases > 1 ? (slot->linearHoriAdvance + 512) >> 10 : slot->advance.x;
+	if(cache_add(ctx, &ctx->bmp_cache, bmp) != 0) {
+	    bitmap_free(bmp);
+	    return 0;
+	}
+	stat_add(ctx->counters, FT_STAT_RASTERIZED, 1);
+	stat_add(ctx->counters, FT_STAT_RASTER_NS, clock_ns() - t);
+
+    return bmp;
+}
+
+/* Signed distance fields.
+   In SDF mode each glyph is rendered once at the face size set by ft_set_face() and
+   converted to a distance field with SDF_SPREAD pixels of range on each side of the outline.
+   Strings are then drawn at sdf_size points by resampling the field, so changing
+   the size needs no FreeType calls once the glyphs are cached. */
+
+#define SDF_SPREAD	6
+#define SDF_INF		1e20f
 
-	if(last) last->next = bmp;
-	else ctx->bmp_cache = bmp;
+/* Felzenszwalb & Huttenlocher squared distance transform of "n" samples of f, stride apart */
+
+static void edt_1d(float *f, int n, int stride, float *d, int *v, float *z)
+{
+    int k = 0, q;
+    float s;
+
+	v[0] = 0;
+	z[0] = -SDF_INF;
+	z[1] = SDF_INF;
+	for(q = 1; q < n; q++) {
+	    do {
+		int p = v[k];
+		s = ((f[q * stride] + q * q) - (f[p * stride] + p * p)) / (2 * q - 2 * p);
+	    } while(s <= z[k] && --k >= 0);
+	    k++;
+	    v[k] = q;
+	    z[k] = s;
+	    z[k + 1] = SDF_INF;
+	}
+	for(k = 0, q = 0; q < n; q++) {
+	    while(z[k + 1] < q) k++;
+	    d[q] = (q - v[k]) * (q - v[k]) + f[v[k] * stride];
+	}
+	for(q = 0; q < n; q++) f[q * stride] = d[q];
+}
+
+static void edt_2d(float *f, int w, int h, float *d, int *v, float *z)
+{
+    int x, y;
+	for(x = 0; x < w; x++) edt_1d(f + x, h, w, d, v, z);
+	for(y = 0; y < h; y++) edt_1d(f + y * w, w, 1, d, v, z);
+}
+
+/* Return the distance field cached for glyph key "c". If not in cache, first render and cache it. */
+
+static struct bitmap *get_char_sdf(struct ft_ctx *ctx, uint32_t c)
+{
+    FT_GlyphSlot slot;
+    FT_Bitmap *bitmap;
+    struct bitmap *bmp;
+    int x, y, w, h, n;
+    float *outer, *inner, *d, *z;
+    int *v;
+    uint64_t t;
+
+	if((bmp = cache_find(&ctx->sdf_cache, c, 0))) {	/* cache hit */
+	    stat_add(ctx->counters, FT_STAT_GLYPH_HITS, 1);
+	    return bmp;
+	}
+	stat_add(ctx->counters, FT_STAT_GLYPH_MISSES, 1);
+	t = clock_ns();
+	if(!(slot = load_glyph(ctx, c, FT_LOAD_RENDER))) {
+	    log_error("error rendering glyph %08x", c);	
+	    return 0;
+	}
+	bitmap = &slot->bitmap;
+	if(bitmap->pixel_mode != FT_PIXEL_MODE_GRAY) {
+	    log_error("unsupported pixel mode %d for glyph %08x", bitmap->pixel_mode, c);
+	    return 0;
+	}
+	if(bitmap->pitch < 0) {
+	    log_error("fonts with negative pitch not supported");
+	    return 0;
+	}
+	w = bitmap->width + 2 * SDF_SPREAD;
+	h = bitmap->rows + 2 * SDF_SPREAD;
+	n = w > h ? w : h;
+	bmp = (struct bitmap *) calloc(1, sizeof(struct bitmap));
+	outer = (float *) malloc(w * h * sizeof(float));	/* squared distance to the nearest inside pixel */
+	inner = (float *) malloc(w * h * sizeof(float));	/* and to the nearest outside one */
+	d = (float *) malloc(n * sizeof(float));
+	z = (float *) malloc((n + 1) * sizeof(float));
+	v = (int *) malloc(n * sizeof(int));
+	if(bmp) bmp->buffer = (uint8_t *) malloc(w * h);
+	if(!bmp || !bmp->buffer || !outer || !inner || !d || !z || !v) {
+	    log_error("no memory for distance field");
+	    if(bmp) free(bmp->buffer);
+	    free(bmp);
+	    bmp = 0;
+	    goto done;
+	}
+	for(y = 0; y < h; y++)
+	    for(x = 0; x < w; x++) {
+		int bx = x - SDF_SPREAD, by = y - SDF_SPREAD;
+		int cov = (bx >= 0 && by >= 0 && bx < bitmap->width && by < bitmap->rows) ?
+			bitmap->buffer[bx + by * bitmap->pitch] : 0;
+		outer[x + y * w] = cov >= 128 ? 0 : SDF_INF;
+		inner[x + y * w] = cov >= 128 ? SDF_INF : 0;
+	    }
+	edt_2d(outer, w, h, d, v, z);
+	edt_2d(inner, w, h, d, v, z);
+
+	for(y = 0; y < h; y++)
+	    for(x = 0; x < w; x++) {
+		int bx = x - SDF_SPREAD, by = y - SDF_SPREAD, val;
+		int cov = (bx >= 0 && by >= 0 && bx < bitmap->width && by < bitmap->rows) ?
+			bitmap->buffer[bx + by * bitmap->pitch] : 0;
+		float dist;	/* signed distance to the outline in pixels, positive outside */
+		if(cov > 0 && cov < 255) dist = 0.5f - cov / 255.0f;	/* antialiased edge pixel */
+		else if(outer[x + y * w] > 0) dist = sqrtf(outer[x + y * w]) - 0.5f;
+		else dist = 0.5f - sqrtf(inner[x + y * w]);
+		val = 128 - (int) lrintf(dist * 128 / SDF_SPREAD);
+		bmp->buffer[x + y * w] = val < 0 ? 0 : val > 255 ? 255 : val;
+	    }
+
+	bmp->key = c;
+	bmp->width = w;
+	bmp->rows = h;
+	bmp->pitch = w;
+	bmp->left = slot->bitmap_left - SDF_SPREAD;
+	bmp->top = slot->bitmap_top + SDF_SPREAD;
+	bmp->advance = slot->advance.x;		/* 26.6 */
+	if(cache_add(ctx, &ctx->sdf_cache, bmp) != 0) {
+	    bitmap_free(bmp);
+	    bmp = 0;
+	    goto done;
+	}
+	stat_add(ctx->counters, FT_STAT_RASTERIZED, 1);
+	stat_add(ctx->counters, FT_STAT_RASTER_NS, clock_ns() - t);
+
+    done:
+	free(outer);
+	free(inner);
+	free(d);
+	free(z);
+	free(v);
 
     return bmp;
 }
 
-/* Max string width in pixels for word wrapping calculations (not implemented in this example) */
-int ft_max_string_width(struct ctx *c, const char *str)
+/* Text is drawn at sdf_size points using distance fields computed at the current face size.
+   Zero turns SDF mode off. */
+
+int ft_set_sdf_size(struct ctx *c, int size)
+{
+    if(!c->fctx || size < 0) return -1;
+    c->fctx->sdf_size = size;
+    return 0;
+}
+
+/* 16.16 scale from the reference size to sdf_size */
+#define sdf_scale(ctx) (((ctx)->sdf_size << 16) / (ctx)->fsize)
+
+/* Advance at sdf_size, 26.6 */
+#define sdf_advance(ctx, adv) ((int) ((int64_t) (adv) * sdf_scale(ctx) >> 16))
+
+/* Number of horizontal subpixel positions glyphs are rendered at, 1 to 4.
+   One means whole pixels with hinted advances. */
+
+int ft_set_subpixel(struct ctx *c, int phases)
 {
     struct ft_ctx *ctx = c->fctx;
-#ifdef HANDLE_UNICODE
-    wchar_t s[strlen(str)+1];
-	if(mbstowcs(s, str, strlen(str)+1) <= 0) {
-	    log_error("widechar conversion error");
+    if(!ctx || phases < 1 || phases > 4) return -1;
+    if(phases == ctx->phases) return 0;
+    flush_cache(ctx);	/* advances differ between the modes */
+    ctx->phases = phases;
+#ifdef SHARED_ATLAS
+    if(ctx->fname) ctx->atlas = atlas_attach(ctx->fname, ctx->fsize, c->dpi, ctx->phases);
+#endif
+    return 0;
+}
+
+/* Split a 26.6 pen position into the pixel to draw at and the nearest subpixel offset */
+
+static inline int pen_pixel(struct ft_ctx *ctx, int pen, int *dx)
+{
+    int x = pen >> 6, phase = ((pen & 63) * ctx->phases + 32) >> 6;
+	if(phase == ctx->phases) {
+	    x++;
+	    phase = 0;
+	}
+	*dx = phase * 64 / ctx->phases;
+    return x;
+}
+
+/* Kerning.
+   FT_Get_Kerning() is too slow to call for every pair drawn. Adjustments between chars
+   of the hot range are kept in a dense matrix, filled a row at a time when the first pair
+   starting with a given char is seen after the face is set; all other pairs are memoized
+   in an open addressing hash table. Adjustments are 26.6 at the face size, rounded to
+   whole pixels unless subpixel positioning is on. */
+
+static inline int kern_hot(FT_ULong c)
+{
+    if(c >= 0x20 && c < 0x80) return c - 0x20;
+    if(c >= 0x400 && c < 0x460) return c - 0x400 + 96;
+    return -1;
+}
+
+static inline FT_ULong kern_char(int k)
+{
+    return k < 96 ? k + 0x20 : k - 96 + 0x400;
+}
+
+static int kern_query(struct ft_ctx *ctx, FT_UInt left, FT_UInt right)
+{
+    FT_Vector delta;
+    if(!left || !right) return 0;
+    if(ctx->FT_Get_Kerning(ctx->face, left, right,
+	ctx->phases > 1 ? FT_KERNING_UNFITTED : FT_KERNING_DEFAULT, &delta) != 0) return 0;
+    return delta.x;
+}
+
+static int kern_fill_row(struct ft_ctx *ctx, int row)
+{
+    int k;
+	if(!ctx->kern_hot) {
+	    ctx->kern_hot = (int16_t *) malloc(KERN_HOT * KERN_HOT * sizeof(int16_t));
+	    if(!ctx->kern_hot) {
+		log_error("no memory for kerning table");
+		return -1;
+	    }
+	}
+	for(k = 0; k < KERN_HOT; k++)
+	    ctx->kern_hot[row * KERN_HOT + k] = kern_query(ctx,
+		cmap_lookup(ctx->cmap, kern_char(row)), cmap_lookup(ctx->cmap, kern_char(k)));
+	ctx->kern_rows[row >> 3] |= 1 << (row & 7);
+
+    return 0;
+}
+
+static int kern_map_grow(struct ft_ctx *ctx)
+{
+    int k, size = ctx->kern_size ? ctx->kern_size * 2 : 256;
+    struct kern_pair *map = (struct kern_pair *) calloc(size, sizeof(struct kern_pair));
+	if(!map) {
+	    log_error("no memory for kerning map");
 	    return -1;
 	}
-    return glyph2screen(ctx->maxwd * wcslen(s));
+	for(k = 0; k < ctx->kern_size; k++) {
+	    uint64_t key = ctx->kern_map[k].key;
+	    int slot;
+	    if(!key) continue;
+	    for(slot = (key * 0x9e3779b97f4a7c15ull) >> 40 & (size - 1); map[slot].key; slot = (slot + 1) & (size - 1)) ;
+	    map[slot] = ctx->kern_map[k];
+	}
+	free(ctx->kern_map);
+	ctx->kern_map = map;
+	ctx->kern_size = size;
+
+    return 0;
+}
+
+/* Adjustment to apply between chars "left" and "right", 26.6 at the face size.
+   Only chars drawn from the current face are kerned, kern_query() gets 0 for the others. */
+
+static int get_kerning(struct ft_ctx *ctx, FT_ULong left, FT_ULong right)
+{
+    int hl, hr, slot, val;
+    uint64_t key;
+
+	if(!ctx->kerning || !left || !FT_HAS_KERNING(ctx->face)) return 0;
+	hl = kern_hot(left);
+	hr = kern_hot(right);
+	if(hl >= 0 && hr >= 0) {
+	    if(!(ctx->kern_rows[hl >> 3] & (1 << (hl & 7))) && kern_fill_row(ctx, hl) != 0) return 0;
+	    return ctx->kern_hot[hl * KERN_HOT + hr];
+	}
+	key = (uint64_t) left << 32 | right;
+	if(ctx->kern_size) {
+	    for(slot = (key * 0x9e3779b97f4a7c15ull) >> 40 & (ctx->kern_size - 1); ctx->kern_map[slot].key;
+		    slot = (slot + 1) & (ctx->kern_size - 1))
+		if(ctx->kern_map[slot].key == key) return ctx->kern_map[slot].val;
+	}
+	val = kern_query(ctx, cmap_lookup(ctx->cmap, left), cmap_lookup(ctx->cmap, right));
+	if(2 * (ctx->kern_used + 1) > ctx->kern_size && kern_map_grow(ctx) != 0) return val;
+	for(slot = (key * 0x9e3779b97f4a7c15ull) >> 40 & (ctx->kern_size - 1); ctx->kern_map[slot].key;
+		slot = (slot + 1) & (ctx->kern_size - 1)) ;
+	ctx->kern_map[slot].key = key;
+	ctx->kern_map[slot].val = val;
+	ctx->kern_used++;
+
+    return val;
+}
+
+/* Kerning adjustment at the size text is drawn at, 26.6 */
+#define pair_kerning(ctx, left, right) ((ctx)->sdf_size ? \
+	(int) ((int64_t) get_kerning(ctx, left, right) * sdf_scale(ctx) >> 16) : get_kerning(ctx, left, right))
+
+/* Turn pair kerning on or off */
+
+int ft_set_kerning(struct ctx *c, int on)
+{
+    if(!c->fctx) return -1;
+    c->fctx->kerning = on;
+    return 0;
+}
+
+#ifdef SHARED_ATLAS
+
+/* Whether "bmp" goes into a shared atlas: glyphs of the primary face whose
+   sizes fit the 16 bits struct atlas_glyph keeps them in */
+
+static inline int atlas_fits(const struct bitmap *bmp)
+{
+    return !(bmp->key >> KEY_FACE_SHIFT) && bmp->width <= INT16_MAX && bmp->rows <= INT16_MAX && bmp->pitch <= INT16_MAX
+	    && bmp->left >= INT16_MIN && bmp->left <= INT16_MAX && bmp->top >= INT16_MIN && bmp->top <= INT16_MAX;
+}
+
+/* Publish the private glyph cache as a shared atlas and switch our own bitmaps to it.
+   Glyphs missed later are still rendered into the private cache. */
+
+int ft_share_glyphs(struct ctx *c)
+{
+    struct ft_ctx *ctx = c->fctx;
+    struct atlas_glyph *glyphs;
+    struct bitmap *bmp;
+    uint8_t *data;
+    size_t size = 0;
+    int k, n = 0;
+
+	if(ctx->atlas) return 0;	/* already sharing */
+	for(k = 0; k < ctx->bmp_cache.size; k++)
+	    for(bmp = ctx->bmp_cache.buckets[k]; bmp; bmp = bmp->next) {
+		if(!atlas_fits(bmp)) continue;	/* fallback glyphs stay private */
+		n++;
+		size += bmp->pitch * bmp->rows;
+	    }
+	if(!n) return -1;
+	glyphs = (struct atlas_glyph *) malloc(n * sizeof(struct atlas_glyph));
+	data = (uint8_t *) malloc(size ? size : 1);
+	if(!glyphs || !data) {
+	    log_error("no memory for atlas");
+	    free(glyphs);
+	    free(data);
+	    return -1;
+	}
+	for(k = 0, n = 0, size = 0; k < ctx->bmp_cache.size; k++)
+	    for(bmp = ctx->bmp_cache.buckets[k]; bmp; bmp = bmp->next) {
+		if(!atlas_fits(bmp)) continue;
+		glyphs[n].gid = bmp->key;
+		glyphs[n].dx = bmp->dx;
+		glyphs[n].width = bmp->width;
+		glyphs[n].rows = bmp->rows;
+		glyphs[n].pitch = bmp->pitch;
+		glyphs[n].left = bmp->left;
+		glyphs[n].top = bmp->top;
+		glyphs[n].advance = bmp->advance;
+		glyphs[n].offs = size;
+		memcpy(data + size, bmp->buffer, bmp->pitch * bmp->rows);
+		size += bmp->pitch * bmp->rows;
+		n++;
+	    }
+	ctx->atlas = atlas_publish(ctx->fname, ctx->fsize, c->dpi, ctx->phases, glyphs, n, data, size);
+	free(glyphs);
+	free(data);
+	if(!ctx->atlas) return -1;
+
+	/* drop private copies of everything the segment now holds */
+	for(k = 0; k < ctx->bmp_cache.size; k++)
+	    for(bmp = ctx->bmp_cache.buckets[k]; bmp; bmp = bmp->next) {
+		const struct atlas_glyph *g;
+		if(bmp->shared || bmp->key >> KEY_FACE_SHIFT) continue;
+		if(!(g = atlas_lookup(ctx->atlas, bmp->key, bmp->dx))) continue;
+		free(bmp->buffer);
+		bmp->buffer = (uint8_t *) atlas_data(ctx->atlas, g);
+		bmp->shared = 1;
+	    }
+
+    return 0;
+}
+#endif
+
+/* Clipping.
+   Nothing is written outside c->clip, which is always within the buffer. Before a glyph is
+   looked up, its pen position is checked against the clip: ink is assumed to lie within two
+   line heights to either side of the pen and above the baseline, and within one below it.
+   Glyphs that cannot reach the clip cost at most the lookup of their advance (see
+   key_advance()), never a bitmap, and lines that cannot, nothing at all when they are
+   not wrapped. */
+
+void ft_set_clip(struct ctx *c, const struct rect *r)
+{
+    struct rect *clip = &c->clip;
+	clip->left = r && r->left > 0 ? r->left : 0;
+	clip->top = r && r->top > 0 ? r->top : 0;
+	clip->right = r && r->right < c->width ? r->right : c->width;
+	clip->bottom = r && r->bottom < c->height ? r->bottom : c->height;
+}
+
+/* Can a glyph with its pen at pen_x (26.6), pen_y, in lines "height" high, touch the clip? */
+
+static inline int in_clip(const struct ctx *c, int pen_x, int pen_y, int height)
+{
+    int x = pen_x >> 6;
+    return pen_y + height > c->clip.top && pen_y - 2 * height < c->clip.bottom
+	&& x + 2 * height > c->clip.left && x - 2 * height < c->clip.right;
+}
+
+/* Write "n" coverage values to the window buffer starting at x, y, what is inside the clip */
+
+static inline void put_row(struct ctx *c, int x, int y, const uint8_t *cov, int n)
+{
+    int k;
+	if(y < c->clip.top || y >= c->clip.bottom) return;
+	if(x < c->clip.left) {
+	    cov += c->clip.left - x;
+	    n -= c->clip.left - x;
+	    x = c->clip.left;
+	}
+	if(x + n > c->clip.right) n = c->clip.right - x;
+	if(n <= 0) return;
+	mark_dirty(c, x, y, n, 1);
+	stat_add(c->counters, c->fmt == WINDOW_FORMAT_RGB_565 ? FT_STAT_PIXELS_565 : FT_STAT_PIXELS_8888, n);
+	y = buffer_row(c, y);
+	if(c->fmt == WINDOW_FORMAT_RGBA_8888) {
+	    uint32_t *p32 = (uint32_t *) c->buffer + x + y * c->stride;
+	    for(k = 0; k < n; k++) {
+		uint8_t val = cov[k];
+		p32[k] = (val | (val << 8) | (val << 16));
+	    }
+	} else if(c->fmt == WINDOW_FORMAT_RGB_565) {	
+	    uint16_t *p16 = (uint16_t *) c->buffer + x + y * c->stride;
+	    for(k = 0; k < n; k++) {
+		uint8_t val = (cov[k] >> 3);
+		p16[k] = (val | (val << 6) | (val << 11));
+	    }	
+	}	
+}
+
+/* Draw the distance field "bmp" scaled to sdf_size with its origin at pen_x, pen_y */
+
+static void put_sdf(struct ctx *c, struct bitmap *bmp, int pen_x, int pen_y)
+{
+    struct ft_ctx *ctx = c->fctx;
+    int scale = sdf_scale(ctx), inv = (ctx->fsize << 16) / ctx->sdf_size;
+    int k = SDF_SPREAD * scale >> 8;	/* field units to coverage steps at this scale */
+    /* nothing is drawn farther than a target pixel outside the glyph bitmap, so skip the padding */
+    int x0 = ((bmp->left + SDF_SPREAD) * scale >> 16) - 1;
+    int x1 = -((-(bmp->left + bmp->width - SDF_SPREAD) * scale) >> 16) + 1;
+    int y0 = ((SDF_SPREAD - bmp->top) * scale >> 16) - 1;
+    int y1 = -((-(bmp->rows - bmp->top - SDF_SPREAD) * scale) >> 16) + 1;
+    int xmax = ((bmp->width - 1) << 16) - 1, ymax = ((bmp->rows - 1) << 16) - 1;
+    int wd = x1 - x0, x, y;
+    int32_t row[wd > 0 ? wd : 1];
+    int16_t sx[wd > 0 ? wd : 1], ax[wd > 0 ? wd : 1];
+    uint8_t cov[wd > 0 ? wd : 1];
+
+	/* Field coordinates of target pixel centres, 16.16. They are clamped to the field,
+	   whose outer border is SDF_SPREAD pixels away from the outline and reads as empty. */
+	for(x = 0; x < wd; x++) {
+	    int fx = ((2 * (x + x0) + 1) * inv >> 1) - (bmp->left << 16) - 0x8000;
+	    fx = fx < 0 ? 0 : fx > xmax ? xmax : fx;
+	    sx[x] = fx >> 16;
+	    ax[x] = (fx >> 8) & 0xff;
+	}
+	if(y0 < c->clip.top - pen_y) y0 = c->clip.top - pen_y;	/* rows outside the clip are not sampled */
+	if(y1 > c->clip.bottom - pen_y) y1 = c->clip.bottom - pen_y;
+	for(y = y0; y < y1; y++) {
+	    int fy = ((2 * y + 1) * inv >> 1) + (bmp->top << 16) - 0x8000;
+	    const uint8_t *r0, *r1;
+	    int ay;
+		fy = fy < 0 ? 0 : fy > ymax ? ymax : fy;
+		ay = (fy >> 8) & 0xff;
+		r0 = bmp->buffer + (fy >> 16) * bmp->pitch;
+		r1 = r0 + bmp->pitch;
+		/* bilinear sample, 8.8 */
+		for(x = 0; x < wd; x++) {
+		    int a = r0[sx[x]], b = r0[sx[x] + 1], e = r1[sx[x]], f = r1[sx[x] + 1];
+		    a = (a << 8) + (b - a) * ax[x];
+		    e = (e << 8) + (f - e) * ax[x];
+		    row[x] = a + (((e - a) * ay) >> 8);
+		}
+		/* threshold at the outline and smoothstep over one target pixel */
+		for(x = 0; x < wd; x++) {
+		    int t = 128 + (((row[x] - 32768) * k) >> 15);
+		    t = t < 0 ? 0 : t > 256 ? 256 : t;
+		    t = (t * t * (768 - 2 * t)) >> 16;
+		    cov[x] = t > 255 ? 255 : t;
+		}
+		put_row(c, pen_x + x0, pen_y + y, cov, wd);
+	}
+}
+
+/* Advances.
+   Laying text out only takes the advances of its glyphs, so they are kept apart from the
+   bitmaps: a glyph is loaded, not rendered, the first time its advance is asked for, and
+   only rasterized when it is drawn. Both advances are those the bitmaps get, see
+   get_char_bitmap() and get_char_sdf(). */
+
+static inline unsigned adv_slot(uint32_t key, int size)
+{
+    return (key * 2654435761u) >> 8 & (size - 1);
+}
+
+static int adv_map_grow(struct ft_ctx *ctx)
+{
+    int k, size = ctx->adv_size ? ctx->adv_size * 2 : 256;
+    struct glyph_advance *map = (struct glyph_advance *) calloc(size, sizeof(struct glyph_advance));
+    unsigned slot;
+	if(!map) {
+	    log_error("no memory for advances");
+	    return -1;
+	}
+	for(k = 0; k < ctx->adv_size; k++) {
+	    if(!ctx->adv_map[k].key) continue;
+	    for(slot = adv_slot(ctx->adv_map[k].key, size); map[slot].key; slot = (slot + 1) & (size - 1)) ;
+	    map[slot] = ctx->adv_map[k];
+	}
+	free(ctx->adv_map);
+	ctx->adv_map = map;
+	ctx->adv_size = size;
+
+    return 0;
+}
+
+/* Advance of glyph key "key" at the size text is drawn at, 26.6, -1 if it cannot be loaded */
+
+static int key_advance(struct ft_ctx *ctx, uint32_t key)
+{
+    struct glyph_advance *a, none;
+    FT_GlyphSlot slot;
+    unsigned k;
+
+	key++;
+	if(ctx->adv_size) {
+	    for(k = adv_slot(key, ctx->adv_size); ctx->adv_map[k].key; k = (k + 1) & (ctx->adv_size - 1))
+		if(ctx->adv_map[k].key == key) {
+		    a = &ctx->adv_map[k];
+		    return ctx->sdf_size ? sdf_advance(ctx, a->sdf) : a->bmp;
+		}
+	}
+	if(!(slot = load_glyph(ctx, key - 1, FT_LOAD_DEFAULT))) {
+	    log_error("error loading glyph %08x", key - 1);
+	    return -1;
+	}
+	if(2 * (ctx->adv_used + 1) <= ctx->adv_size || adv_map_grow(ctx) == 0) {
+	    for(k = adv_slot(key, ctx->adv_size); ctx->adv_map[k].key; k = (k + 1) & (ctx->adv_size - 1)) ;
+	    a = &ctx->adv_map[k];
+	    ctx->adv_used++;
+	} else a = &none;	/* no memory, just not kept */
+	a->key = key;
+	a->bmp = ctx->phases > 1 ? (slot->linearHoriAdvance + 512) >> 10 : slot->advance.x;
+	a->sdf = slot->advance.x;
+
+    return ctx->sdf_size ? sdf_advance(ctx, a->sdf) : a->bmp;
+}
+
+#ifdef SHAPING
+
+typedef char wchar_is_utf32[sizeof(wchar_t) == sizeof(uint32_t) ? 1 : -1];
+
+/* Glyph key of shaped glyph "g" of "s" and its advance and offsets at the size text is drawn at, 26.6.
+   A glyph the current face lacks comes out as glyph 0 and is replaced by the char unshaped
+   from the fallback chain. */
+
+static int shaped_glyph(struct ft_ctx *ctx, const wchar_t *s, const struct shaped_glyph *g,
+	uint32_t *key, int *advance, int *xoff, int *yoff)
+{
+    int scale = ctx->sdf_size ? sdf_scale(ctx) : 1 << 16;	/* shaped at the face size */
+	*key = g->gid;
+	*advance = (int64_t) g->x_advance * scale >> 16;
+	*xoff = (int64_t) g->x_offset * scale >> 16;
+	*yoff = (int64_t) g->y_offset * scale >> 16;
+	if(!*key && (*key = glyph_key(ctx, s[g->cluster]))) {
+	    if((*advance = key_advance(ctx, *key)) < 0) return -1;
+	    *xoff = *yoff = 0;
+	}
+    return 0;
+}
+
+/* Shape the "len" chars of paragraph "s" a run at a time into glyphs in logical order, that
+   is in the order of their clusters, with the bidi level of each char into "level" and that of
+   the paragraph into "base". A paragraph of one left to right run comes straight from the shaper. */
+
+static int shape_paragraph(struct ft_ctx *ctx, const wchar_t *s, int len, uint8_t *level, int *base,
+	const struct shaped_glyph **glyphs)
+{
+    const uint32_t *text = (const uint32_t *) s;
+    const struct shaped_glyph *g;
+    uint32_t script;
+    int k, j, e, m, n = 0;
+
+	*base = shaper_levels(text, len, level);
+	for(k = 0; k < len; k = e) {
+	    e = shaper_run_end(text, len, level, k, &script);
+	    if((m = shaper_run(ctx->shaper, text + k, e - k, script, level[k] & 1, &g)) < 0) return -1;
+	    if(k == 0 && e == len && !(level[k] & 1)) {
+		*glyphs = g;
+		return m;
+	    }
+	    if(n + m > ctx->para_size) {
+		int size = 2 * (n + m);
+		struct shaped_glyph *p = (struct shaped_glyph *) realloc(ctx->para, size * sizeof(struct shaped_glyph));
+		if(!p) {
+		    log_error("no memory for shaped text");
+		    return -1;
+		}
+		ctx->para = p;
+		ctx->para_size = size;
+	    }
+	    for(j = 0; j < m; j++) {	/* right to left runs come in visual order */
+		ctx->para[n + j] = g[level[k] & 1 ? m - 1 - j : j];
+		ctx->para[n + j].cluster += k;
+	    }
+	    n += m;
+	}
+	*glyphs = ctx->para;
+
+    return n;
+}
+
+/* Display order of glyphs k to e - 1 of a line into ctx->order[k] to ctx->order[e - 1], as in
+   UAX #9 L1 and L2: trailing spaces go back to the paragraph level "base", then from the highest
+   level down to 1, each run of glyphs at that level or above is reversed. Returns 0 if the line
+   is all left to right and stays in logical order, -1 if there is no memory. */
+
+static int line_order(struct ft_ctx *ctx, const wchar_t *s, const struct shaped_glyph *g, const uint8_t *level,
+	int base, int k, int e)
+{
+    int i, j, l, t, end, top = 0;
+#define LEVEL(i) ((i) >= end ? base : level[g[i].cluster])
+
+	for(end = e; end > k && s[g[end - 1].cluster] == ' '; end--) ;
+	for(i = k; i < e; i++) if(LEVEL(i) > top) top = LEVEL(i);
+	if(!top) return 0;
+	if(e > ctx->order_size) {
+	    int size = 2 * e, *p = (int *) realloc(ctx->order, size * sizeof(int));
+	    if(!p) {
+		log_error("no memory for shaped text");
+		return -1;
+	    }
+	    ctx->order = p;
+	    ctx->order_size = size;
+	}
+	for(i = k; i < e; i++) ctx->order[i] = i;
+	/* a reversed run keeps its place, so the levels of its positions still tell the runs below it */
+	for(l = top; l > 0; l--)
+	    for(i = k; i < e; i = j) {
+		for(; i < e && LEVEL(i) < l; i++) ;
+		for(j = i; j < e && LEVEL(j) >= l; j++) ;
+		for(t = 0; t < (j - i) / 2; t++) {
+		    int o = ctx->order[i + t];
+		    ctx->order[i + t] = ctx->order[j - 1 - t];
+		    ctx->order[j - 1 - t] = o;
+		}
+	    }
+#undef LEVEL
+
+    return 1;
+}
+
+/* Lay out "s" shaped a paragraph at a time from start_x, start_y, wrapping at "width" (0: never).
+   Lines are counted into "lines" if it is set, the widest goes to "max_width" (26.6) if that is,
+   and glyphs are drawn if "draw" is. Positions come from the shaper, so pair kerning is not
+   applied on top. Lines are broken in logical order at break opportunities found from the
+   chars, as in wrap_line(), and only between clusters, so marks stay with their base; each
+   line is then drawn in display order. */
+
+static int shaped_string(struct ctx *c, const wchar_t *s, int start_x, int start_y, int width,
+	int *lines, int *max_width, int draw)
+{
+    struct ft_ctx *ctx = c->fctx;
+    const struct shaped_glyph *g = 0;
+    struct bitmap *bmp;
+    struct lb_state lb;
+    int i, j, k, e, n, len, x, y, dx, pen_x, pen_y, nlines = 1, height = ft_get_line_height(c);
+    int w, wd, brk, brk_wd, hard, advance, xoff, yoff, base = 0, mixed;
+    uint32_t key;
+
+	pen_y = start_y + height;
+	if(max_width) *max_width = 0;
+	while(1) {
+	    for(len = 0; s[len] && s[len] != '\n'; len++) ;
+	    if(draw && !lines && pen_y - 2 * height >= c->clip.bottom) break;	/* the rest is below the clip */
+	    {
+		uint8_t opp[len + 1], level[len + 1];	/* break opportunity before each char and its bidi level */
+		lb_init(&lb);
+		for(k = hard = 0; k < len; k++) hard |= (opp[k] = lb_next(&lb, s[k])) == LB_MUST;
+		/* a paragraph that stays on one line is not shaped when above the clip or right of it */
+		if(draw && !lines && !width && !hard && (pen_y + height <= c->clip.top || start_x - 2 * height >= c->clip.right)) n = 0;
+		else n = len ? shape_paragraph(ctx, s, len, level, &base, &g) : 0;
+		if(n < 0) return -1;
+		for(k = 0; ; k = e) {
+		    /* the line is glyphs k to e - 1 */
+		    for(e = k, w = wd = 0, brk = -1, brk_wd = 0; e < n; e++) {
+			int cl = g[e].cluster, first = e == 0 || g[e - 1].cluster != cl;
+			if(e > k && first && opp[cl] == LB_MUST) break;
+			if(e > k && first && opp[cl] == LB_ALLOW) {
+			    brk = e;
+			    brk_wd = wd;
+			}
+			if(shaped_glyph(ctx, s, &g[e], &key, &advance, &xoff, &yoff) != 0) return -1;
+			if(width && first && s[cl] != ' ' && w + advance > width << 6) {
+			    if(e == k && !draw) return -1;	/* won't fit */
+			    if(e > k) {
+				if(brk > k) {
+				    e = brk;
+				    wd = brk_wd;
+				}
+				break;
+			    }
+			}
+			w += advance;
+			if(s[cl] != ' ') wd = w;	/* trailing spaces hang */
+		    }
+		    if(max_width && wd > *max_width) *max_width = wd;
+		    if(draw && pen_y + height > c->clip.top) {
+			if((mixed = line_order(ctx, s, g, level, base, k, e)) < 0) return -1;
+			for(i = k, pen_x = start_x << 6; i < e && (pen_x >> 6) - 2 * height < c->clip.right; i++) {
+			    j = mixed ? ctx->order[i] : i;
+			    if(shaped_glyph(ctx, s, &g[j], &key, &advance, &xoff, &yoff) != 0) return -1;
+			    if(in_clip(c, pen_x + xoff, pen_y - ((yoff + 32) >> 6), height)) {
+				int gx = pen_x + xoff, gy = pen_y - ((yoff + 32) >> 6);
+				if(ctx->sdf_size) {
+				    bmp = get_char_sdf(ctx, key);
+				    if(!bmp) return -1;
+				    put_sdf(c, bmp, (gx + 32) >> 6, gy);
+				} else {
+				    x = pen_pixel(ctx, gx, &dx);
+				    bmp = get_char_bitmap(ctx, key, dx);
+				    if(!bmp) return -1;
+				    for(y = 0; y < bmp->rows; y++)
+					put_row(c, x + bmp->left, gy - bmp->top + y, bmp->buffer + y * bmp->pitch, bmp->width);
+				}
+			    }
+			    pen_x += advance;
+			}
+		    }
+		    if(e >= n) break;
+		    if(!draw && !lines) return -1;	/* no line breaks allowed */
+		    nlines++;
+		    pen_y += height;
+		    if(draw && !lines && pen_y - 2 * height >= c->clip.bottom) return 0;
+		}
+	    }
+	    s += len;
+	    if(!*s) break;
+	    if(!draw && !lines) return -1;	/* no line breaks allowed */
+	    nlines++;
+	    pen_y += height;
+	    s++;
+	}
+	if(lines) *lines = nlines;
+
+    return 0;
+}
+
+/* Shape text with HarfBuzz if it is available */
+
+int ft_set_shaping(struct ctx *c, int on)
+{
+    if(!c->fctx || (on && !c->fctx->shaper)) return -1;
+    c->fctx->shaping = on;
+    return 0;
+}
+#endif
+
+/* Next char of the string at "*s", which is moved past it. 0 at the end, -1 for a malformed one. */
+
+static inline int next_char(const char **s, FT_ULong *c)
+{
+#ifdef HANDLE_UNICODE
+    mbstate_t state;
+    wchar_t wc;
+    size_t n;
+	if(!(**s & 0x80)) {	/* ASCII */
+	    *c = (unsigned char) **s;
+	    if(!*c) return 0;
+	    (*s)++;
+	    return 1;
+	}
+	memset(&state, 0, sizeof(state));
+	n = mbrtowc(&wc, *s, MB_CUR_MAX, &state);
+	if(n == (size_t) -1 || n == (size_t) -2) return -1;
+	*s += n;
+	*c = wc;
 #else
-    return glyph2screen(ctx->maxwd * strlen(str));
+	if(!(*c = (unsigned char) **s)) return 0;
+	(*s)++;
 #endif
+    return 1;
 }
 
+/* Line breaking.
+   A line is broken at the last break opportunity that fits on it (see linebreak.c), and
+   only where there is none, before the char that does not fit. Spaces at the end of a
+   line hang past the width. A line ends at a hard break whatever its width; "\r\n" is
+   one break. Measuring, drawing and ft_max_string_width() all find lines the same way. */
+
+/* Find the line at "s" wrapped at "max" (26.6, 0 for never): its text ends at *end and the
+   next line starts at *next, null after the last one. "lb" holds the break state at "s" and
+   is moved on to *next. If "width" is set the line is measured even when not wrapped, and
+   its width without trailing spaces goes there, 26.6.
+   Returns 1 if a char alone is wider than max, -1 for a malformed string or a glyph error. */
+
+static int wrap_line(struct ft_ctx *ctx, const char *s, int max, struct lb_state *lb,
+	const char **end, const char **next, int *width)
+{
+    const char *p = s, *q, *brk = 0;
+    struct lb_state at_p, at_brk;
+    int w = 0, wd = 0, brk_wd = 0, over = 0, r, opp, advance;
+    FT_ULong ch, prev = 0;
+
+	while(1) {
+	    at_p = *lb;
+	    q = p;
+	    if((r = next_char(&q, &ch)) <= 0) {
+		if(r < 0) return -1;
+		*next = 0;
+		break;
+	    }
+	    opp = lb_next(lb, ch);
+	    if(lb_hard(ch)) {
+		if(ch == '\r' && *q == '\n') lb_next(lb, *q++);
+		*next = q;
+		break;
+	    }
+	    if(p != s && opp == LB_ALLOW) {
+		brk = p;
+		at_brk = at_p;
+		brk_wd = wd;
+	    }
+	    if(max || width) {
+		if((advance = key_advance(ctx, glyph_key(ctx, ch))) < 0) return -1;
+		advance += pair_kerning(ctx, prev, ch);
+		if(max && ch != ' ' && w + advance > max) {
+		    if(p != s) {	/* break at the last opportunity, or before this char */
+			if(brk) {
+			    p = brk;
+			    *lb = at_brk;
+			    wd = brk_wd;
+			} else *lb = at_p;
+			*next = p;
+			break;
+		    }
+		    over = 1;
+		}
+		w += advance;
+		if(ch != ' ') wd = w;
+		prev = ch;
+	    }
+	    p = q;
+	}
+	*end = p;
+	if(width) *width = wd;
+
+    return over;
+}
+
+/* Width in pixels of the widest line of "str" drawn unwrapped */
+
+int ft_max_string_width(struct ctx *c, const char *str)
+{
+    struct ft_ctx *ctx = c->fctx;
+    const char *s, *end, *next;
+    struct lb_state lb;
+    int w, max = 0;
+
+	stat_add(c->counters, FT_STAT_MEASURED, 1);
+#ifdef SHAPING
+	if(ctx->shaper && ctx->shaping) {
+	    int lines;
+	    wchar_t ws[strlen(str)+1];
+	    if(mbstowcs(ws, str, strlen(str)+1) == (size_t) -1) {
+		log_error("widechar conversion error");
+		return -1;
+	    }
+	    if(shaped_string(c, ws, 0, 0, 0, &lines, &max, 0) != 0) return -1;
+	    return (max + 63) >> 6;
+	}
+#endif
+	lb_init(&lb);
+	for(s = str; s; s = next) {
+	    if(wrap_line(ctx, s, 0, &lb, &end, &next, &w) < 0) {
+		log_error("widechar conversion error");
+		return -1;
+	    }
+	    if(w > max) max = w;
+	}
+
+    return (max + 63) >> 6;
+}
 
 /* Updates target_lines, returns error if the string does not fit in target_width. 
    If target_lines is null, no line breaks are allowed. */
@@ -215,95 +1525,144 @@ int ft_max_string_width(struct ctx *c, const char *str)
 int ft_get_string_metrics(struct ctx *c, const char *str, int target_width, int *target_lines)
 {
     struct  ft_ctx *ctx = c->fctx;
-    int wd = 0, lines = 1;  	
-    struct bitmap *bmp; 
-#ifdef HANDLE_UNICODE	
-    wchar_t ss[strlen(str)+1], *s = ss;
-	if(mbstowcs(s, str, strlen(str)+1) <= 0) {
-	    log_error("widechar conversion error");
-	    return -1;
+    const char *s, *end, *next;
+    struct lb_state lb;
+    int lines = 0;
+    TRACE_SCOPE(__func__);
+
+	stat_add(c->counters, FT_STAT_MEASURED, 1);
+#ifdef SHAPING
+	if(ctx->shaper && ctx->shaping) {
+	    wchar_t ws[strlen(str)+1];
+	    if(mbstowcs(ws, str, strlen(str)+1) == (size_t) -1) {
+		log_error("widechar conversion error");
+		return -1;
+	    }
+	    return shaped_string(c, ws, 0, 0, target_width, target_lines, 0, 0);
 	}
-#else
-    const char *s = str;	
 #endif
-	while(*s) {
-	    if(*s == '\n') {	
-		if(!target_lines) return -1;
-		lines++;		
-		wd = 0;
-		s++;
-		continue;	
-	    }
-	    bmp = get_char_bitmap(ctx, *s);
-	    if(!bmp) return -1;
-	    if(wd + bmp->advance > target_width) {	/* line break required? */
-		if(!target_lines) return -1;
-		if(!wd) return -1;		/* first char on line, no chance */
-		lines++;
-		wd = 0;				/* retry with this char starting the next line */
-	    } else {
-		wd += bmp->advance;
-		s++;
-	    }
+	lb_init(&lb);
+	for(s = str; s; s = next, lines++) {
+	    /* a char wider than the line does not fit either */
+	    if(wrap_line(ctx, s, target_width << 6, &lb, &end, &next, 0) != 0) return -1;
+	    if(next && !target_lines) return -1;
 	}
-	*target_lines = lines;
+	if(target_lines) *target_lines = lines;
 
     return 0;
 }
 
+/* Advance of char "ch" as ft_get_string_metrics() takes it, 26.6, without kerning */
+
+int ft_get_advance(struct ctx *c, uint32_t ch)
+{
+    struct ft_ctx *ctx = c->fctx;
+    return key_advance(ctx, glyph_key(ctx, ch));
+}
+
 /* Render string using current face assuming that the string will fit 
-   as per the previous function */
+   as per the previous function, wrapped at "width" pixels from start_x (0: never).
+   Glyphs are only looked up for the lines that can reach the clip, and only up to
+   where they leave it. */
 
 int ft_render_string(struct ctx *c, const char *str, int start_x, int start_y, int width)
 {
-    int pen_x, pen_y, x, y;
+    int pen_x, pen_y, x, y, dx, advance, kern, height;	/* pen_x in 26.6 */
+    FT_ULong prev, ch = 0;
+    uint32_t key;
     struct  ft_ctx *ctx = c->fctx;
     struct bitmap *bmp;
-#ifdef HANDLE_UNICODE
-    wchar_t ss[strlen(str)+1], *s = ss;
-	if(mbstowcs(s, str, strlen(str)+1) <= 0) {
-	    log_error("widechar conversion error");	
-	    return -1;	
+    struct lb_state lb;
+    const char *s, *end, *next;
+    TRACE_SCOPE(__func__);
+
+	log_debug("%s: %d %d wd=%d", __func__, start_x, start_y, width);
+	stat_add(c->counters, FT_STAT_RENDERED, 1);
+#ifdef SHAPING
+	if(ctx->shaper && ctx->shaping) {
+	    wchar_t ws[strlen(str)+1];
+	    if(mbstowcs(ws, str, strlen(str)+1) == (size_t) -1) {
+		log_error("widechar conversion error");
+		return -1;
+	    }
+	    return shaped_string(c, ws, start_x, start_y, width, 0, 0, 1);
 	}
-#else
-    const char *s = str;	
 #endif
-	log_info("%s: %d %d wd=%d", __func__, start_x, start_y, width);
-	pen_x = start_x;
-	pen_y = start_y + ctx->height;
-
-	while(*s) {
-	    if(*s == '\n') {
-		pen_x = start_x;
-		pen_y += ctx->height;
-		s++;
-		continue;
-	    }
-	    bmp = get_char_bitmap(ctx, *s);
-	    if(!bmp) return -1;
-	    if(width && pen_x + bmp->advance > width) {
-	        pen_x = start_x;
-	        pen_y += ctx->height;
-	    }
-	    if(c->fmt == WINDOW_FORMAT_RGBA_8888) {
-		uint32_t *p32 = (uint32_t *) c->buffer + pen_x + bmp->left + (pen_y - bmp->top) * c->stride;
-		for(y = 0; y < bmp->rows; y++, p32 += c->stride - bmp->width)
-		    for(x = 0; x < bmp->width; x++) {
-			uint8_t val = bmp->buffer[x + y * bmp->pitch];
-			*p32++ = (val | (val << 8) | (val << 16));
+	height = ft_get_line_height(c);
+	lb_init(&lb);
+	for(s = str, pen_y = start_y + height; s; s = next, pen_y += height) {
+	    if(pen_y - 2 * height >= c->clip.bottom) break;	/* the rest is below the clip */
+	    if(wrap_line(ctx, s, width << 6, &lb, &end, &next, 0) < 0) goto failed;
+	    if(pen_y + height <= c->clip.top) continue;		/* above it */
+	    /* until nothing more of the line can show */
+	    for(pen_x = start_x << 6, prev = 0; s < end && (pen_x >> 6) - 2 * height < c->clip.right; prev = ch) {
+		next_char(&s, &ch);
+		key = glyph_key(ctx, ch);
+		kern = pair_kerning(ctx, prev, ch);
+		if((advance = key_advance(ctx, key)) < 0) goto failed;
+		pen_x += kern;
+		if(in_clip(c, pen_x, pen_y, height)) {	/* only now is there a bitmap to get */
+		    if(ctx->sdf_size) {
+			if(!(bmp = get_char_sdf(ctx, key))) goto failed;
+			put_sdf(c, bmp, (pen_x + 32) >> 6, pen_y);
+		    } else {
+			x = pen_pixel(ctx, pen_x, &dx);
+			if(!(bmp = get_char_bitmap(ctx, key, dx))) goto failed;
+			for(y = 0; y < bmp->rows; y++)
+			    put_row(c, x + bmp->left, pen_y - bmp->top + y, bmp->buffer + y * bmp->pitch, bmp->width);
 		    }
-	    } else if(c->fmt == WINDOW_FORMAT_RGB_565) {	
-		uint16_t *p16 = (uint16_t *) c->buffer + pen_x + bmp->left + (pen_y - bmp->top) * c->stride;
-		for(y = 0; y < bmp->rows; y++, p16 += c->stride - bmp->width)
-		    for(x = 0; x < bmp->width; x++) {
-			uint8_t val = (bmp->buffer[x + y * bmp->pitch] >> 3);
-			*p16++ = (val | (val << 6) | (val << 11));
-		    }	
-	    }	
-	    pen_x += bmp->advance;
-	    s++;
+		}
+		pen_x += advance;
+	    }
 	}
+	return 0;
+
+    failed:
+	log_error("%s failed", __func__);
+	return -1;
+}
+
+/* Character cells for fixed pitch grids, see grid.c.
+   Cells are as wide as the widest printable ASCII char and a line high, with the
+   baseline "ascent" pixels from the top. Glyphs are drawn from the face size bitmaps
+   whether or not SDF mode is on, narrower ones centered and wider ones clipped. */
+
+int ft_get_cell_size(struct ctx *c, int *width, int *height, int *ascent)
+{
+    struct ft_ctx *ctx = c->fctx;
+    struct bitmap *bmp;
+    int k, wd = 0;
+
+	for(k = ' '; k <= '~'; k++) {
+	    if(!(bmp = get_char_bitmap(ctx, glyph_key(ctx, k), 0))) return -1;
+	    if(bmp->advance > wd) wd = bmp->advance;
+	}
+	*width = (wd + 63) >> 6;
+	*height = ctx->height;
+	*ascent = glyph2screen(ctx->face->ascender);
+	if(*ascent > *height) *ascent = *height;
+
     return 0;
 }
 
+/* Coverage of char "ch" in a "width" x "height" cell with the baseline "ascent" rows down */
 
+int ft_render_cell(struct ctx *c, uint32_t ch, uint8_t *cov, int width, int height, int ascent)
+{
+    struct ft_ctx *ctx = c->fctx;
+    struct bitmap *bmp = get_char_bitmap(ctx, glyph_key(ctx, ch), 0);
+    int x, y, x0, x1, y0, y1;
+
+	memset(cov, 0, width * height);
+	if(!bmp) return -1;
+	x = bmp->left + (width - ((bmp->advance + 32) >> 6)) / 2;
+	y = ascent - bmp->top;
+	x0 = x < 0 ? -x : 0;
+	x1 = x + bmp->width > width ? width - x : bmp->width;
+	y0 = y < 0 ? -y : 0;
+	y1 = y + bmp->rows > height ? height - y : bmp->rows;
+	for(; x1 > x0 && y0 < y1; y0++)
+	    memcpy(cov + (y + y0) * width + x + x0, bmp->buffer + y0 * bmp->pitch + x0, x1 - x0);
+
+    return 0;
+}
@@ -0,0 +1,296 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "main.h"
+
+/* Fixed pitch grids of character cells for terminal style screens.
+   A grid is rows x cols cells holding a char and its colors, drawn into ctx->buffer
+   at x, y by grid_draw(). Changes only set bits in a per cell dirty bitmap; drawing
+   copies a finished tile (glyph composited over its background in the pixel format)
+   for each dirty cell that now differs from what is on the screen there. Tiles come
+   from a cache keyed by the cell value, so a cell costs a glyph render and a blend
+   only the first time its char shows up in its colors.
+   Scrolling rotates the row indices of the cells instead of moving them, then marks
+   all of the grid dirty: only the cells whose content is not the same as that of the
+   one below them are copied again. */
+
+#define GRID_TILES	1024		/* tile cache slots, a power of 2 */
+#define TILE_USED	0x80000000u	/* in tile keys: slot holds a tile */
+#define CELL_NONE	0xffffffffu	/* in g->shown: nothing drawn there yet */
+
+/* xterm colors */
+static const uint32_t palette_rgb[16] = {
+    0x000000, 0xcd0000, 0x00cd00, 0xcdcd00, 0x0000ee, 0xcd00cd, 0x00cdcd, 0xe5e5e5,
+    0x7f7f7f, 0xff0000, 0x00ff00, 0xffff00, 0x5c5cff, 0xff00ff, 0x00ffff, 0xffffff
+};
+
+struct grid {
+    struct ctx *ctx;
+    int x, y, rows, cols;
+    int cw, ch, ascent, bpp;		/* cell size in pixels, baseline in the cell, bytes per pixel */
+    int top;				/* row of cells shown in the top grid row */
+    uint32_t *cells;			/* GRID_CELL() values, rows x cols */
+    uint32_t *shown;			/* what each grid cell on the screen shows */
+    uint64_t *dirty;			/* bit per grid cell, words_per_row words a row */
+    int words_per_row;
+    uint32_t *keys;			/* tile cache: cell value | TILE_USED, 0 for a free slot */
+    uint8_t *tiles;			/* GRID_TILES tiles of cw x ch pixels */
+    int ntiles;
+    uint8_t *cov;			/* glyph coverage of the tile being made */
+    const uint8_t **run_tiles;		/* tiles grid_draw() copies to a row, and their columns */
+    int *run_cols;
+};
+
+static inline uint32_t *cell(struct grid *g, int row, int col)
+{
+    row += g->top;
+    return &g->cells[(row >= g->rows ? row - g->rows : row) * g->cols + col];
+}
+
+static inline void set_dirty(struct grid *g, int row, int col)
+{
+    g->dirty[row * g->words_per_row + (col >> 6)] |= 1ull << (col & 63);
+}
+
+/* Mark every cell dirty, and no bits past the last column */
+
+static void set_all_dirty(struct grid *g)
+{
+    uint64_t last = g->cols & 63 ? (1ull << (g->cols & 63)) - 1 : ~0ull;
+    int row;
+	memset(g->dirty, 0xff, g->rows * g->words_per_row * sizeof(uint64_t));
+	for(row = 0; row < g->rows; row++) g->dirty[(row + 1) * g->words_per_row - 1] = last;
+}
+
+/* Blend of palette colors "fg" and "bg" at coverage "a" in the pixel format */
+
+static uint32_t blend(struct grid *g, int fg, int bg, int a)
+{
+    uint32_t f = palette_rgb[fg], b = palette_rgb[bg], v = 0;
+    int k;
+	for(k = 0; k < 24; k += 8) {
+	    int fc = f >> k & 0xff, bc = b >> k & 0xff;
+	    v |= (uint32_t) ((bc * 255 + (fc - bc) * a + 127) / 255) << k;
+	}
+	/* v is 0xRRGGBB, RGBA_8888 is R first in memory */
+	if(g->ctx->fmt == WINDOW_FORMAT_RGB_565)
+	    return (v >> 19 & 0x1f) << 11 | (v >> 10 & 0x3f) << 5 | (v >> 3 & 0x1f);
+    return (v >> 16 & 0xff) | (v & 0xff00) | (v & 0xff) << 16;
+}
+
+/* Tile for cell value "v", rendered and cached if it is not yet. grid_draw() empties
+   the cache when it fills up, after copying the tiles it got from it. */
+
+static const uint8_t *get_tile(struct grid *g, uint32_t v)
+{
+    uint32_t key = v | TILE_USED;
+    unsigned slot = (v * 2654435761u) >> 22 & (GRID_TILES - 1);
+    int fg = GRID_FG(v), bg = GRID_BG(v), k, n = g->cw * g->ch;
+    uint8_t *tile;
+
+	while(g->keys[slot] && g->keys[slot] != key) slot = (slot + 1) & (GRID_TILES - 1);
+	tile = g->tiles + slot * n * g->bpp;
+	if(g->keys[slot]) return tile;	/* cache hit */
+	if(ft_render_cell(g->ctx, GRID_CHAR(v), g->cov, g->cw, g->ch, g->ascent) != 0) return 0;
+	if(g->bpp == 2) {
+	    uint16_t *p = (uint16_t *) tile;
+	    for(k = 0; k < n; k++) p[k] = blend(g, fg, bg, g->cov[k]);
+	} else {
+	    uint32_t *p = (uint32_t *) tile;
+	    for(k = 0; k < n; k++) p[k] = blend(g, fg, bg, g->cov[k]);
+	}
+	g->keys[slot] = key;
+	g->ntiles++;
+
+    return tile;
+}
+
+struct grid *grid_create(struct ctx *c, int x, int y, int rows, int cols)
+{
+    struct grid *g = (struct grid *) calloc(1, sizeof(struct grid));
+    int k;
+
+	if(rows <= 0 || cols <= 0) {
+	    log_error("bad grid size %d x %d", cols, rows);
+	    free(g);
+	    return 0;
+	}
+	if(!g) goto nomem;
+	g->ctx = c;
+	g->x = x;
+	g->y = y;
+	g->rows = rows;
+	g->cols = cols;
+	g->bpp = c->fmt == WINDOW_FORMAT_RGB_565 ? 2 : 4;
+	if(ft_get_cell_size(c, &g->cw, &g->ch, &g->ascent) != 0) {
+	    log_error("failed to get the cell size");
+	    free(g);
+	    return 0;
+	}
+	if(x < 0 || y < 0 || x + cols * g->cw > c->width || y + rows * g->ch > c->height) {
+	    log_error("%d x %d cells of %d x %d at %d, %d do not fit in %d x %d", cols, rows, g->cw, g->ch,
+		    x, y, c->width, c->height);
+	    free(g);
+	    return 0;
+	}
+	g->words_per_row = (cols + 63) / 64;
+	g->cells = (uint32_t *) malloc(rows * cols * sizeof(uint32_t));
+	g->shown = (uint32_t *) malloc(rows * cols * sizeof(uint32_t));
+	g->dirty = (uint64_t *) calloc(rows * g->words_per_row, sizeof(uint64_t));
+	g->keys = (uint32_t *) calloc(GRID_TILES, sizeof(uint32_t));
+	g->tiles = (uint8_t *) malloc(GRID_TILES * g->cw * g->ch * g->bpp);
+	g->cov = (uint8_t *) malloc(g->cw * g->ch);
+	g->run_tiles = (const uint8_t **) malloc(cols * sizeof(uint8_t *));
+	g->run_cols = (int *) malloc(cols * sizeof(int));
+	if(!g->cells || !g->shown || !g->dirty || !g->keys || !g->tiles || !g->cov || !g->run_tiles || !g->run_cols) goto nomem;
+	for(k = 0; k < rows * cols; k++) {
+	    g->cells[k] = GRID_CELL(' ', GRID_ATTR_DEFAULT);
+	    g->shown[k] = CELL_NONE;
+	}
+	set_all_dirty(g);
+	log_info("%s: %d x %d cells of %d x %d", __func__, cols, rows, g->cw, g->ch);
+	return g;
+
+    nomem:
+	log_error("no memory for %d x %d grid", cols, rows);
+	grid_destroy(g);
+	return 0;
+}
+
+void grid_destroy(struct grid *g)
+{
+    if(!g) return;
+    free(g->cells);
+    free(g->shown);
+    free(g->dirty);
+    free(g->keys);
+    free(g->tiles);
+    free(g->cov);
+    free(g->run_tiles);
+    free(g->run_cols);
+    free(g);
+}
+
+void grid_cell_size(const struct grid *g, int *width, int *height)
+{
+    *width = g->cw;
+    *height = g->ch;
+}
+
+void grid_put(struct grid *g, int row, int col, uint32_t ch, int attr)
+{
+    uint32_t *p, v = GRID_CELL(ch, attr);
+	if(row < 0 || row >= g->rows || col < 0 || col >= g->cols) return;
+	p = cell(g, row, col);
+	if(*p == v) return;
+	*p = v;
+	set_dirty(g, row, col);
+}
+
+/* Put the chars of UTF-8 string "s" from row, col on, up to the end of the row.
+   Returns the number of cells written. */
+
+int grid_print(struct grid *g, int row, int col, const char *s, int attr)
+{
+    const uint8_t *p = (const uint8_t *) s;
+    int n = 0;
+
+	while(*p && col + n < g->cols) {
+	    uint32_t c = *p++;
+	    int more = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+	    if(more) c &= 0x3f >> more;
+	    else if(c >= 0x80) c = 0xfffd;	/* stray continuation byte */
+	    for(; more && (*p & 0xc0) == 0x80; more--) c = c << 6 | (*p++ & 0x3f);
+	    if(more || c > 0x10ffff) c = 0xfffd;	/* truncated or out of range */
+	    grid_put(g, row, col + n++, c, attr);
+	}
+    return n;
+}
+
+/* Blank "n" rows from "row" on */
+
+void grid_clear(struct grid *g, int row, int n, int attr)
+{
+    int k;
+	for(; n > 0 && row < g->rows; n--, row++)
+	    for(k = 0; k < g->cols; k++) grid_put(g, row, k, ' ', attr);
+}
+
+/* Move the content up by "n" rows, the rows coming in at the bottom are blank */
+
+void grid_scroll(struct grid *g, int n)
+{
+	if(n <= 0) return;
+	if(n > g->rows) n = g->rows;
+	g->top = (g->top + n) % g->rows;
+	/* the rows rotated to the bottom still hold what scrolled off the top */
+	set_all_dirty(g);
+	grid_clear(g, g->rows - n, n, GRID_ATTR_DEFAULT);
+}
+
+/* memcpy() of "n" bytes, n >= 16, in 16 byte moves the compiler inlines; the last one may overlap.
+   Tile rows are a few dozen bytes, too short for a memcpy() call to pay off. */
+
+static inline void copy_row(uint8_t *dst, const uint8_t *src, int n)
+{
+    int k;
+	for(k = 0; k < n - 16; k += 16) memcpy(dst + k, src + k, 16);
+	memcpy(dst + n - 16, src + n - 16, 16);
+}
+
+/* Copy the "n" tiles gathered for grid row "row" a pixel row at a time, so the buffer is written in order */
+
+static void copy_run(struct grid *g, int row, int n)
+{
+    struct ctx *c = g->ctx;
+    int y, k, py = g->y + row * g->ch, tile_row = g->cw * g->bpp;
+
+	for(y = 0; y < g->ch; y++) {
+	    uint8_t *dst = (uint8_t *) c->buffer + (buffer_row(c, py + y) * c->stride + g->x) * g->bpp;
+	    if(tile_row >= 16) for(k = 0; k < n; k++)
+		copy_row(dst + g->run_cols[k] * tile_row, g->run_tiles[k] + y * tile_row, tile_row);
+	    else for(k = 0; k < n; k++)
+		memcpy(dst + g->run_cols[k] * tile_row, g->run_tiles[k] + y * tile_row, tile_row);
+	}
+	mark_dirty(c, g->x + g->run_cols[0] * g->cw, py, (g->run_cols[n - 1] - g->run_cols[0] + 1) * g->cw, g->ch);
+}
+
+/* Copy the cells that changed since the last call to ctx->buffer and mark them dirty.
+   The tiles to copy in a row are gathered first and then copied together. When the tile
+   cache fills up on the way, the tiles gathered so far are copied before it is emptied. */
+
+int grid_draw(struct grid *g)
+{
+    int row, w, n;
+
+	for(row = 0; row < g->rows; row++) {
+	    uint64_t *bits = g->dirty + row * g->words_per_row;
+	    uint32_t *shown = g->shown + row * g->cols;
+	    for(w = n = 0; w < g->words_per_row; w++) {
+		while(bits[w]) {
+		    int col = w * 64 + __builtin_ctzll(bits[w]);
+		    uint32_t v;
+		    bits[w] &= bits[w] - 1;
+		    if(col >= g->cols || shown[col] == (v = *cell(g, row, col))) continue;
+		    if(g->ntiles >= GRID_TILES * 3 / 4) {	/* rarely happens, start over */
+			if(n) copy_run(g, row, n);
+			n = 0;
+			memset(g->keys, 0, GRID_TILES * sizeof(uint32_t));
+			g->ntiles = 0;
+		    }
+		    if(!(g->run_tiles[n] = get_tile(g, v))) {
+			if(n) copy_run(g, row, n);	/* those are marked shown already */
+			set_dirty(g, row, col);		/* try this one again next time */
+			return -1;
+		    }
+		    g->run_cols[n++] = col;
+		    shown[col] = v;
+		}
+	    }
+	    if(n) copy_run(g, row, n);
+	}
+    return 0;
+}
@@ -0,0 +1,447 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <math.h>
+#include <locale.h>
+#include <pthread.h>
+
+#include "main.h"
+#include "metrics.h"
+
+/* Headless backend: runs the app core on a memory surface on Linux, so the
+   text pipeline can be benchmarked and its frames checked off the device.
+   Build with "make -f Makefile.host" in this directory. */
+
+/* The libraries ft.c and shape.c find loaded in an Android process are
+   linked normally here, under their upstream names */
+
+static const char *host_libs[][2] = {
+    { "libft2.so", "libfreetype.so.6" },
+    { "libharfbuzz_ng.so", "libharfbuzz.so.0" },
+    { 0, 0 }
+};
+
+void *fake_dlopen(const char *filename, int flags)
+{
+    const char *base = strrchr(filename, '/');
+    uint64_t t0 = metrics_ns();
+    void *handle;
+    int k;
+    TRACE_SCOPE(__func__);
+	base = base ? base + 1 : filename;
+	for(k = 0; host_libs[k][0] && strcmp(base, host_libs[k][0]) != 0; k++);
+	handle = dlopen(host_libs[k][0] ? host_libs[k][1] : filename, flags);
+	metrics_dlopen(metrics_ns() - t0, !handle);
+    return handle;
+}
+
+void *fake_dlsym(void *handle, const char *symbol)
+{
+    return dlsym(handle, symbol);
+}
+
+int fake_dlclose(void *handle)
+{
+    return dlclose(handle);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#define STALL_SECONDS	10	/* a generated source left this long without a frame is not going to show any */
+
+static const char *stage_names[STAGES] = { "metrics", "scroll", "render", "present" };
+
+/* Whether the app is still showing lines */
+
+static int running(struct ctx *ctx)
+{
+    int run;
+    pthread_mutex_lock(&ctx->mutex);
+    run = ctx->should_run && !ctx->source_done;
+    pthread_mutex_unlock(&ctx->mutex);
+    return run;
+}
+
+/* Numbers in words a second, one at a time and a batch at a time */
+
+static int bench_numbers(unsigned count)
+{
+    static char arena[1 << 16];
+    static const char *words[4096];
+    char buf[NUM2WORDS_MAX + 1];
+    unsigned k, n = 0;
+    size_t sum = 0;
+    double t0, t1, t2;
+
+	t0 = now();
+	for(k = 0; k < count; k++) sum += num2words(k, buf, sizeof(buf));
+	t1 = now();
+	for(k = 0; k < count; k += n) n = num2words_range(k, count - k < 4096 ? count - k : 4096, arena, sizeof(arena), words);
+	t2 = now();
+	printf("num2words: %.2f M numbers/s, %.1f bytes average\n", count / (t1 - t0) / 1e6, (double) sum / count);
+	printf("num2words_range: %.2f M numbers/s\n", count / (t2 - t1) / 1e6);
+
+    return 0;
+}
+
+/* Full screen, scrolling and sparse updates of a cols x rows cell grid */
+
+static int bench_grid(struct ctx *ctx, int cols, int rows, int count)
+{
+    static const char *what[] = { "full", "scroll", "sparse" };
+    struct grid *g = 0;
+    char buf[NUM2WORDS_MAX + 1];
+    double t, sum, worst;
+    unsigned seed = 1;
+    int cw, ch, ascent, k, m, r, col, ret = 1;
+
+	if(cols <= 0 || rows <= 0 || ft_get_cell_size(ctx, &cw, &ch, &ascent) != 0) return 1;
+	ctx->width = ctx->stride = cols * cw;	/* a surface the grid just fits */
+	ctx->height = rows * ch;
+	ctx->buffer = calloc(ctx->width * ctx->height, ctx->fmt == WINDOW_FORMAT_RGB_565 ? 2 : 4);
+	if(!ctx->buffer || !(g = grid_create(ctx, 0, 0, rows, cols)) || grid_draw(g) != 0) goto done;
+	printf("%d x %d cells of %d x %d, %d x %d pixels\n", cols, rows, cw, ch, ctx->width, ctx->height);
+	for(m = 0; m < 3; m++) {
+	    for(k = -1, sum = worst = 0; k < count; k++) {	/* the first one warms the tile cache up */
+		t = now();
+		if(m == 0) {	/* every cell changes */
+		    for(r = 0; r < rows; r++)
+			for(col = 0; col < cols; col++)
+			    grid_put(g, r, col, '!' + (r * cols + col + k + 1) % 94, GRID_ATTR(1 + (r + k + 1) % 7, 0));
+		} else if(m == 1) {
+		    grid_scroll(g, 1);
+		    num2words(k + 1, buf, sizeof(buf));
+		    grid_print(g, rows - 1, 0, buf, GRID_ATTR_DEFAULT);
+		} else for(r = 0; r < rows * cols / 100; r++) {
+		    seed = seed * 1103515245 + 12345;
+		    grid_put(g, (seed >> 8) % rows, (seed >> 16) % cols, '!' + (seed >> 4) % 94, GRID_ATTR((seed >> 12) % 8, 0));
+		}
+		if(grid_draw(g) != 0) goto done;
+		t = now() - t;
+		ctx->dirty.n = 0;
+		if(k < 0) continue;
+		sum += t;
+		if(t > worst) worst = t;
+	    }
+	    printf("  %-8s %8.1f us average, %8.1f us worst\n", what[m], sum / count * 1e6, worst * 1e6);
+	}
+	ret = 0;
+
+    done:
+	grid_destroy(g);
+	free(ctx->buffer);
+	ctx->buffer = 0;
+	return ret;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Frame time percentiles of "n" frames */
+
+static void frame_times(const char *what, double *ft, int n, int rows)
+{
+	if(!n) return;
+	qsort(ft, n, sizeof(double), cmp_double);
+	printf("  %4d frames of %d lines %s: p50 %.1f us, p99 %.1f us, worst %.1f us\n", n, rows, what,
+		ft[n / 2] * 1e6, ft[n * 99 / 100] * 1e6, ft[n - 1] * 1e6);
+}
+
+/* Open a document and scroll through it, a screenful a frame while it is indexed and
+   then in jumps from one end to the other, then time finding lines by byte offset */
+
+static int bench_doc(struct ctx *ctx, const char *file, int width, int height, int count)
+{
+    int rows = height / ft_get_line_height(ctx) - 1, done = 0, k, m = 0, ret = 1;
+    double *ft = (double *) malloc(count * sizeof(double)), t, t0, t_indexed = 0;
+    unsigned n = 0, first = 0, seed = 1, sum = 0;
+    size_t size;
+    struct doc *d;
+
+	ctx->width = ctx->stride = width;
+	ctx->height = height;
+	ctx->buffer = calloc(width * height, ctx->fmt == WINDOW_FORMAT_RGB_565 ? 2 : 4);
+	ft_set_clip(ctx, 0);
+	if(!ft || !ctx->buffer || rows < 1) goto failed;
+	t0 = now();
+	if(!(d = doc_open(ctx, file, width - 20))) goto failed;
+	for(k = 0; k < count; k++) {
+	    t = now();
+	    doc_pump(d);
+	    n = doc_lines(d, &done);
+	    if(done && !t_indexed) {
+		t_indexed = t - t0;
+		m = k;		/* frames drawn while indexing */
+	    }
+	    /* a screenful down while indexing, then across all of it */
+	    first = done ? (uint64_t) n * (k * 7919 % count) / count : first + rows < n ? first + rows : 0;
+	    if(doc_draw(d, first, 10, 0, rows) != 0) break;
+	    ctx->dirty.n = 0;
+	    ft[k] = now() - t;
+	}
+	while(!(n = doc_lines(d, &done), done)) {	/* in case drawing the frames took less time */
+	    if(!doc_pump(d)) usleep(1000);
+	}
+	if(!t_indexed) {
+	    t_indexed = now() - t0;
+	    m = k;
+	}
+	size = doc_line_offset(d, n);
+	printf("%s: %.1f MB, %u lines at %d pixels indexed in %.2f s, %.1f MB/s%s\n", file, size / 1e6, n, width - 20,
+		t_indexed, size / t_indexed / 1e6, done < 0 ? ", failed" : "");
+	frame_times("while indexing", ft, m, rows);
+	frame_times("after", ft + m, k - m, rows);
+	t = now();
+	for(k = 0; k < 1000000; k++) {
+	    seed = seed * 1103515245 + 12345;
+	    sum += doc_find(d, size ? (size_t) seed % size : 0);
+	}
+	printf("  doc_find: %.0f ns a lookup\n", (now() - t) / k * 1e9 + 0 * sum);
+	/* a tenth narrower: the frame after it only wraps what it shows, the index follows */
+	size = doc_line_offset(d, first);
+	t = now();
+	if(doc_set_width(d, (width - 20) * 9 / 10) == 0 && doc_draw_at(d, size, 10, 0, rows) == 0) {
+	    t_indexed = now() - t;
+	    while(!(n = doc_lines(d, &done), done)) {
+		if(!doc_pump(d)) usleep(1000);
+	    }
+	    printf("  width change: %.2f ms to the next frame, %.2f s to index all %u lines again\n",
+		    t_indexed * 1e3, now() - t, n);
+	}
+	doc_close(d);
+	ret = 0;
+
+    failed:
+	free(ft);
+	free(ctx->buffer);
+	ctx->buffer = 0;
+	return ret;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [options]\n"
+	"  -w width -h height	surface size (1080 x 1920)\n"
+	"  -f rgb565|rgba8888	pixel format (rgb565)\n"
+	"  -d dpi		pixel density (480)\n"
+	"  -b buffers		surface buffers used round robin (3)\n"
+	"  -F file -s size	face and its size in points\n"
+	"  -r rate		lines per second to aim for, 0 for no pacing (0),\n"
+	"			or frames per second for a stream (60)\n"
+	"  -x numbers|random|file|-	text source: numbers in words, random words,\n"
+	"			the lines of a file or a stream on stdin (numbers)\n"
+	"  -T rate		touch samples per second to send, 0 for none (0)\n"
+	"  -V rate		display refresh rate frames are paced by, 0 for none (0)\n"
+	"  -c mono|virtual	clock of the display: real time, or virtual time that\n"
+	"			jumps to what is waited for, the same every run (mono)\n"
+	"  -n frames		stop after this many frames\n"
+	"  -t seconds		stop after this long (10 unless -n is given)\n"
+	"  -o pattern		write frames to PPM files, e.g. frame%%05u.ppm\n"
+	"  -S seconds		print the text engine counters this often\n"
+	"  -M file		publish the metrics page in file instead of a memfd\n"
+	"  -v			log what the app logs\n"
+#ifdef TRACING
+	"  -P file		write a Chrome trace of the run to file\n"
+#endif
+	"  -N count		time numbers in words instead\n"
+	"  -G colsxrows		time updates of a cell grid instead, -n of each (1000)\n"
+	"  -D file		time scrolling through a document instead, -n frames (1000)\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    int width = 1080, height = 1920, fmt = WINDOW_FORMAT_RGB_565, dpi = 480, buffers = 3;
+    int size = DEFAULT_FSIZE, opt, k, grid_cols = 0, grid_rows = 0;
+    double rate = 0, touch_rate = 0, next_touch = 0, vsync_rate = 0;
+    unsigned frames = 0, n;
+    double seconds = 0, t0, t, stats_every = 0, next_stats = 0, last_frame = 0;
+    unsigned last_n = 0;
+    struct ft_stats fst;
+    char line[512];
+    const char *face = 0, *dump = 0, *metrics = 0, *source = "numbers", *doc = 0, *clock = "mono";
+    struct frame_clock *clk;
+    struct text_source *src;
+    struct app_stats *st;
+    struct surface *s;
+    struct ctx *ctx;
+    struct timespec tick = { 0, 1000000 };
+
+	setlocale(LC_ALL, "C.UTF-8");	/* for mbrtowc() in ft.c */
+	log_set_level(LOG_LEVEL_ERROR);	/* the app's log goes to stderr, with -v all of it */
+	atexit(log_flush);
+	while((opt = getopt(argc, argv, "w:h:f:d:b:F:s:r:x:T:V:c:n:t:o:S:M:vP:N:G:D:")) != -1) {
+	    switch(opt) {
+		case 'w': width = atoi(optarg); break;
+		case 'h': height = atoi(optarg); break;
+		case 'f':
+		    if(strcmp(optarg, "rgb565") == 0) fmt = WINDOW_FORMAT_RGB_565;
+		    else if(strcmp(optarg, "rgba8888") == 0) fmt = WINDOW_FORMAT_RGBA_8888;
+		    else {
+			usage(argv[0]);
+			return 1;
+		    }
+		    break;
+		case 'd': dpi = atoi(optarg); break;
+		case 'b': buffers = atoi(optarg); break;
+		case 'F': face = optarg; break;
+		case 's': size = atoi(optarg); break;
+		case 'r': rate = atof(optarg); break;
+		case 'x': source = optarg; break;
+		case 'T': touch_rate = atof(optarg); break;
+		case 'V': vsync_rate = atof(optarg); break;
+		case 'c': clock = optarg; break;
+		case 'n': frames = strtoul(optarg, 0, 10); break;
+		case 'S': next_stats = stats_every = atof(optarg); break;
+		case 'M': metrics = optarg; break;
+		case 't': seconds = atof(optarg); break;
+		case 'o': dump = optarg; break;
+		case 'v': log_set_level(LOG_LEVEL_INFO); break;
+#ifdef TRACING
+		case 'P':	/* written when it exits */
+		    if(trace_start(optarg) != 0 || atexit(trace_stop) != 0) return 1;
+		    break;
+#endif
+		case 'N': return bench_numbers(strtoul(optarg, 0, 10));
+		case 'D': doc = optarg; break;
+		case 'G':
+		    if(sscanf(optarg, "%dx%d", &grid_cols, &grid_rows) != 2 || grid_cols <= 0 || grid_rows <= 0) {
+			usage(argv[0]);
+			return 1;
+		    }
+		    break;
+		default:
+		    usage(argv[0]);
+		    return 1;
+	    }
+	}
+	if(width <= 0 || height <= 0 || dpi <= 0 || buffers <= 0 || size <= 0 || rate < 0 || touch_rate < 0 || vsync_rate < 0
+		|| (strcmp(clock, "mono") != 0 && strcmp(clock, "virtual") != 0)) {
+	    usage(argv[0]);
+	    return 1;
+	}
+	if(!frames && seconds <= 0) seconds = 10;
+
+	ctx = app_create(dpi, fmt);
+	if(!ctx) return 1;
+	ctx->metrics = metrics_create(metrics);	/* see metrics_cli.c */
+	if((face || size != DEFAULT_FSIZE) && ft_set_face(ctx, face ? face : DEFAULT_FACE, size) != 0) {
+	    log_error("failed to set face %s", face ? face : DEFAULT_FACE);
+	    app_destroy(ctx);
+	    return 1;
+	}
+	if(doc) {
+	    k = bench_doc(ctx, doc, width, height, frames ? frames : 1000);
+	    app_destroy(ctx);
+	    return k;
+	}
+	if(grid_cols) {
+	    k = bench_grid(ctx, grid_cols, grid_rows, frames ? frames : 1000);
+	    app_destroy(ctx);
+	    return k;
+	}
+	if(strcmp(source, "numbers") == 0) src = numbers_source_create();
+	else if(strcmp(source, "random") == 0) src = random_source_create(1);
+	else if(strcmp(source, "-") == 0) {
+	    src = fd_source_create(0);
+	    source = "stdin";
+	    if(!rate) rate = 60;
+	} else src = file_source_create(source);
+	ctx->period = rate ? 1e9 / rate : 0;
+	ctx->stats = st = (struct app_stats *) calloc(1, sizeof(struct app_stats));
+	if(!src || !st) {
+	    if(src) src->destroy(src);
+	    app_destroy(ctx);
+	    return 1;
+	}
+	ctx->source->destroy(ctx->source);
+	ctx->source = src;
+	clk = strcmp(clock, "virtual") == 0 ? virtual_clock_create(vsync_rate ? 1e9 / vsync_rate : 0)
+		: mono_clock_create(vsync_rate ? 1e9 / vsync_rate : 0);
+	if(!clk) {
+	    app_destroy(ctx);
+	    return 1;
+	}
+	ctx->clock->destroy(ctx->clock);
+	ctx->clock = clk;
+	s = mem_surface_create(width, height, fmt, buffers);
+	if(!s) {
+	    app_destroy(ctx);
+	    return 1;
+	}
+	if(dump) mem_surface_dump(s, dump);
+	mem_surface_limit(s, frames);
+
+	t0 = now();
+	if(app_start(ctx, s, width, height, width) != 0) {
+	    app_destroy(ctx);
+	    return 1;
+	}
+	app_redraw(ctx);
+	do {
+	    nanosleep(&tick, 0);
+	    n = mem_surface_frames(s);
+	    t = now() - t0;
+	    if(n != last_n) {
+		last_n = n;
+		last_frame = t;
+	    } else if(!src->take && t - last_frame > STALL_SECONDS + 2.0 * ctx->period / 1e9) {
+		fprintf(stderr, "no frame in %.0f s, e.g. lines too long for the screen, stopping\n", t - last_frame);
+		break;
+	    }
+	    /* a finger going round a circle, a sample at a time like a touch screen reports them */
+	    if(touch_rate && t >= next_touch) {
+		struct touch sample = { width / 2 + width / 4 * cos(t * 2), height / 2 + width / 4 * sin(t * 2), (t0 + t) * 1e9 };
+		app_touch(ctx, &sample, 1);
+		next_touch += 1 / touch_rate;
+		if(next_touch < t) next_touch = t;
+	    }
+	    /* read while app_thread draws, like a monitor would */
+	    if(stats_every > 0 && t >= next_stats) {
+		ft_get_stats(ctx, &fst);
+		ft_format_stats(&fst, line, sizeof(line));
+		printf("%.2f s: %s\n", t, line);
+		next_stats += stats_every;
+	    }
+	} while((!frames || n < frames) && (seconds <= 0 || t < seconds) && running(ctx));
+	t = now() - t0;
+	app_stop(ctx);
+	n = mem_surface_frames(s);
+
+	printf("%d x %d %s, %d dpi, %d buffers%s: %u frames in %.2f s, %.1f frames/s\n",
+		width, height, fmt == WINDOW_FORMAT_RGB_565 ? "rgb565" : "rgba8888", dpi, buffers,
+#ifdef ZERO_COPY
+		", zero copy",
+#else
+		"",
+#endif
+		n, t, n / t);
+	printf("%s: %.0f lines/s, %.0f glyphs/s, %.1f MB/s blitted\n", source,
+		st->lines / t, st->glyphs / t, st->blitted / t / 1e6);
+	if(src->take) printf("%s: %llu batches, %llu lines dropped\n", source, st->frames, st->dropped);
+	if(vsync_rate) printf("%s clock at %.0f Hz: %llu frames presented, %llu late for their vsync\n",
+		clock, vsync_rate, ctx->presented, ctx->missed);
+	for(k = 0; k < STAGES; k++)
+	    printf("  %-8s p50 %8.1f us   p99 %8.1f us\n", stage_names[k],
+		    hist_percentile(st->hist[k], 50) / 1e3, hist_percentile(st->hist[k], 99) / 1e3);
+	if(st->touches)
+	    printf("touch: %llu samples in %llu frames, input to present p50 %.1f us, p99 %.1f us\n", st->touches,
+		    st->touch_frames, hist_percentile(st->touch_hist, 50) / 1e3, hist_percentile(st->touch_hist, 99) / 1e3);
+	ft_get_stats(ctx, &fst);
+	ft_format_stats(&fst, line, sizeof(line));
+	printf("engine: %s\n", line);
+	app_destroy(ctx);
+
+    return 0;
+}
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "main.h"
+
+/* Line break opportunities after UAX #14, the Unicode line breaking algorithm.
+   Chars are fed one at a time to lb_next(), which tells whether a line may, must or
+   may not be broken before the char, from its line break class and what came before.
+   Classes come from a compact table: ASCII directly, everything else as ranges of
+   chars sharing a class, looked up by bisection. The ranges cover the scripts and
+   punctuation this app meets; within them the table is tailored the way CSS "normal"
+   breaking is: small kana break like other ideographs, precomposed Hangul syllables
+   are ideographs too, and the South East Asian scripts that need a dictionary are
+   left unbroken as letters. Ambiguous and unknown chars are letters. */
+
+enum {
+    BK, CR, LF, NL, SP, ZW, ZWJ, CM, WJ, GL, BA, BB, B2, HY, CB, CL, CP, EX, IN, NS,
+    OP, QU, IS, NU, PO, PR, SY, AL, HL, ID, JL, JV, JT, RI, EB, EM
+};
+
+static const uint8_t ascii_class[128] = {
+    [0x00 ... 0x08] = CM, [0x09] = BA, [0x0a] = LF, [0x0b ... 0x0c] = BK, [0x0d] = CR,
+    [0x0e ... 0x1f] = CM, [' '] = SP, ['!'] = EX, ['"'] = QU, ['#'] = AL, ['$'] = PR,
+    ['%'] = PO, ['&'] = AL, ['\''] = QU, ['('] = OP, [')'] = CP, ['*'] = AL, ['+'] = PR,
+    [','] = IS, ['-'] = HY, ['.'] = IS, ['/'] = SY, ['0' ... '9'] = NU, [':' ... ';'] = IS,
+    ['<' ... '>'] = AL, ['?'] = EX, ['@' ... 'Z'] = AL, ['['] = OP, ['\\'] = PR, [']'] = CP,
+    ['^' ... 'z'] = AL, ['{'] = OP, ['|'] = BA, ['}'] = CL, ['~'] = AL, [0x7f] = CM
+};
+
+/* Chars from U+0080 on: the first char of each range << 8 | its class */
+#define R(c, cls)	((uint32_t) (c) << 8 | (cls))
+static const uint32_t ranges[] = {
+    R(0x80, CM), R(0x85, NL), R(0x86, CM), R(0xa0, GL), R(0xa1, OP), R(0xa2, PO), R(0xa3, PR),
+    R(0xa6, AL), R(0xab, QU), R(0xac, AL), R(0xad, BA), R(0xae, AL), R(0xb0, PO), R(0xb1, PR),
+    R(0xb2, AL), R(0xb4, BB), R(0xb5, AL), R(0xbb, QU), R(0xbc, AL), R(0xbf, OP), R(0xc0, AL),
+    R(0x300, CM), R(0x370, AL), R(0x483, CM), R(0x48a, AL),
+    /* Hebrew and Arabic */
+    R(0x591, CM), R(0x5be, BA), R(0x5bf, CM), R(0x5c0, AL), R(0x5c1, CM), R(0x5c8, AL),
+    R(0x5d0, HL), R(0x5f3, AL), R(0x610, CM), R(0x61b, AL), R(0x64b, CM), R(0x660, NU),
+    R(0x66a, AL), R(0x670, CM), R(0x671, AL), R(0x6d6, CM), R(0x6de, AL), R(0x6f0, NU), R(0x6fa, AL),
+    /* Devanagari */
+    R(0x900, CM), R(0x904, AL), R(0x93a, CM), R(0x950, AL), R(0x951, CM), R(0x958, AL),
+    R(0x962, CM), R(0x964, BA), R(0x966, NU), R(0x970, AL),
+    /* Thai digits and word separators */
+    R(0xe50, NU), R(0xe5a, BA), R(0xe5c, AL),
+    /* Hangul jamo */
+    R(0x1100, JL), R(0x1160, JV), R(0x11a8, JT), R(0x1200, AL), R(0x1361, BA), R(0x1362, AL),
+    R(0x1680, BA), R(0x1681, AL), R(0x1ab0, CM), R(0x1b00, AL), R(0x1dc0, CM), R(0x1e00, AL),
+    /* General Punctuation */
+    R(0x2000, BA), R(0x2007, GL), R(0x2008, BA), R(0x200b, ZW), R(0x200c, CM), R(0x200d, ZWJ),
+    R(0x200e, CM), R(0x2010, BA), R(0x2011, GL), R(0x2012, BA), R(0x2014, B2), R(0x2015, AL),
+    R(0x2018, QU), R(0x201a, OP), R(0x201b, QU), R(0x201e, OP), R(0x201f, QU), R(0x2020, AL),
+    R(0x2024, IN), R(0x2027, BA), R(0x2028, BK), R(0x202a, CM), R(0x202f, GL), R(0x2030, PO),
+    R(0x2038, AL), R(0x2039, QU), R(0x203b, AL), R(0x203c, NS), R(0x203e, AL), R(0x2044, IS),
+    R(0x2045, OP), R(0x2046, CL), R(0x2047, NS), R(0x204a, AL), R(0x2056, BA), R(0x2057, AL),
+    R(0x2058, BA), R(0x205c, AL), R(0x205d, BA), R(0x2060, WJ), R(0x2061, AL), R(0x2066, CM),
+    R(0x2070, AL), R(0x207d, OP), R(0x207e, CL), R(0x207f, AL), R(0x208d, OP), R(0x208e, CL),
+    R(0x208f, AL), R(0x20a0, PR), R(0x20d0, CM), R(0x2100, AL), R(0x2103, PO), R(0x2104, AL),
+    R(0x2109, PO), R(0x210a, AL), R(0x2116, PR), R(0x2117, AL),
+    /* CJK */
+    R(0x2e80, ID), R(0x3000, BA), R(0x3001, CL), R(0x3003, ID), R(0x3005, NS), R(0x3006, ID),
+    R(0x3008, OP), R(0x3009, CL), R(0x300a, OP), R(0x300b, CL), R(0x300c, OP), R(0x300d, CL),
+    R(0x300e, OP), R(0x300f, CL), R(0x3010, OP), R(0x3011, CL), R(0x3012, ID), R(0x3014, OP),
+    R(0x3015, CL), R(0x3016, OP), R(0x3017, CL), R(0x3018, OP), R(0x3019, CL), R(0x301a, OP),
+    R(0x301b, CL), R(0x301c, NS), R(0x301d, OP), R(0x301e, CL), R(0x3020, ID), R(0x302a, CM),
+    R(0x3030, ID), R(0x303b, NS), R(0x303d, ID), R(0x3099, CM), R(0x309b, NS), R(0x309f, ID),
+    R(0x30a0, NS), R(0x30a1, ID), R(0x30fb, NS), R(0x30ff, ID), R(0xa4d0, AL), R(0xac00, ID),
+    R(0xd7b0, JV), R(0xd7cb, JT), R(0xd800, AL), R(0xf900, ID), R(0xfb00, AL), R(0xfb1d, HL),
+    R(0xfb50, AL), R(0xfe00, CM), R(0xfe10, IS), R(0xfe11, CL), R(0xfe13, IS), R(0xfe15, EX),
+    R(0xfe17, OP), R(0xfe18, CL), R(0xfe19, IN), R(0xfe1a, AL), R(0xfe20, CM), R(0xfe30, ID),
+    R(0xfe70, AL), R(0xfeff, WJ),
+    /* fullwidth and halfwidth forms */
+    R(0xff00, AL), R(0xff01, EX), R(0xff02, ID), R(0xff04, PR), R(0xff05, PO), R(0xff06, ID),
+    R(0xff08, OP), R(0xff09, CL), R(0xff0a, ID), R(0xff0c, CL), R(0xff0d, ID), R(0xff0e, CL),
+    R(0xff0f, ID), R(0xff1a, NS), R(0xff1c, ID), R(0xff1f, EX), R(0xff20, ID), R(0xff3b, OP),
+    R(0xff3c, ID), R(0xff3d, CL), R(0xff3e, ID), R(0xff5b, OP), R(0xff5c, ID), R(0xff5d, CL),
+    R(0xff5e, ID), R(0xff5f, OP), R(0xff60, CL), R(0xff62, OP), R(0xff63, CL), R(0xff65, NS),
+    R(0xff66, ID), R(0xff9e, NS), R(0xffa0, AL), R(0xffe0, PO), R(0xffe1, PR), R(0xffe2, ID),
+    R(0xffe5, PR), R(0xffe7, AL), R(0xfff9, CM), R(0xfffc, CB), R(0xfffd, AL),
+    /* emoji, the supplementary ideographic planes and tags */
+    R(0x1f000, ID), R(0x1f1e6, RI), R(0x1f200, ID), R(0x1f3fb, EM), R(0x1f400, ID), R(0x1fb00, AL),
+    R(0x20000, ID), R(0x40000, AL), R(0xe0001, CM), R(0xe0080, AL), R(0xe0100, CM), R(0xe01f0, AL)
+};
+
+#define NRANGES	(sizeof(ranges) / sizeof(ranges[0]))
+
+/* Class of "c". The range found last is tried first, text mostly stays in one script. */
+
+static inline int lb_class(struct lb_state *st, uint32_t c)
+{
+    int lo = 0, hi = NRANGES, mid;
+	if(c < 0x80) return ascii_class[c];
+	lo = st->range;
+	if(ranges[lo] >> 8 <= c && (lo == NRANGES - 1 || ranges[lo + 1] >> 8 > c)) return ranges[lo] & 0xff;
+	lo = 0;
+	while(hi - lo > 1) {	/* range lo starts at or before c */
+	    mid = (lo + hi) / 2;
+	    if(ranges[mid] >> 8 <= c) lo = mid;
+	    else hi = mid;
+	}
+	st->range = lo;
+    return ranges[lo] & 0xff;
+}
+
+#define BIT(c)		(1ull << (c))
+#define ONE_OF(c, m)	(BIT(c) & (m))
+
+void lb_init(struct lb_state *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->last = st->base = BK;		/* as if after a hard break: LB2, no break at the start */
+}
+
+/* Between "prev" (SP after spaces) and "c", neither of them hard breaks, both resolved
+   past combining marks; st->base is the class of the last char that is not a space */
+
+static int pair(const struct lb_state *st, int prev, int c)
+{
+    int base = st->base;
+	if(c == WJ || prev == WJ || prev == GL) return LB_NONE;		/* LB11, LB12 */
+	if(c == GL && !ONE_OF(prev, BIT(SP) | BIT(BA) | BIT(HY))) return LB_NONE;	/* LB12a */
+	if(ONE_OF(c, BIT(CL) | BIT(CP) | BIT(EX) | BIT(IS) | BIT(SY))) return LB_NONE;	/* LB13 */
+	if(base == OP) return LB_NONE;					/* LB14: OP SP* x */
+	if(base == QU && c == OP) return LB_NONE;			/* LB15 */
+	if((base == CL || base == CP) && c == NS) return LB_NONE;	/* LB16 */
+	if(base == B2 && c == B2) return LB_NONE;			/* LB17 */
+	if(prev == SP) return LB_ALLOW;					/* LB18 */
+	if(c == QU || prev == QU) return LB_NONE;			/* LB19 */
+	if(c == CB || prev == CB) return LB_ALLOW;			/* LB20 */
+	if(ONE_OF(c, BIT(BA) | BIT(HY) | BIT(NS)) || prev == BB) return LB_NONE;	/* LB21 */
+	if(st->hl_hy) return LB_NONE;					/* LB21a: HL (HY | BA) x */
+	if(prev == SY && c == HL) return LB_NONE;			/* LB21b */
+	if(c == IN) return LB_NONE;					/* LB22 */
+	if(ONE_OF(prev, BIT(AL) | BIT(HL)) && c == NU) return LB_NONE;		/* LB23 */
+	if(prev == NU && ONE_OF(c, BIT(AL) | BIT(HL))) return LB_NONE;
+	if(prev == PR && ONE_OF(c, BIT(ID) | BIT(EB) | BIT(EM))) return LB_NONE;	/* LB23a */
+	if(ONE_OF(prev, BIT(ID) | BIT(EB) | BIT(EM)) && c == PO) return LB_NONE;
+	if(ONE_OF(prev, BIT(PR) | BIT(PO)) && ONE_OF(c, BIT(AL) | BIT(HL))) return LB_NONE;	/* LB24 */
+	if(ONE_OF(prev, BIT(AL) | BIT(HL)) && ONE_OF(c, BIT(PR) | BIT(PO))) return LB_NONE;
+	/* LB25, as pairs */
+	if(ONE_OF(prev, BIT(CL) | BIT(CP) | BIT(NU)) && ONE_OF(c, BIT(PO) | BIT(PR))) return LB_NONE;
+	if(ONE_OF(prev, BIT(PO) | BIT(PR)) && ONE_OF(c, BIT(OP) | BIT(NU))) return LB_NONE;
+	if(ONE_OF(prev, BIT(HY) | BIT(IS) | BIT(NU) | BIT(SY)) && c == NU) return LB_NONE;
+	/* LB26, LB27: Korean syllable blocks */
+	if(prev == JL && ONE_OF(c, BIT(JL) | BIT(JV))) return LB_NONE;
+	if(prev == JV && ONE_OF(c, BIT(JV) | BIT(JT))) return LB_NONE;
+	if(prev == JT && c == JT) return LB_NONE;
+	if(ONE_OF(prev, BIT(JL) | BIT(JV) | BIT(JT)) && c == PO) return LB_NONE;
+	if(prev == PR && ONE_OF(c, BIT(JL) | BIT(JV) | BIT(JT))) return LB_NONE;
+	if(ONE_OF(prev, BIT(AL) | BIT(HL)) && ONE_OF(c, BIT(AL) | BIT(HL))) return LB_NONE;	/* LB28 */
+	if(prev == IS && ONE_OF(c, BIT(AL) | BIT(HL))) return LB_NONE;		/* LB29 */
+	if(ONE_OF(prev, BIT(AL) | BIT(HL) | BIT(NU)) && c == OP) return LB_NONE;	/* LB30 */
+	if(prev == CP && ONE_OF(c, BIT(AL) | BIT(HL) | BIT(NU))) return LB_NONE;
+	if(prev == RI && c == RI && (st->ri & 1)) return LB_NONE;	/* LB30a: flags are pairs */
+	/* LB30b, any ideograph taken for an emoji base: the table does not tell them apart */
+	if(ONE_OF(prev, BIT(EB) | BIT(ID)) && c == EM) return LB_NONE;
+    return LB_ALLOW;							/* LB31 */
+}
+
+/* Whether the line may be broken before "ch", which follows the chars fed so far */
+
+int lb_next(struct lb_state *st, uint32_t ch)
+{
+    int c = lb_class(st, ch), prev = st->last, r;
+
+	if(c == AL && prev == AL) {	/* most of the text, LB28 */
+	    st->zwj = st->hl_hy = st->ri = 0;
+	    return LB_NONE;
+	}
+	if(prev == BK || prev == LF || prev == NL) r = st->started ? LB_MUST : LB_NONE;	/* LB4, LB5 */
+	else if(prev == CR) r = c == LF ? LB_NONE : LB_MUST;
+	else if(ONE_OF(c, BIT(BK) | BIT(CR) | BIT(LF) | BIT(NL) | BIT(SP) | BIT(ZW))) r = LB_NONE;	/* LB6, LB7 */
+	else if(st->base == ZW) r = LB_ALLOW;				/* LB8: ZW SP* / */
+	else if(st->zwj) r = LB_NONE;					/* LB8a */
+	else if((c == CM || c == ZWJ) && prev != SP && prev != ZW) {
+	    /* LB9: a mark takes the class of its base */
+	    st->zwj = c == ZWJ;
+	    return LB_NONE;
+	} else {
+	    if(c == CM || c == ZWJ) c = AL;				/* LB10 */
+	    r = pair(st, prev, c);
+	}
+	if(c == CM || c == ZWJ) c = AL;	/* a mark after a break, a space or at the start */
+	st->started = 1;
+	st->zwj = ch == 0x200d;
+	st->last = c;
+	if(c == SP) {
+	    st->ri = 0;
+	    return r;
+	}
+	st->hl_hy = (c == HY || c == BA) && prev == HL;
+	st->ri = c == RI ? st->ri + 1 : 0;
+	st->base = c;
+
+    return r;
+}
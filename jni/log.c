@@ -0,0 +1,466 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/types.h>
+#include <sys/prctl.h>
+#ifdef __ANDROID__
+#include <android/log.h>
+#endif
+
+#include "log.h"
+
+/* Logging.
+   log_write() takes no lock and makes no system call: it copies the format pointer, the
+   arguments and a CLOCK_MONOTONIC time into a ring of the calling thread, to be formatted
+   and written out by the logger thread, every LOG_PERIOD or as soon as there is an error
+   or the ring is half full. It writes the rings of all threads in time order. When a ring is
+   full its thread's messages are dropped and counted. A format logged more than LOG_BURST
+   times a second is counted instead for the rest of the second. The ring of a thread that
+   exited goes to the next new one. */
+
+#define LOG_RING	(1 << 16)	/* bytes per thread, a power of 2 */
+#define LOG_MAX		1024		/* longest message, with its arguments or formatted */
+#define LOG_PERIOD	10000000	/* ns */
+#define LOG_BURST	20		/* messages of one format a second */
+#define LOG_FORMATS	64		/* formats the burst limit keeps track of, a power of 2 */
+#define LOG_PAD		0x80000000u	/* in log_rec.size: skip to the start of the ring */
+
+struct log_rec {
+    uint32_t size;			/* with the arguments, a multiple of 8 */
+    int level;
+    const char *tag, *fmt;
+    uint64_t ts;
+    /* then 8 bytes an argument, strings as their length and the bytes with a 0 */
+};
+
+struct log_ring {
+    struct log_ring *next;		/* all rings, newest first */
+    atomic_int idle;			/* its thread exited */
+    atomic_uint head, tail;		/* bytes written and read */
+    atomic_uint dropped;
+    char buf[LOG_RING] __attribute__((aligned(8)));
+};
+
+/* A conversion in a format */
+struct log_conv {
+    const char *start, *len, *end;	/* of its "%", length modifier and the end */
+    int stars;				/* int arguments for "*" width or precision */
+    char size;				/* 'H' for hh, 'Q' for ll, else the length modifier or 0 */
+    char conv;
+};
+
+atomic_int log_min;
+static _Atomic(struct log_ring *) rings;
+static __thread struct log_ring *ring;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static sem_t wake;
+static int logger_failed;		/* then log_write() writes out itself */
+
+static struct {
+    const char *fmt, *tag;
+    int level;
+    uint64_t second;
+    unsigned n, suppressed;
+} formats[LOG_FORMATS];
+
+static inline uint64_t log_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Find the next conversion from "fmt" on, return its end or 0 when there are no more */
+
+static const char *next_conv(const char *fmt, struct log_conv *c)
+{
+	for(; *fmt; fmt++) {
+	    if(*fmt != '%') continue;
+	    if(fmt[1] != '%') break;
+	    fmt++;
+	}
+	if(!*fmt) return 0;
+	c->start = fmt++;
+	c->stars = 0;
+	while(*fmt == '-' || *fmt == '+' || *fmt == ' ' || *fmt == '#' || *fmt == '0' || *fmt == '\'') fmt++;
+	if(*fmt == '*') c->stars++, fmt++;
+	else while(*fmt >= '0' && *fmt <= '9') fmt++;
+	if(*fmt == '.') {
+	    fmt++;
+	    if(*fmt == '*') c->stars++, fmt++;
+	    else while(*fmt >= '0' && *fmt <= '9') fmt++;
+	}
+	c->len = fmt;
+	c->size = 0;
+	switch(*fmt) {
+	    case 'h': case 'l':
+		c->size = *fmt++;
+		if(*fmt == c->size) c->size = c->size == 'h' ? 'H' : 'Q', fmt++;
+		break;
+	    case 'j': case 'z': case 't': case 'L':
+		c->size = *fmt++;
+		break;
+	}
+	if(!(c->conv = *fmt)) return 0;
+    return c->end = fmt + 1;
+}
+
+static int64_t signed_arg(va_list *ap, char size)
+{
+	switch(size) {
+	    case 'H': return (signed char) va_arg(*ap, int);
+	    case 'h': return (short) va_arg(*ap, int);
+	    case 'l': return va_arg(*ap, long);
+	    case 'Q': return va_arg(*ap, long long);
+	    case 'j': return va_arg(*ap, intmax_t);
+	    case 'z': return va_arg(*ap, ssize_t);
+	    case 't': return va_arg(*ap, ptrdiff_t);
+	}
+    return va_arg(*ap, int);
+}
+
+static uint64_t unsigned_arg(va_list *ap, char size)
+{
+	switch(size) {
+	    case 'H': return (unsigned char) va_arg(*ap, unsigned);
+	    case 'h': return (unsigned short) va_arg(*ap, unsigned);
+	    case 'l': return va_arg(*ap, unsigned long);
+	    case 'Q': return va_arg(*ap, unsigned long long);
+	    case 'j': return va_arg(*ap, uintmax_t);
+	    case 'z': return va_arg(*ap, size_t);
+	    case 't': return va_arg(*ap, ptrdiff_t);
+	}
+    return va_arg(*ap, unsigned);
+}
+
+/* Copy the arguments "fmt" takes from "ap" to "p", as many as fit before "end" */
+
+static char *put_args(char *p, const char *end, const char *fmt, va_list *ap)
+{
+    union { int64_t i; uint64_t u; double d; } *slot;
+    struct log_conv c;
+    const char *s;
+    char *start;
+    size_t n;
+    int k;
+
+	while((fmt = next_conv(fmt, &c))) {
+	    if(end - p < 8 * (c.stars + 2)) break;	/* the rest show as "..." */
+	    start = p;
+	    for(k = 0; k < c.stars; k++, p += 8) ((int64_t *) p)[0] = va_arg(*ap, int);
+	    slot = (void *) p;
+	    p += 8;
+	    switch(c.conv) {
+		case 'd': case 'i':
+		    slot->i = signed_arg(ap, c.size);
+		    break;
+		case 'u': case 'o': case 'x': case 'X':
+		    slot->u = unsigned_arg(ap, c.size);
+		    break;
+		case 'c':
+		    slot->i = va_arg(*ap, int);
+		    break;
+		case 'p':
+		    slot->u = (uintptr_t) va_arg(*ap, void *);
+		    break;
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+		    slot->d = c.size == 'L' ? (double) va_arg(*ap, long double) : va_arg(*ap, double);
+		    break;
+		case 's':
+		    if(c.size == 'l') return start;	/* wide */
+		    if(!(s = va_arg(*ap, const char *))) s = "(null)";
+		    for(n = 0; s[n] && p + n + 1 < end; n++);
+		    memcpy(p, s, n);
+		    p[n] = 0;
+		    slot->u = n;
+		    p += (n + 8) & ~7;
+		    break;
+		default:		/* unknown, so is what it takes */
+		    return start;
+	    }
+	}
+    return p;
+}
+
+/* Format a record into "out" of "size" bytes, return its length */
+
+static int format_rec(const struct log_rec *rec, char *out, int size)
+{
+    const char *p = (const char *) (rec + 1), *end = (const char *) rec + rec->size;
+    const char *fmt = rec->fmt, *s;
+    const union { int64_t i; uint64_t u; double d; } *slot;
+    char spec[32];
+    int64_t star[2] = { 0, 0 };
+    struct log_conv c;
+    int len = 0, n, k;
+
+#define ROOM		(size - len)
+#define FORMAT(v)	(c.stars == 0 ? snprintf(out + len, ROOM, spec, v)		\
+			: c.stars == 1 ? snprintf(out + len, ROOM, spec, (int) star[0], v)	\
+			: snprintf(out + len, ROOM, spec, (int) star[0], (int) star[1], v))
+
+	for(;;) {
+	    s = fmt;
+	    fmt = next_conv(fmt, &c);
+	    /* the text up to the conversion, with %% as % */
+	    for(; *s && (!fmt || s < c.start) && len < size - 1; s++) {
+		out[len++] = *s;
+		if(*s == '%' && s[1] == '%') s++;
+	    }
+	    if(!fmt) break;
+	    if(end - p < 8 * (c.stars + 1) || c.len - c.start > (int) sizeof(spec) - 4) {
+		n = snprintf(out + len, ROOM, "...");
+		len += n < ROOM ? n : ROOM - 1;
+		break;
+	    }
+	    for(k = 0; k < c.stars; k++, p += 8) star[k] = *(const int64_t *) p;
+	    slot = (const void *) p;
+	    p += 8;
+	    /* the spec with the size of what was kept */
+	    n = c.len - c.start;
+	    memcpy(spec, c.start, n);
+	    if(strchr("diuoxX", c.conv)) spec[n++] = 'l', spec[n++] = 'l';
+	    spec[n++] = c.conv;
+	    spec[n] = 0;
+	    switch(c.conv) {
+		case 'd': case 'i': n = FORMAT((long long) slot->i); break;
+		case 'u': case 'o': case 'x': case 'X': n = FORMAT((unsigned long long) slot->u); break;
+		case 'c': n = FORMAT((int) slot->i); break;
+		case 'p': n = FORMAT((void *) (uintptr_t) slot->u); break;
+		case 's':
+		    n = FORMAT(p);
+		    p += (slot->u + 8) & ~7;
+		    break;
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+		    n = FORMAT(slot->d);
+		    break;
+		default:
+		    p -= 8;
+		    n = snprintf(out + len, ROOM, "%.*s", (int) (c.end - c.start), c.start);
+		    break;
+	    }
+	    if(n > 0) len += n < ROOM ? n : ROOM - 1;
+	}
+	out[len] = 0;
+#undef FORMAT
+#undef ROOM
+    return len;
+}
+
+static void output(int level, const char *tag, const char *text)
+{
+#ifdef __ANDROID__
+    __android_log_write(level, tag, text);
+#else
+    (void) level;
+    fprintf(stderr, "%s: %s\n", tag, text);
+#endif
+}
+
+/* The burst limit: 0 when a message of "rec->fmt" is to be counted instead. A format that
+   was not seen for a second gives its place up to a new one. */
+
+static int burst_ok(const struct log_rec *rec)
+{
+    unsigned h = ((uintptr_t) rec->fmt >> 3) * 2654435761u, k, stale = LOG_FORMATS;
+    uint64_t second = rec->ts / 1000000000ull;
+    char text[LOG_MAX];
+
+	for(k = 0; k < LOG_FORMATS; k++, h++) {
+	    h &= LOG_FORMATS - 1;
+	    if(!formats[h].fmt || formats[h].fmt == rec->fmt) break;
+	    if(stale == LOG_FORMATS && !formats[h].suppressed && formats[h].second + 1 < second) stale = h;
+	}
+	if(k == LOG_FORMATS || !formats[h].fmt) {
+	    if(stale != LOG_FORMATS) h = stale;
+	    else if(k == LOG_FORMATS) return 1;		/* too many to keep track of */
+	    formats[h].fmt = 0;
+	}
+	if(formats[h].fmt != rec->fmt || formats[h].second != second) {
+	    if(formats[h].suppressed) {
+		snprintf(text, sizeof(text), "%u more of \"%s\" left out", formats[h].suppressed, formats[h].fmt);
+		output(formats[h].level, formats[h].tag, text);
+	    }
+	    formats[h].fmt = rec->fmt;
+	    formats[h].tag = rec->tag;
+	    formats[h].level = rec->level;
+	    formats[h].second = second;
+	    formats[h].n = formats[h].suppressed = 0;
+	}
+	if(++formats[h].n <= LOG_BURST) return 1;
+	formats[h].suppressed++;
+    return 0;
+}
+
+/* Report what the burst limit left out before "second" */
+
+static void report_bursts(uint64_t second)
+{
+    char text[LOG_MAX];
+    int k;
+
+	for(k = 0; k < LOG_FORMATS; k++) {
+	    if(!formats[k].suppressed || formats[k].second >= second) continue;
+	    snprintf(text, sizeof(text), "%u more of \"%s\" left out", formats[k].suppressed, formats[k].fmt);
+	    output(formats[k].level, formats[k].tag, text);
+	    formats[k].suppressed = 0;
+	}
+}
+
+/* The next record of "r" to write out, or 0 */
+
+static struct log_rec *peek(struct log_ring *r)
+{
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&r->head, memory_order_acquire);
+    struct log_rec *rec;
+
+	while(tail != head) {
+	    rec = (struct log_rec *) (r->buf + tail % LOG_RING);
+	    if(!(rec->size & LOG_PAD)) return rec;
+	    tail += rec->size & ~LOG_PAD;
+	    atomic_store_explicit(&r->tail, tail, memory_order_release);
+	}
+    return 0;
+}
+
+/* Write out all the rings hold, oldest first */
+
+static void drain(uint64_t second)
+{
+    struct log_ring *r, *min;
+    struct log_rec *rec, *first;
+    char text[LOG_MAX];
+    unsigned n;
+
+	pthread_mutex_lock(&drain_lock);
+	for(;;) {
+	    for(min = 0, first = 0, r = atomic_load(&rings); r; r = r->next)
+		if((rec = peek(r)) && (!first || rec->ts < first->ts)) min = r, first = rec;
+	    if(!min) break;
+	    if(burst_ok(first)) {
+		format_rec(first, text, sizeof(text));
+		output(first->level, first->tag, text);
+	    }
+	    atomic_fetch_add_explicit(&min->tail, first->size, memory_order_release);
+	}
+	for(r = atomic_load(&rings); r; r = r->next) {
+	    if(!(n = atomic_exchange(&r->dropped, 0))) continue;
+	    snprintf(text, sizeof(text), "%u messages dropped, the log ring of a thread was full", n);
+	    output(LOG_LEVEL_ERROR, LOG_TAG, text);
+	}
+	report_bursts(second);
+	pthread_mutex_unlock(&drain_lock);
+}
+
+static void *logger(void *arg)
+{
+    struct timespec ts;
+    (void) arg;
+
+	prctl(PR_SET_NAME, "logger");
+	for(;;) {
+	    clock_gettime(CLOCK_REALTIME, &ts);	/* sem_timedwait() only takes CLOCK_REALTIME */
+	    ts.tv_nsec += LOG_PERIOD;
+	    if(ts.tv_nsec >= 1000000000) ts.tv_sec++, ts.tv_nsec -= 1000000000;
+	    while(sem_timedwait(&wake, &ts) == 0);	/* posted more than once */
+	    drain(log_ns() / 1000000000ull);
+	}
+    return 0;
+}
+
+static void release_ring(void *r)
+{
+    atomic_store(&((struct log_ring *) r)->idle, 1);
+}
+
+static void log_init(void)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+
+	sem_init(&wake, 0, 0);
+	pthread_key_create(&key, release_ring);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if(pthread_create(&thread, &attr, logger, 0) != 0) {
+	    output(LOG_LEVEL_ERROR, LOG_TAG, "failed to create logger thread, logging synchronously");
+	    logger_failed = 1;
+	}
+	pthread_attr_destroy(&attr);
+}
+
+static struct log_ring *get_ring(void)
+{
+    struct log_ring *r;
+    int idle;
+
+	pthread_once(&once, log_init);
+	for(r = atomic_load(&rings); r; r = r->next) {
+	    idle = 1;
+	    if(atomic_load(&r->idle) && atomic_compare_exchange_strong(&r->idle, &idle, 0)) break;
+	}
+	if(!r) {
+	    if(!(r = (struct log_ring *) calloc(1, sizeof(struct log_ring)))) return 0;
+	    r->next = atomic_load(&rings);
+	    while(!atomic_compare_exchange_weak(&rings, &r->next, r));
+	}
+	pthread_setspecific(key, r);
+    return ring = r;
+}
+
+void log_write(int level, const char *tag, const char *fmt, ...)
+{
+    struct log_ring *r = ring ? ring : get_ring();
+    uint64_t buf[LOG_MAX / 8];
+    struct log_rec *rec = (struct log_rec *) buf;
+    unsigned head, tail, pos, pad, size;
+    va_list ap;
+
+	if(!r) return;
+	rec->level = level;
+	rec->tag = tag;
+	rec->fmt = fmt;
+	rec->ts = log_ns();
+	va_start(ap, fmt);
+	rec->size = size = put_args((char *) (rec + 1), (char *) buf + sizeof(buf), fmt, &ap) - (char *) buf;
+	va_end(ap);
+
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	pos = head % LOG_RING;
+	pad = pos + size > LOG_RING ? LOG_RING - pos : 0;
+	if(LOG_RING - (head - tail) < pad + size) {
+	    atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+	    return;
+	}
+	if(pad) {
+	    *(uint32_t *) (r->buf + pos) = LOG_PAD | pad;
+	    head += pad;
+	    pos = 0;
+	}
+	memcpy(r->buf + pos, buf, size);
+	atomic_store_explicit(&r->head, head + size, memory_order_release);
+	if(logger_failed) log_flush();
+	else if(level >= LOG_LEVEL_ERROR || (head - tail <= LOG_RING / 2 && head + size - tail > LOG_RING / 2))
+	    sem_post(&wake);		/* once when it gets half full */
+}
+
+void log_set_level(int level)
+{
+    atomic_store(&log_min, level);
+}
+
+void log_flush(void)
+{
+    drain(UINT64_MAX);
+}
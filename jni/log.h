@@ -0,0 +1,37 @@
+#ifndef __LOG_H_INCLUDED
+#define __LOG_H_INCLUDED
+
+/* Logging, see log.c. Shared by main.h and fake_dlfcn.c, which define LOG_TAG first.
+   Messages below LOG_LEVEL are compiled out, those below log_min() at run time cost a test.
+   The others are copied to a ring of the calling thread and formatted and written out
+   later by a thread of their own, so "fmt" must be a literal (or live as long as the
+   process): only it is kept, %s arguments are copied. */
+
+#include <stdatomic.h>
+
+#define LOG_LEVEL_DEBUG		3	/* the priorities of android/log.h */
+#define LOG_LEVEL_INFO		4
+#define LOG_LEVEL_ERROR		6
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL		LOG_LEVEL_INFO
+#endif
+#ifndef LOG_TAG
+#define LOG_TAG			"test2"
+#endif
+
+extern atomic_int log_min;
+extern void log_write(int level, const char *tag, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+/* Leave out messages below "level" from now on */
+extern void log_set_level(int level);
+/* Write out all that was logged before, e.g. at exit */
+extern void log_flush(void);
+
+#define LOG_PRINT(level, ...)	((level) >= LOG_LEVEL						\
+				    && (level) >= atomic_load_explicit(&log_min, memory_order_relaxed) \
+				    ? log_write(level, LOG_TAG, __VA_ARGS__) : (void) 0)
+#define log_error(...)		LOG_PRINT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_info(...)		LOG_PRINT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...)		LOG_PRINT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+#endif
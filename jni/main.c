@@ -2,353 +2,946 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
-#include <jni.h>
 #include <errno.h>
 #include <signal.h>
 #include <unistd.h>
 #include <limits.h>
+#include <time.h>
 #include <pthread.h>
-
-#include <android_native_app_glue.h>
-#include <sys/system_properties.h>
+#include <sys/prctl.h>
 
 #include "main.h"
 
+/* App core: draws the text on its own thread and presents it on the surface it is started
+   with. The platform backend (android.c, host.c) creates it, starts it once it has a
+   surface and passes redraw requests and touches on to it. Touches only go into a ring
+   the UI thread never waits on; app_thread takes all that came in at each frame.
+   app_thread is the only one to present: it waits for something to show, then for the
+   vsync of ctx->clock, lays out all that is pending and presents it in one frame. */
+
 static void *app_thread(void *arg);
 
 static void stop_app_thread(struct ctx *ctx) 
 {
+    pthread_mutex_lock(&ctx->mutex);
     ctx->should_run = 0;
+    pthread_mutex_unlock(&ctx->mutex);
+    sem_post(&ctx->wake);
     pthread_join(ctx->app_thread, 0);
     ctx->app_thread = 0;	
 }
 
-static void done(struct ctx *ctx) 
+void app_stop(struct ctx *ctx) 
 {
-    ANativeActivity* activity;
+    if(ctx->app_thread) stop_app_thread(ctx);
+}
 
+void app_destroy(struct ctx *ctx) 
+{
     if(!ctx) return;
-    activity = ctx->app->activity;
     pthread_mutex_lock(&ctx->mutex);
     if(ctx->app_thread) log_error("internal error: thread not stopped in %s", __func__);
     ft_quit(ctx);
     pthread_mutex_unlock(&ctx->mutex);	
     pthread_mutex_destroy(&ctx->mutex);
+    sem_destroy(&ctx->wake);
+    if(ctx->surface) ctx->surface->destroy(ctx->surface);
+    if(ctx->source) ctx->source->destroy(ctx->source);
+    if(ctx->clock) ctx->clock->destroy(ctx->clock);
+    metrics_destroy(ctx->metrics);
+    free(ctx->stats);
+#ifdef ZERO_COPY
+    while(ctx->nitems) free(ctx->items[--ctx->nitems].text);
+    free(ctx->items);
+#else
     if(ctx->buffer) free(ctx->buffer);
+#endif
+    pthread_mutex_destroy(&ctx->present);
     free(ctx);
-    ANativeActivity_finish(activity);
+}
+
+static int bytes_per_pixel(struct ctx *ctx)
+{
+    if(ctx->fmt == WINDOW_FORMAT_RGBA_8888) return 4;
+    if(ctx->fmt == WINDOW_FORMAT_RGB_565) return 2;
+    log_error("unsupported window format %d", ctx->fmt);
+    return 0;
+}
+
+/* Dirty regions.
+   Everything drawn is marked as a rectangle of the screen, and the marks are merged
+   into at most DIRTY_SPANS row spans. draw_frame() only brings those rows up to date and
+   locks the window with their union, so the compositor gets a partial update as well. */
+
+void damage_add(struct damage *d, int top, int bottom)
+{
+    struct span *s, tmp;
+    int k, j, gap, best = 0, best_gap = INT_MAX;
+
+	for(k = 0; k < d->n; k++) {
+	    s = &d->spans[k];
+	    if(top <= s->bottom && bottom >= s->top) break;
+	    gap = top > s->bottom ? top - s->bottom : s->top - bottom;
+	    if(gap < best_gap) {
+		best_gap = gap;
+		best = k;
+	    }
+	}
+	if(k == d->n) {
+	    if(k < DIRTY_SPANS) {
+		d->spans[d->n].top = top;
+		d->spans[d->n++].bottom = bottom;
+		return;
+	    }
+	    k = best;	/* out of spans: grow the nearest one over the gap */
+	}
+	s = &d->spans[k];
+	if(top < s->top) s->top = top;
+	if(bottom > s->bottom) s->bottom = bottom;
+	/* the span may now reach others, fold them into it */
+	for(j = 0; j < d->n; j++) {
+	    struct span *o = &d->spans[j];
+	    if(j == k || o->top > s->bottom || o->bottom < s->top) continue;
+	    if(o->top < s->top) s->top = o->top;
+	    if(o->bottom > s->bottom) s->bottom = o->bottom;
+	    d->spans[j] = d->spans[--d->n];
+	    if(k == d->n) k = j;
+	    s = &d->spans[k];
+	    j = -1;
+	}
+	/* keep it last where mark_dirty() looks first */
+	tmp = d->spans[k];
+	d->spans[k] = d->spans[d->n - 1];
+	d->spans[d->n - 1] = tmp;
+}
+
+/* Merge the damage of the last "n" frames of "history" into "d", all of the screen if that is not known */
+
+static void damage_since(struct ctx *ctx, struct damage *d, const struct damage *history, int n)
+{
+    int k, j;
+	d->n = 0;
+	d->left = ctx->width;
+	d->right = 0;
+	if(n < 1 || n > DAMAGE_HISTORY) {
+	    d->left = 0;
+	    d->right = ctx->width;
+	    damage_add(d, 0, ctx->height);
+	    return;
+	}
+	for(k = 0; k < n; k++) {
+	    if(!history[k].n) continue;
+	    if(history[k].left < d->left) d->left = history[k].left;
+	    if(history[k].right > d->right) d->right = history[k].right;
+	    for(j = 0; j < history[k].n; j++) damage_add(d, history[k].spans[j].top, history[k].spans[j].bottom);
+	}
+}
+
+/* Bounding rectangle of "d" on the screen, false if empty */
+
+static int damage_bounds(struct ctx *ctx, const struct damage *d, struct rect *r)
+{
+    int k;
+	r->left = d->left < 0 ? 0 : d->left;
+	r->right = d->right > ctx->width ? ctx->width : d->right;
+	r->top = ctx->height;
+	r->bottom = 0;
+	for(k = 0; k < d->n; k++) {
+	    if(d->spans[k].top < r->top) r->top = d->spans[k].top;
+	    if(d->spans[k].bottom > r->bottom) r->bottom = d->spans[k].bottom;
+	}
+	if(r->top < 0) r->top = 0;
+	if(r->bottom > ctx->height) r->bottom = ctx->height;
+    return r->left < r->right && r->top < r->bottom;
+}
+
+/* Push the damage of the frame just finished into the history */
+
+static void damage_push(struct ctx *ctx)
+{
+	memmove(ctx->history + 1, ctx->history, (DAMAGE_HISTORY - 1) * sizeof(struct damage));
+	ctx->history[0] = ctx->dirty;
+	ctx->dirty.n = 0;
+}
+
+#ifdef ZERO_COPY
+
+/* Zero copy mode.
+   There is no private frame: the text on the screen is kept as a list of strings that are
+   drawn straight into the locked window buffer. A buffer is stale in the rows this frame
+   changes and, when it was last shown "age" frames ago, in those the age - 1 frames before
+   changed; only these rows are cleared and the strings crossing them drawn again.
+   Scrolling a buffer that holds the previous frame moves its rows instead, leaving
+   just the ones uncovered at the bottom stale. Strings are drawn by draw_frame(), so
+   app_thread only holds ctx->mutex while it changes the list. */
+
+static int add_item(struct ctx *ctx, char *text, int x, int y, int width, int height)
+{
+    struct text_item *items = (struct text_item *) realloc(ctx->items, (ctx->nitems + 1) * sizeof(struct text_item));
+	if(!items) {
+	    log_error("no memory");
+	    return -1;
+	}
+	ctx->items = items;
+	items += ctx->nitems++;
+	items->text = text;
+	items->x = x;
+	items->y = y;
+	items->width = width;
+	items->height = height;
+	mark_dirty(ctx, 0, y, ctx->width, height);
+    return 0;
+}
+
+/* Move the items that start in rows top to bottom - 1 up by "dy", dropping those that leave them.
+   Items stay in the order they were added, which is the order they are drawn in. */
+
+static void scroll_items(struct ctx *ctx, int top, int bottom, int dy)
+{
+    int k;
+	for(k = 0; k < ctx->nitems; ) {
+	    struct text_item *it = &ctx->items[k];
+	    if(it->y < top || it->y >= bottom) k++;
+	    else if((it->y -= dy) >= top) k++;
+	    else {
+		free(it->text);
+		memmove(it, it + 1, (--ctx->nitems - k) * sizeof(struct text_item));
+	    }
+	}
+	if(ctx->scroll_dy && (ctx->scroll.top != top || ctx->scroll.bottom != bottom)) {
+	    mark_dirty(ctx, 0, ctx->scroll.top, ctx->width, ctx->scroll.bottom - ctx->scroll.top);
+	    ctx->scroll_dy = 0;
+	}
+	ctx->scroll.top = top;
+	ctx->scroll.bottom = bottom;
+	ctx->scroll_dy += dy;
+}
+
+static void redraw_stale(struct ctx *ctx, struct surface_buffer *buf, int all, int bpp)
+{
+    struct damage stale;
+    struct text_item *it;
+    struct span *sc = &ctx->scroll;
+    int k, j, dy = ctx->scroll_dy, line = buf->stride * bpp;
+
+	if(all) buf->age = 0;
+	if(dy && buf->age == 1 && dy < sc->bottom - sc->top) {
+	    TRACE_SCOPE("scroll memmove");
+	    memmove(buf->bits + sc->top * line, buf->bits + (sc->top + dy) * line, (sc->bottom - sc->top - dy) * line);
+	    stat_add(ctx->counters, FT_STAT_SCROLL_BYTES, (sc->bottom - sc->top - dy) * line);
+	    if(ctx->stats) ctx->stats->blitted += (sc->bottom - sc->top - dy) * line;
+	    damage_add(&ctx->dirty, sc->bottom - dy, sc->bottom);
+	} else if(dy) damage_add(&ctx->dirty, sc->top, sc->bottom);
+	ctx->scroll_dy = 0;
+	stale = ctx->dirty;
+	if(dy) damage_add(&ctx->dirty, sc->top, sc->bottom);	/* to other buffers all of the scrolled rows are new */
+	damage_push(ctx);
+	if(buf->age != 1) {
+	    struct damage before;
+	    damage_since(ctx, &before, ctx->history + 1, buf->age <= DAMAGE_HISTORY ? buf->age - 1 : 0);
+	    for(k = 0; k < before.n; k++) damage_add(&stale, before.spans[k].top, before.spans[k].bottom);
+	}
+
+	ctx->buffer = buf->bits;
+	ctx->stride = buf->stride;
+	for(k = 0; k < stale.n; k++) {
+	    int top = stale.spans[k].top < 0 ? 0 : stale.spans[k].top;
+	    int bottom = stale.spans[k].bottom > ctx->height ? ctx->height : stale.spans[k].bottom;
+	    if(top >= bottom) continue;
+	    memset(ctx->buffer + top * line, 0, (bottom - top) * line);
+	    if(ctx->stats) ctx->stats->blitted += (bottom - top) * line;
+	}
+	/* strings are clipped to each span they cross, so the rest of them costs next to nothing */
+	for(j = 0; j < stale.n; j++) {
+	    struct rect clip = { 0, stale.spans[j].top, ctx->width, stale.spans[j].bottom };
+	    ft_set_clip(ctx, &clip);
+	    for(k = 0; k < ctx->nitems; k++) {
+		it = &ctx->items[k];
+		if(it->y < clip.bottom && it->y + it->height > clip.top
+			&& ft_render_string(ctx, it->text, it->x, it->y, it->width) != 0) log_error("rendering failed");
+	    }
+	    it = &ctx->greeting;
+	    if(it->text && it->y < clip.bottom && it->y + it->height > clip.top
+		    && ft_render_string(ctx, it->text, it->x, it->y, it->width) != 0) log_error("rendering failed");
+	}
+	ft_set_clip(ctx, 0);
+	ctx->dirty.n = 0;	/* marks made while redrawing */
+	ctx->buffer = 0;
 }
 
 static void draw_frame(struct ctx* ctx) 
 {
-    int k, width, stride;
-    void *src, *dst; 
-    ANativeWindow_Buffer buffer;
+    int bpp, all;
+    struct surface_buffer buf;
+    struct rect bounds, want;
+    TRACE_SCOPE(__func__);
 
-    if(!ctx->app->window) {
-	log_error("%s called with null window", __func__);
+    if(!ctx->surface) {
+	log_error("%s called before app_start()", __func__);
 	return;
     }
-    log_info("%s: %d x %d", __func__, ctx->width, ctx->height);
+    pthread_mutex_lock(&ctx->present); 
+    if(ctx->paused) {
+        pthread_mutex_unlock(&ctx->present); 
+	return;		/* app_resume() asks for all of the next frame */
+    }
     pthread_mutex_lock(&ctx->mutex); 
-    if(ANativeWindow_setBuffersGeometry(ctx->app->window, 0, 0, ctx->fmt) != 0) {
-	log_error("Failed to set buffer format");
-        pthread_mutex_unlock(&ctx->mutex); 
-	return;
+    all = atomic_exchange(&ctx->redraw, 0);
+    if(all) mark_dirty(ctx, 0, 0, ctx->width, ctx->height);
+    ctx->dirty.left = 0;		/* stale rows are redrawn whole */
+    ctx->dirty.right = ctx->width;
+    if(!damage_bounds(ctx, &ctx->dirty, &want)) want.top = want.bottom = -1;
+    if(ctx->scroll_dy) {
+	if(want.top < 0 || ctx->scroll.top < want.top) want.top = ctx->scroll.top;
+	if(want.bottom < 0 || ctx->scroll.bottom > want.bottom) want.bottom = ctx->scroll.bottom;
     }
-    if(ANativeWindow_lock(ctx->app->window, &buffer, 0) < 0) {
-	log_error("Unable to lock window buffer");
+    if(want.top >= want.bottom) {
+	ctx->dirty.n = 0;
         pthread_mutex_unlock(&ctx->mutex); 
-	return;
+        pthread_mutex_unlock(&ctx->present); 
+	return;		/* nothing changed */
     }
-    src = ctx->buffer;
-    dst = buffer.bits;
-
-    if(ctx->fmt == WINDOW_FORMAT_RGBA_8888) {
-	width = ctx->width * 4;
-	stride = ctx->stride * 4;	
-    } else if(ctx->fmt == WINDOW_FORMAT_RGB_565) {
-	width = ctx->width * 2;
-	stride = ctx->stride * 2;	
-    } else {
-	log_error("%s called for unsupported window format %d", __func__, ctx->fmt);
-	ANativeWindow_unlockAndPost(ctx->app->window);	
-	pthread_mutex_unlock(&ctx->mutex); 
+    log_debug("%s: %d,%d - %d,%d", __func__, want.left, want.top, want.right, want.bottom);
+    bounds = want;
+    if(!(bpp = bytes_per_pixel(ctx)) || ctx->surface->lock(ctx->surface, &buf, &bounds) != 0) {
+        pthread_mutex_unlock(&ctx->mutex); 
+        pthread_mutex_unlock(&ctx->present); 
 	return;
     }
-
-    for(k = 0; k < ctx->height; k++, src += stride, dst += stride) memcpy(dst, src, width);
-   		
-    ANativeWindow_unlockAndPost(ctx->app->window);	
+    redraw_stale(ctx, &buf, all, bpp);
+    ctx->surface->post(ctx->surface);
+    stat_add(ctx->counters, FT_STAT_PRESENTS, 1);
     pthread_mutex_unlock(&ctx->mutex); 
+    pthread_mutex_unlock(&ctx->present); 
 }
 
-static void init_window(struct ctx *ctx)
-{
-    ANativeWindow_Buffer buffer;
+#else
+
+/* Copy mode.
+   app_thread draws into its own canvas, ctx->buffer, and is the only one to present, so
+   draw_frame() copies what the locked window buffer lacks straight from it: the rows
+   changed since the frame the buffer holds, through buffer_row() for the scrolling band. */
+
+/* Copy rows top to bottom - 1 of the canvas to the window, "width" bytes at byte "offs" of each */
 
-    if(ctx->buffer) return;
+static void copy_rows(struct ctx *ctx, void *dst, int dst_stride, int top, int bottom, int offs, int width, int bpp)
+{
+    if(bottom <= top) return;
+    stat_add(ctx->counters, FT_STAT_PRESENT_BYTES, (bottom - top) * width);
+    if(ctx->stats) ctx->stats->blitted += (bottom - top) * width;
+    for(; top < bottom; top++)
+	memcpy(dst + top * dst_stride * bpp + offs, ctx->buffer + buffer_row(ctx, top) * ctx->stride * bpp + offs, width);
+}
 
-    log_info(__func__);
-    if(ANativeWindow_setBuffersGeometry(ctx->app->window, 0, 0, ctx->fmt) != 0) {
-	log_error("Failed to set buffer format");
-	done(ctx);
+static void draw_frame(struct ctx* ctx) 
+{
+    int k, bpp, all;
+    struct surface_buffer buf;
+    struct rect bounds, want;
+    struct damage d;
+    TRACE_SCOPE(__func__);
+
+    if(!ctx->surface) {
+	log_error("%s called before app_start()", __func__);
 	return;
     }
-    if(ANativeWindow_lock(ctx->app->window, &buffer, 0) < 0) {
-	log_error("Unable to lock window buffer");
-	done(ctx);
+    if(!(bpp = bytes_per_pixel(ctx))) return;
+    pthread_mutex_lock(&ctx->present); 
+    if(ctx->paused) {
+        pthread_mutex_unlock(&ctx->present); 
+	return;		/* app_resume() asks for all of the next frame */
+    }
+    all = atomic_exchange(&ctx->redraw, 0);
+    damage_since(ctx, &d, ctx->history, all || !ctx->shown ? 0 : ctx->seq - ctx->shown);
+    if(!damage_bounds(ctx, &d, &want)) {
+	ctx->shown = ctx->seq;
+        pthread_mutex_unlock(&ctx->present); 
+	return;
+    }
+    log_debug("%s: %d,%d - %d,%d", __func__, want.left, want.top, want.right, want.bottom);
+    bounds = want;
+    if(ctx->surface->lock(ctx->surface, &buf, &bounds) != 0) {
+        pthread_mutex_unlock(&ctx->present); 
 	return;
     }
-    ctx->height = buffer.height;
-    ctx->width = buffer.width;
-    ctx->stride = buffer.stride;
-    ctx->buffer = calloc(1, ctx->height * ctx->stride * (ctx->fmt == WINDOW_FORMAT_RGBA_8888 ? 4 : 2)); 
-    ANativeWindow_unlockAndPost(ctx->app->window);	
-    if(!ctx->buffer) {
+
+    /* A buffer that does not hold the previous frame needs all of it, and the window hands
+       back a bigger rectangle when it could not keep the rest of that frame in this buffer */
+    if(buf.age != 1) {
+	bounds.left = bounds.top = 0;
+	bounds.right = ctx->width;
+	bounds.bottom = ctx->height;
+    }
+    if(bounds.left != want.left || bounds.right != want.right || bounds.top != want.top || bounds.bottom != want.bottom)
+	copy_rows(ctx, buf.bits, buf.stride, bounds.top, bounds.bottom, bounds.left * bpp,
+		(bounds.right - bounds.left) * bpp, bpp);
+    else for(k = 0; k < d.n; k++) {
+	int top = d.spans[k].top < 0 ? 0 : d.spans[k].top;
+	int bottom = d.spans[k].bottom > ctx->height ? ctx->height : d.spans[k].bottom;
+	copy_rows(ctx, buf.bits, buf.stride, top, bottom, want.left * bpp, (want.right - want.left) * bpp, bpp);
+    }
+    ctx->shown = ctx->seq;
+   		
+    ctx->surface->post(ctx->surface);
+    stat_add(ctx->counters, FT_STAT_PRESENTS, 1);
+    pthread_mutex_unlock(&ctx->present); 
+}
+#endif
+
+struct ctx *app_create(int dpi, int fmt)
+{
+    struct ctx *ctx = (struct ctx *) calloc(1, sizeof(struct ctx));
+    if(!ctx) {
+	log_error("no memory");
+	return 0;
+    }	
+    pthread_mutex_init(&ctx->mutex, 0);
+    sem_init(&ctx->wake, 0, 0);
+    pthread_mutex_init(&ctx->present, 0);
+    ctx->dpi = dpi;
+    ctx->fmt = fmt;
+    ctx->period = 1000000000;	/* a line a second */
+    ctx->source = numbers_source_create();
+    ctx->clock = mono_clock_create(0);
+    if(!ctx->source || !ctx->clock) {
+	app_destroy(ctx);
+	return 0;
+    }
+
+    if(ft_init(ctx) != 0) {
+	app_destroy(ctx);
+	return 0;
+    }
+    return ctx;
+}
+
+/* Start drawing on "s", which the app owns from now on */
+
+int app_start(struct ctx *ctx, struct surface *s, int width, int height, int stride)
+{
+#ifndef ZERO_COPY
+    int size;
+#endif
+
+    ctx->surface = s;
+    ctx->height = height;
+    ctx->width = width;
+    ctx->stride = stride;
+    ft_set_clip(ctx, 0);
+#ifndef ZERO_COPY
+    size = ctx->height * ctx->stride * bytes_per_pixel(ctx);
+    ctx->buffer = calloc(1, size); 
+    if(!size || !ctx->buffer) {
 	log_error("No memory for window buffer");
-	done(ctx);
+	return -1;
     }		
+#endif
     log_info("window %d x %d stride %d allocated", ctx->width, ctx->height, ctx->stride);
     ctx->should_run = 1;	
     if(pthread_create(&ctx->app_thread, 0, app_thread, ctx) != 0) {
 	log_error("failed to create app thread");
-	done(ctx);
+	ctx->app_thread = 0;
+	return -1;
     }
+    return 0;
 }
 
-static int32_t handle_input(struct android_app* app, AInputEvent* event) 
+/* Hand "n" touch samples, oldest first, to app_thread, which draws the greeting where the
+   latest one is with its next frame. Called on the UI thread, it neither locks nor waits:
+   when the ring is short of room, the oldest samples are dropped. */
+
+void app_touch(struct ctx *ctx, const struct touch *t, int n)
 {
-    struct ctx* ctx = (struct ctx*) app->userData;
-    if(AInputEvent_getType(event) == AINPUT_EVENT_TYPE_MOTION) {
-	int x = AMotionEvent_getX(event, 0);
-	int y = AMotionEvent_getY(event, 0);
-	log_info("AINPUT_EVENT_TYPE_MOTION %d %d", x, y);	
-	pthread_mutex_lock(&ctx->mutex);
-	if(ft_render_string(ctx, "BRAVO, Mr. T.W.Lewis\nЭто по-русски\n", x, y, 1000) != 0) 
-		log_error("rendering failed");
-	pthread_mutex_unlock(&ctx->mutex);
-	draw_frame(ctx);	
-	stop_app_thread(ctx);
-	return 1;
-    }
-    return 0;
+    unsigned head = atomic_load_explicit(&ctx->touch_head, memory_order_relaxed);
+    unsigned room = TOUCH_QUEUE - (head - atomic_load_explicit(&ctx->touch_tail, memory_order_acquire));
+
+	if(n <= 0) return;
+	if((unsigned) n > room) {
+	    t += n - room;
+	    n = room;
+	}
+	for(; n > 0; n--) ctx->touches[head++ % TOUCH_QUEUE] = *t++;
+	atomic_store_explicit(&ctx->touch_head, head, memory_order_release);
+	sem_post(&ctx->wake);
 }
 
-static void handle_cmd(struct android_app* app, int32_t cmd)
+/* The surface lost its content, draw all of the next frame */
+
+void app_redraw(struct ctx *ctx)
 {
-    struct ctx* ctx = (struct ctx*) app->userData;
+    atomic_store(&ctx->redraw, 1);
+    sem_post(&ctx->wake);
+}
 
-    switch(cmd) {
-	case APP_CMD_INIT_WINDOW:
-	    log_info("APP_CMD_INIT_WINDOW");	
-	    pthread_mutex_lock(&ctx->mutex);
-	    init_window(ctx);
-	    pthread_mutex_unlock(&ctx->mutex);
-	    draw_frame(ctx);
-	    break;
-	case APP_CMD_WINDOW_REDRAW_NEEDED:
-	case APP_CMD_WINDOW_RESIZED:
-	    draw_frame(ctx);
-	    log_info("APP_CMD_WINDOW_RESIZED/REDRAW_NEEDED");	
-	    break;
-	case APP_CMD_TERM_WINDOW:
-	    log_info("APP_CMD_TERM_WINDOW");	
-	    break;
-	default:
-	    log_info("APP_CMD_%d", cmd);
-	    break;
-    }
+/* The window is going away: once this returns, app_thread no longer touches the surface
+   and its frames are dropped until app_resume() */
+
+void app_pause(struct ctx *ctx)
+{
+    pthread_mutex_lock(&ctx->present);
+    ctx->paused = 1;
+    pthread_mutex_unlock(&ctx->present);
 }
 
-/* Terrible bug corrected: https://groups.google.com/d/msg/alt.usage.english/4t0PAe9-QGc/H2Jb2SJQBgAJ */
+/* The window is back, draw all of the next frame on it */
 
-static const char *low_nums[] = { 0, "one", "two", "three", "four", "five", "six", "seven", "eight", "nine", "ten",
-	"eleven", "twelve", "thirteen", "fourteen", "fifteen", "sixteen", "seventeen", "eighteen", "nineteen" };
-static const char *ten_multiples[] = { 0, 0, "twenty", "thirty", "forty", "fifty", "sixty", "seventy", "eighty", "ninety" };
-static const char *large_nums[] = { "billion", "million", "thousand", 0 };
-static const int large_vals[] = { 1000000000, 1000000, 1000, 0 };
+void app_resume(struct ctx *ctx)
+{
+    pthread_mutex_lock(&ctx->present);
+    ctx->paused = 0;
+    pthread_mutex_unlock(&ctx->present);
+    app_redraw(ctx);
+}
 
-/* Numerals in the English language are spoken in triples each consisting 
-   of the number of hundreds (if any) possibly followed by "and" and the lesser number, e.g.:
-   909,168,442 is "nine hundred and nine million one hundered and sixty-eight thousand four hundred and forty-two" */
+/* Benchmark statistics: stage latencies go into log-linear histograms, HIST_SUB buckets
+   per power of two of nanoseconds, so percentiles are within 1/HIST_SUB of the truth. */
 
-static char *triple(char *out, int num)
+static inline uint64_t clock_ns(void)
 {
-    int hi, rest;
-    char *c = out;	
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
 
-	if(num <= 0 || num >= 1000) return 0;	/* can't happen */
-	hi = num/100;
-	rest = num % 100;
-	if(hi) {
-	    sprintf(c, "%s hundred%s", low_nums[hi], rest ? " and " : "");
-	    c += strlen(c);
+static void hist_add(unsigned *hist, uint64_t ns)
+{
+    int s;
+	if(ns > UINT32_MAX) ns = UINT32_MAX;
+	if(ns < 2 * HIST_SUB) {
+	    hist[ns]++;
+	    return;
 	}
-	if(!rest) return out;
-	if(rest <= 19) {
-	    sprintf(c, "%s", low_nums[rest]);
-	    return out;
+	s = 63 - __builtin_clzll(ns) - 5;	/* HIST_SUB is 32 */
+	hist[s * HIST_SUB + (ns >> s)]++;
+}
+
+uint64_t hist_percentile(const unsigned *hist, int pct)
+{
+    uint64_t total = 0, sum = 0;
+    int k, s;
+	for(k = 0; k < HIST_BUCKETS; k++) total += hist[k];
+	if(!total) return 0;
+	for(k = 0; k < HIST_BUCKETS; k++) {
+	    sum += hist[k];
+	    if(sum * 100 >= total * pct) break;
 	}
-	hi = rest/10;
-	rest = rest % 10;
-	if(rest) sprintf(c, "%s-%s", ten_multiples[hi], low_nums[rest]);
-	else sprintf(c, "%s", ten_multiples[hi]);
+	if(k < 2 * HIST_SUB) return k;
+	s = k / HIST_SUB - 1;
+    return ((uint64_t) (k % HIST_SUB + HIST_SUB) << s) + ((1ull << s) >> 1);	/* middle of the bucket */
+}
+
+/* Time stage "stage" from "t0" on, returns the time now to start the next one */
 
-    return out;
+static inline uint64_t stage_done(struct ctx *ctx, int stage, uint64_t t0)
+{
+    uint64_t t;
+    if(!ctx->stats) return 0;
+    t = clock_ns();
+    hist_add(ctx->stats->hist[stage], t - t0);
+    return t;
 }
 
-static char *num2engl(unsigned int num)
+/* Chars in a line, which is about the glyphs drawn for it */
+
+static int count_chars(const char *s)
 {
-    uint32_t i, hi, rest;
-    char tmp[512], *c;
+    int n = 0;
+    for(; *s; s++) n += (*s & 0xc0) != 0x80 && *s != '\n';
+    return n;
+}
 
-	if(!num) return strdup("zero");
+/* The scrolling text area app_thread writes to: "rows" rows of "line_height" pixels from x, y,
+   the text wrapped at "width". Row "cur" is the next to write to. */
 
-	for(i = 0, rest = num, c = tmp; large_vals[i]; i++) {
-	    hi = rest/large_vals[i];
-	    rest = rest % large_vals[i];
-	    if(hi) {
-		sprintf(c, "%s %s%s", triple(c, hi), large_nums[i], rest ? " " : "");
-		c += strlen(c);
-	    }
-	    if(!rest) return strdup(tmp);
+struct console {
+    int x, y, width, line_height, rows, cur;
+    unsigned shown;			/* lines shown so far */
+};
+
+static int console_init(struct ctx *ctx, struct console *con)
+{
+	con->line_height = ft_get_line_height(ctx) + 10;
+	if(!con->line_height || !ctx->height) {
+	    log_error("dimensions unknown");
+	    return -1;
+	}
+	con->x = 10;
+	con->y = 250;
+	con->cur = 0;
+	con->shown = 0;
+	con->rows = (ctx->height - 2 * con->y)/con->line_height;
+	con->width = ctx->width - 2 * con->x;
+	if(con->rows <= 0 || con->width <= 0) {
+	    log_error("window %d x %d too small for text", ctx->width, ctx->height);
+	    return -1;
 	}
-	triple(c, rest);
 
-    return strdup(tmp);
+	log_info("%s: width = %d height %d max_lines %d", __func__, con->width, ctx->height, con->rows);
+
+#ifndef ZERO_COPY
+	ctx->band_y = con->y;
+	ctx->band_rows = con->rows * con->line_height;
+	ctx->band_head = 0;
+#endif
+    return 0;
 }
 
-static void *app_thread(void *arg) 
+/* Scroll the text up by "lines" rows. In zero copy mode, ctx->mutex is held. */
+
+static void console_scroll(struct ctx *ctx, struct console *con, int lines)
 {
-    struct ctx *ctx = (struct ctx *) arg;
-    int  k = 0, stride_bytes, bytes_per_font_height, pixels_per_font_height, 
-	 lines, cur_lines, max_lines, target_width, start_x, start_y;   
+#ifdef ZERO_COPY
+	scroll_items(ctx, con->y, con->y + con->rows * con->line_height, lines * con->line_height);
+#else
+    int head, n, stride_bytes = ctx->stride * bytes_per_pixel(ctx);
+    TRACE_SCOPE("scroll");
+
+	/* Nothing moves: the top "lines" slots of the band are cleared and its head
+	   advanced past them, which makes them the bottom ones. */
+	for(head = ctx->band_head / con->line_height, n = 0; n < lines; n++) {
+	    memset(ctx->buffer + (con->y + head * con->line_height) * stride_bytes, 0, stride_bytes * con->line_height);
+	    stat_add(ctx->counters, FT_STAT_SCROLL_BYTES, stride_bytes * con->line_height);
+	    if(++head == con->rows) head = 0;
+	}
+	ctx->band_head = head * con->line_height;
+	mark_dirty(ctx, 0, con->y, ctx->width, ctx->band_rows);	/* all of it moved up on the screen */
+#endif
+	con->cur -= lines;
+}
 
-	pixels_per_font_height = ft_get_line_height(ctx) + 10;
-	if(!pixels_per_font_height || !ctx->height) {
-	    log_error("dimensions unknown");
-	    return 0;	    
+/* Draw "c", which takes "lines" rows, at the current row. In zero copy mode, ctx->mutex is held. */
+
+static int console_put(struct ctx *ctx, struct console *con, const char *c, int lines)
+{
+#ifdef ZERO_COPY
+    char *text = strdup(c);		/* for the item to keep */
+	if(!text || add_item(ctx, text, con->x, con->y + con->cur * con->line_height, con->width,
+		(lines + 1) * con->line_height) != 0) {	/* descenders may reach into the next slot */
+	    free(text);
+	    return -1;
+	}
+#else
+	if(ft_render_string(ctx, c, con->x, con->y + con->cur * con->line_height, con->width) != 0) return -1;
+#endif
+	con->cur += lines;
+	if(ctx->stats) {
+	    ctx->stats->lines++;
+	    ctx->stats->glyphs += count_chars(c);
 	}
-	start_x = 10;
-	start_y = 250;
-	cur_lines = 0;
-	max_lines = (ctx->height - 2 * start_y)/pixels_per_font_height;
-	target_width = ctx->width - 2 * start_x;
+#ifdef SHARED_ATLAS
+	if(++con->shown == con->rows) ft_share_glyphs(ctx);	/* glyph set is warm after a screenful */
+#endif
+    return 0;
+}
 
-	log_info("%s: width = %d height %d max_lines %d", __func__, target_width, ctx->height, max_lines);
+static void present(struct ctx *ctx)
+{
+#ifndef ZERO_COPY
+    damage_push(ctx);
+    ctx->seq++;
+#endif
+    draw_frame(ctx);
+}
 
-	if(ctx->fmt == WINDOW_FORMAT_RGBA_8888) stride_bytes = ctx->stride * 4;	
-	else stride_bytes = ctx->stride * 2;	
-	
-	bytes_per_font_height = stride_bytes * pixels_per_font_height;
+/* Lay out the next line of a line by line source, 0 at its end */
 
-	while(1) {
+static int show_line(struct ctx *ctx, struct console *con)
+{
+    const char *c = ctx->source->next(ctx->source);
+    uint64_t t = ctx->stats ? clock_ns() : 0;
+    int lines;
+
+	if(!c) return 0;
+	if(ft_get_string_metrics(ctx, c, con->width, &lines) != 0) {
+	    log_error("ft_get_string_metrics failed");
+	    return -1;	
+	}	
+	t = stage_done(ctx, STAGE_METRICS, t);
+	if(lines > con->rows) {
+	    log_error("logcat string won't fit on this screen: lines %d max_lines %d", lines, con->rows);
+	    return 1;
+	}
+#ifdef ZERO_COPY
+	pthread_mutex_lock(&ctx->mutex);
+#endif
+	if(lines + con->cur >= con->rows) {	/* scroll up window buffer by "lines" */
+	    log_debug("scrolling: %d + %d > %d", lines, con->cur, con->rows);
+	    console_scroll(ctx, con, lines);
+	    t = stage_done(ctx, STAGE_SCROLL, t);
+	} 
+	if(console_put(ctx, con, c, lines) != 0) {
+#ifdef ZERO_COPY
+	    pthread_mutex_unlock(&ctx->mutex);
+#endif
+	    return -1;
+	}
+	stage_done(ctx, STAGE_RENDER, t);
+#ifdef ZERO_COPY
+	pthread_mutex_unlock(&ctx->mutex);
+#endif
+
+    return 1;
+}
+
+/* Lay out the lines due by time "t", the first of them was due at "deadline". Unpaced that is
+   one line; a screenful at most, a source further behind starts over from "t". */
+
+static int show_lines(struct ctx *ctx, struct console *con, uint64_t *deadline, uint64_t t)
+{
+    int k, r = 1;
+	for(k = 0; k < con->rows && r > 0; k++) {
+	    r = show_line(ctx, con);
+	    if(!ctx->period) return r;
+	    if((*deadline += ctx->period) > t) return r;
+	}
+	if(r > 0) *deadline = t + ctx->period;
+    return r;
+}
 
-	    char *c = num2engl(k++);
+static int ms_until(struct ctx *ctx, uint64_t deadline)
+{
+    uint64_t now = ctx->clock->now(ctx->clock);
+    return deadline > now ? (deadline - now) / 1000000 : 0;
+}
+
+/* Streams: lines are read until the frame is due and then laid out in one pass.
+   Returns how many came in, -1 at the end of the stream. */
+
+#define CONSOLE_IDLE_MS	50		/* how long to wait for input before looking at ctx->should_run again */
+
+static int read_batch(struct ctx *ctx, uint64_t deadline)
+{
+    struct text_source *src = ctx->source;
+    int n, m, ms;
+
+	if(!(n = src->fill(src, 0))) n = src->fill(src, CONSOLE_IDLE_MS);
+	if(n <= 0) return n;
+	while((ms = ms_until(ctx, deadline)) > 0 && (m = src->fill(src, ms)) > 0) n = m;
+    return n;
+}
 
-	    pthread_mutex_lock(&ctx->mutex);
-	    if(!ctx->should_run) {
-            	pthread_mutex_unlock(&ctx->mutex);	
-		break;
-	    }	 
-	    if(ft_get_string_metrics(ctx, c, target_width, &lines) != 0) {
+/* The last of the lines read that fit on the screen are measured, the text is scrolled once
+   for all of them and they are drawn. The ones before are dropped without being drawn. */
+
+static int show_batch(struct ctx *ctx, struct console *con)
+{
+    struct text_source *src = ctx->source;
+    const char *c[con->rows];
+    int lines[con->rows], k, n, first, total;
+    unsigned dropped;
+    uint64_t t;
+
+	t = ctx->stats ? clock_ns() : 0;
+	n = src->take(src, c, con->rows, &dropped);
+	/* the last lines that fit, keeping the bottom row free like show_line() does */
+	for(first = n, total = 0; first > 0; first--) {
+	    if(ft_get_string_metrics(ctx, c[first - 1], con->width, &lines[first - 1]) != 0) {
 		log_error("ft_get_string_metrics failed");
-            	pthread_mutex_unlock(&ctx->mutex);	
-		break;	
-	    }	
-	    if(lines + cur_lines >= max_lines) {	/* scroll up window buffer by "lines" */
-		void *ptr = ctx->buffer + start_y * stride_bytes;
-		log_info("scrolling: %d + %d > %d", lines, cur_lines, max_lines);
-		if(lines > max_lines) {
-		    log_error("logcat string won't fit on this screen: lines %d max_lines %d", lines, max_lines);
-		    pthread_mutex_unlock(&ctx->mutex);
-		    continue;		
-		}
-		cur_lines -= lines;
-    		memmove(ptr, ptr + lines * bytes_per_font_height, cur_lines * bytes_per_font_height);
-		memset(ptr + cur_lines * bytes_per_font_height, 0, (max_lines - cur_lines) * bytes_per_font_height);
-	    } 
-
-	    if(ft_render_string(ctx, c, start_x, start_y + cur_lines * pixels_per_font_height, target_width) != 0) {
+		return -1;
+	    }
+	    if(total + lines[first - 1] > con->rows - 1) break;
+	    total += lines[first - 1];
+	}
+	dropped += first;
+	t = stage_done(ctx, STAGE_METRICS, t);
+#ifdef ZERO_COPY
+	pthread_mutex_lock(&ctx->mutex);
+#endif
+	if(con->cur + total > con->rows - 1) {
+	    console_scroll(ctx, con, con->cur + total - (con->rows - 1));
+	    t = stage_done(ctx, STAGE_SCROLL, t);
+	}
+	for(k = first; k < n; k++)
+	    if(console_put(ctx, con, c[k], lines[k]) != 0) {
+#ifdef ZERO_COPY
 		pthread_mutex_unlock(&ctx->mutex);
-		break;
-	    }	
-	    cur_lines += lines;
-            pthread_mutex_unlock(&ctx->mutex);	
-
-	    draw_frame(ctx);
-	    free(c);	
-	    sleep(1);
+#endif
+		return -1;
+	    }
+	stage_done(ctx, STAGE_RENDER, t);
+#ifdef ZERO_COPY
+	pthread_mutex_unlock(&ctx->mutex);
+#endif
+	if(ctx->stats) {
+	    ctx->stats->dropped += dropped;
+	    ctx->stats->frames++;
 	}
 
-    return 0;		
+    return 1;
 }
 
-#ifdef TESTCPP
-extern int test_cplusplus();
+#ifndef ZERO_COPY
+/* Blank the w x h rectangle at x, y of the screen in the canvas */
+
+static void clear_rect(struct ctx *ctx, int x, int y, int w, int h)
+{
+    int bpp = bytes_per_pixel(ctx), k;
+
+	if(x < 0) {
+	    w += x;
+	    x = 0;
+	}
+	if(y < 0) {
+	    h += y;
+	    y = 0;
+	}
+	if(x + w > ctx->width) w = ctx->width - x;
+	if(y + h > ctx->height) h = ctx->height - y;
+	if(w <= 0 || h <= 0) return;
+	for(k = y; k < y + h; k++) memset(ctx->buffer + (buffer_row(ctx, k) * ctx->stride + x) * bpp, 0, w * bpp);
+	mark_dirty(ctx, x, y, w, h);
+}
 #endif
 
+/* Move the greeting to x, y. In zero copy mode draw_frame() draws it, else it goes
+   into the canvas over what was there and leaves a blank where it was. */
 
-void android_main(struct android_app* app) 
+static int show_greeting(struct ctx *ctx, int x, int y)
 {
-    struct ctx *ctx = 0;
-    int ident, events;
-    struct android_poll_source* source;
-    char prop_density[PROP_VALUE_MAX];
-
-    app_dummy();
+    static char text[] = "BRAVO, Mr. T.W.Lewis\nЭто по-русски\n";
+    struct text_item *g = &ctx->greeting;
+    int lines;
 
-#ifdef __arm__
-    log_info("starting arm code");
-#elif defined(__aarch64__)
-    log_info("starting aarch64 code");
+	if(ft_get_string_metrics(ctx, text, 1000, &lines) != 0) return -1;
+#ifdef ZERO_COPY
+	pthread_mutex_lock(&ctx->mutex);
+	if(g->text) mark_dirty(ctx, 0, g->y, ctx->width, g->height);
 #else
-#error "Arch unknown, please port me" 
+	if(g->text) clear_rect(ctx, g->x, g->y, g->width, g->height);
 #endif
-
-#ifdef TESTCPP
-    test_cplusplus();
+	g->text = text;
+	g->x = x;
+	g->y = y;
+	g->width = 1000;
+	g->height = (lines + 1) * ft_get_line_height(ctx);
+#ifdef ZERO_COPY
+	mark_dirty(ctx, 0, y, ctx->width, g->height);
+	pthread_mutex_unlock(&ctx->mutex);
+	return 0;
+#else
+	return ft_render_string(ctx, text, x, y, g->width);
 #endif
+}
 
-    ctx = (struct ctx *) calloc(1, sizeof(struct ctx));
-    if(!ctx) {
-	log_error("no memory");
-    	ANativeActivity_finish(app->activity);
-	return;
-    }	
-
-    app->onAppCmd = handle_cmd;
-    app->onInputEvent = handle_input;
-    app->userData = ctx;
+static inline int touch_pending(struct ctx *ctx)
+{
+    return atomic_load(&ctx->touch_head) != atomic_load(&ctx->touch_tail);
+}
 
-    pthread_mutex_init(&ctx->mutex, 0);
-    ctx->app = app;
+/* Move the greeting to the latest of the touches handed over, they all go with one frame.
+   Returns the end of those touches in the ring, for touches_shown(). */
 
-    if(__system_property_get("ro.sf.lcd_density", prop_density) < 0 
-	|| sscanf(prop_density, "%d", &ctx->dpi) != 1) {
-	log_info("failed to find screen density, assuming 480");
-	ctx->dpi = 480;
-    }
+static unsigned show_touches(struct ctx *ctx)
+{
+    unsigned tail = atomic_load_explicit(&ctx->touch_tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&ctx->touch_head, memory_order_acquire);
+    const struct touch *p = &ctx->touches[(head - 1) % TOUCH_QUEUE];
 
-    ctx->fmt = WINDOW_FORMAT_RGB_565; // WINDOW_FORMAT_RGBA_8888;
+	if(head != tail && show_greeting(ctx, p->x, p->y) != 0) log_error("rendering failed");
+    return head;
+}
 
-    if(ft_init(ctx) != 0) {
-	done(ctx);
-	return;
-    }
+/* Give the ring up to "head" back once the frame with those touches was presented at "t" */
 
-    while(1) {	
-	while((ident = ALooper_pollAll(-1, NULL, &events, (void**)&source)) >= 0) {
-	    if(source) source->process(app, source);
-	    if(app->destroyRequested != 0) {
-		stop_app_thread(ctx);
-		log_info("destroyed.");	
-		done(ctx);	
-		return;
+static void touches_shown(struct ctx *ctx, unsigned head, uint64_t t)
+{
+    unsigned tail = atomic_load_explicit(&ctx->touch_tail, memory_order_relaxed);
+    const struct touch *p;
+
+	if(head == tail) return;
+	if(ctx->stats) {
+	    ctx->stats->touches += head - tail;
+	    ctx->stats->touch_frames++;
+	    for(; tail != head; tail++) {
+		p = &ctx->touches[tail % TOUCH_QUEUE];
+		hist_add(ctx->stats->touch_hist, t > p->t ? t - p->t : 0);
 	    }
 	}
-    }
+	atomic_store_explicit(&ctx->touch_tail, head, memory_order_release);
+}
+
+static int running(struct ctx *ctx)
+{
+    int run;
+	pthread_mutex_lock(&ctx->mutex);
+	run = ctx->should_run;
+	pthread_mutex_unlock(&ctx->mutex);
+    return run;
+}
+
+/* No more lines, app_thread goes on showing touches and redraws */
+
+static void source_done(struct ctx *ctx)
+{
+	pthread_mutex_lock(&ctx->mutex);
+	ctx->source_done = 1;
+	pthread_mutex_unlock(&ctx->mutex);
 }
 
+/* Write the text engine counters to the log */
 
+static void dump_stats(struct ctx *ctx)
+{
+    struct ft_stats st;
+    char buf[512];
+	ft_get_stats(ctx, &st);
+	ft_format_stats(&st, buf, sizeof(buf));
+	log_info("stats: %s", buf);
+}
+
+static void *app_thread(void *arg) 
+{
+    struct ctx *ctx = (struct ctx *) arg;
+    struct frame_clock *clk = ctx->clock;
+    struct console con;
+    uint64_t deadline, vsync, t, t0, dump;
+    unsigned head;
+    int r, due;
+
+	prctl(PR_SET_NAME, "app_thread");	/* for traces and top */
+	if(console_init(ctx, &con) != 0) goto done;
+	dump = (deadline = clk->now(clk)) + ctx->stats_period;
+
+	while(running(ctx)) {
+	    /* wait for something to show: lines, touches or a redraw */
+	    due = 0;
+	    if(ctx->source_done) clk->sleep(clk, CLOCK_NEVER, &ctx->wake);
+	    else if(!ctx->source->take) due = clk->sleep(clk, deadline, &ctx->wake);
+	    else if((due = read_batch(ctx, deadline)) < 0) {
+		source_done(ctx);
+		due = 0;
+	    }
+	    if(!due && !touch_pending(ctx) && !atomic_load(&ctx->redraw)) continue;
+
+	    /* then for the vsync the frame goes out with, and lay out all that is due by it */
+	    vsync = clk->vsync(clk);
+	    t0 = ctx->metrics ? clock_ns() : 0;
+	    TRACE_SCOPE("frame");
+	    if(due) {
+		if(ctx->source->take) {
+		    r = show_batch(ctx, &con);
+		    deadline = vsync + ctx->period;	/* lines coming in until then go with the next frame */
+		} else r = show_lines(ctx, &con, &deadline, vsync);
+		if(r < 0) break;
+		if(!r) source_done(ctx);
+	    }
+	    head = show_touches(ctx);
+	    t = ctx->stats ? clock_ns() : 0;
+	    present(ctx);
+	    touches_shown(ctx, head, stage_done(ctx, STAGE_PRESENT, t));
+	    ctx->presented++;
+	    if(clk->period && clk->now(clk) > vsync + clk->period) ctx->missed++;
+	    if(ctx->metrics) metrics_frame(ctx, clock_ns() - t0);
+	    if(ctx->stats_period && vsync >= dump) {
+		dump_stats(ctx);
+		dump = vsync + ctx->stats_period;
+	    }
+	}
+	log_info("%s: %llu frames presented, %llu late for their vsync", __func__, ctx->presented, ctx->missed);
+
+    done:	/* for running() of the backend, app_stop() still joins */
+	pthread_mutex_lock(&ctx->mutex);
+	ctx->should_run = 0;
+	pthread_mutex_unlock(&ctx->mutex);
+    return 0;		
+}
@@ -1,44 +1,366 @@
 #ifndef __MAIN_H_INCLUDED
 #define __MAIN_H_INCLUDED
 
-#include <android/log.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+
+#include "trace.h"
 
 #define APP_TAG	"test2"
-#define log_error(...) ((void)__android_log_print(ANDROID_LOG_ERROR, APP_TAG, __VA_ARGS__))
-#define log_info(...) ((void)__android_log_print(ANDROID_LOG_INFO, APP_TAG, __VA_ARGS__))
-#if 1
-#define log_debug(...)
+#define LOG_TAG	APP_TAG
+#include "log.h"
+#ifdef __ANDROID__
+#include <android/native_window.h>
 #else
-#define log_debug log_info
+#define WINDOW_FORMAT_RGBA_8888	1	/* values of android/native_window.h */
+#define WINDOW_FORMAT_RGB_565	4
 #endif
 
 
+#ifdef __ANDROID__
 #define DEFAULT_FACE	"/system/fonts/Roboto-Regular.ttf" 
+/* Faces tried in this order for chars DEFAULT_FACE lacks */
+#define DEFAULT_FALLBACKS { 						\
+	"/system/fonts/NotoSansCJK-Regular.ttc",			\
+	"/system/fonts/NotoSansSymbols-Regular-Subsetted.ttf",		\
+	"/system/fonts/NotoSansSymbols-Regular-Subsetted2.ttf",		\
+	0 }
+#else
+#define DEFAULT_FACE	"/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf"
+#define DEFAULT_FALLBACKS { 						\
+	"/usr/share/fonts/opentype/noto/NotoSansCJK-Regular.ttc",	\
+	"/usr/share/fonts/truetype/noto/NotoSansSymbols-Regular.ttf",	\
+	0 }
+#endif
 #define DEFAULT_FSIZE	8
+#define SUBPIXEL_PHASES	4	/* horizontal glyph positions per pixel */
 
-struct android_app;
 struct ft_ctx;
 
+#define DIRTY_SPANS	8
+#define DAMAGE_HISTORY	4		/* frames of damage kept to bring older buffers up to date */
+struct span { int top, bottom; };	/* rows top to bottom - 1 */
+struct rect { int left, top, right, bottom; };
+
+/* Screen rows that changed, merged into at most DIRTY_SPANS spans, and the columns they cover */
+struct damage {
+    int n, left, right;
+    struct span spans[DIRTY_SPANS];
+};
+
+/* Render target, see surface.c */
+struct surface_buffer {
+    void *bits;
+    int width, height, stride, fmt;
+    int age;				/* frames since it was last shown, 0 if its content is undefined */
+};
+struct surface {
+    /* "dirty" is what the caller will change, the surface may grow it */
+    int (*lock)(struct surface *s, struct surface_buffer *buf, struct rect *dirty);
+    void (*post)(struct surface *s);
+    void (*destroy)(struct surface *s);
+};
+extern struct surface *mem_surface_create(int width, int height, int fmt, int n);
+extern const void *mem_surface_front(struct surface *s);
+extern unsigned mem_surface_frames(struct surface *s);
+/* Write each frame posted to a PPM file named by printf "pattern" with the frame number */
+extern void mem_surface_dump(struct surface *s, const char *pattern);
+/* Drop the frames posted after the first "frames", so a run counts exactly that many */
+extern void mem_surface_limit(struct surface *s, unsigned frames);
+
+/* Display timing app_thread paces frames by, see sched.c. Times are in ns. */
+#define CLOCK_NEVER	UINT64_MAX
+struct frame_clock {
+    long period;			/* between vsyncs, 0 if there are none to wait for */
+    uint64_t (*now)(struct frame_clock *c);
+    /* Wait until time "t", returns false when "wake" was posted before */
+    int (*sleep)(struct frame_clock *c, uint64_t t, sem_t *wake);
+    /* Wait for the next vsync and return its time, or the time now without vsyncs */
+    uint64_t (*vsync)(struct frame_clock *c);
+    void (*destroy)(struct frame_clock *c);
+};
+extern struct frame_clock *mono_clock_create(long period);
+extern struct frame_clock *virtual_clock_create(long period);
+
+struct text_item {
+    char *text;
+    int x, y, width, height;
+};
+
+/* Lines for app_thread, see source.c. next() returns a line good until the next call, or 0 at the end. */
+struct text_source {
+    const char *(*next)(struct text_source *src);
+    void (*destroy)(struct text_source *src);
+    /* Streams only, 0 for the others. fill() waits up to "ms" for lines and reads all that came,
+       returning how many are ready, -1 at the end. take() hands out the last "max" of them
+       at most, good until the next fill(), and how many were dropped unseen since the last take(). */
+    int (*fill)(struct text_source *src, int ms);
+    int (*take)(struct text_source *src, const char **lines, int max, unsigned *dropped);
+};
+extern struct text_source *numbers_source_create(void);
+extern struct text_source *file_source_create(const char *file);
+extern struct text_source *random_source_create(unsigned seed);
+extern struct text_source *fd_source_create(int fd);
+
+/* Numbers in words, see source.c */
+#define NUM2WORDS_MAX	260		/* longest words for a 64-bit number, without the NUL */
+extern int num2words(uint64_t num, char *buf, size_t size);
+extern unsigned num2words_range(uint64_t first, unsigned count, char *arena, size_t size, const char **words);
+
+/* Benchmark statistics, collected by app_thread when ctx->stats is set */
+enum { STAGE_METRICS, STAGE_SCROLL, STAGE_RENDER, STAGE_PRESENT, STAGES };
+#define HIST_SUB	32				/* buckets per power of 2 */
+#define HIST_BUCKETS	(HIST_SUB * 29)			/* up to 2^32 ns */
+struct app_stats {
+    unsigned long long lines, glyphs;
+    unsigned long long dropped, frames;		/* stream lines never shown, frames they were shown in */
+    unsigned long long blitted;			/* bytes written to the surface */
+    unsigned hist[STAGES][HIST_BUCKETS];	/* stage latencies in ns, see hist_add() */
+    unsigned long long touches, touch_frames;	/* touch samples taken, frames they were shown in */
+    unsigned touch_hist[HIST_BUCKETS];		/* from each touch sample to the frame showing it */
+};
+
+/* Text engine counters, see ft_get_stats(). Only the thread that draws adds to them, with
+   relaxed loads and stores, so reading them from any other thread costs it nothing. */
+enum {
+    FT_STAT_GLYPH_HITS, FT_STAT_GLYPH_MISSES,
+    FT_STAT_GLYPH_EVICTIONS,			/* entries flushed from the glyph caches */
+    FT_STAT_GLYPH_ENTRIES, FT_STAT_GLYPH_BYTES,	/* in the glyph caches now */
+    FT_STAT_RASTERIZED, FT_STAT_RASTER_NS,	/* glyphs FreeType rendered, and the time it took */
+    FT_STAT_MEASURED, FT_STAT_RENDERED,		/* strings */
+    FT_STAT_PIXELS_565, FT_STAT_PIXELS_8888,	/* glyph pixels written, per window format */
+    FT_STAT_SCROLL_BYTES,			/* moved or cleared by scrolling */
+    FT_STAT_PRESENTS, FT_STAT_PRESENT_BYTES,	/* frames posted, bytes copied to the window for them */
+    FT_STATS
+};
+struct ft_stats {
+    unsigned long long n[FT_STATS];
+};
+
+/* Touch samples, passed from the UI thread to app_thread in a ring, see app_touch() */
+#define TOUCH_QUEUE	256		/* samples, a power of 2 */
+struct touch {
+    int x, y;
+    uint64_t t;				/* when it happened, CLOCK_MONOTONIC ns */
+};
+/* Latency "pct" percent of the samples in "hist" are within, in ns */
+extern uint64_t hist_percentile(const unsigned *hist, int pct);
+
 struct ctx {
-    struct  android_app* app;
     int	dpi;				/* screen pixel density */
     int fmt, height, width, stride;	/* window params */
-    void *buffer;			/* window buffer */	    
+    void *buffer;			/* what text is drawn into: app_thread's canvas, the locked window buffer in zero copy mode */	    
+    struct surface *surface;
+    struct frame_clock *clock;		/* what frames are paced by, CLOCK_MONOTONIC without vsyncs by default */
+    unsigned long long presented, missed;	/* frames app_thread presented, and those late for their vsync */
+    int band_y, band_rows, band_head;	/* scrolling band: buffer rows band_y.. are a ring starting at band_head */
+    struct rect clip;			/* where text may be drawn, within the buffer, see ft_set_clip() */
+    struct damage dirty;		/* changed since the last frame */
+    struct damage history[DAMAGE_HISTORY];	/* changed by the last frames, latest first */
+    atomic_int redraw;			/* the window needs all of the next frame */
+#ifdef ZERO_COPY
+    struct text_item *items;		/* text on the screen, redrawn where a buffer is stale */
+    int nitems;
+    struct span scroll;			/* rows moved up by scroll_dy since the last frame */
+    int scroll_dy;
+#else
+    unsigned seq, shown;		/* frames drawn by app_thread and shown by draw_frame() */
+#endif
+    pthread_mutex_t present;		/* held by draw_frame() while the window buffer is locked */
+    int paused;				/* no window to draw on, see app_pause() */
+    struct touch touches[TOUCH_QUEUE];	/* ring of samples app_touch() puts and app_thread takes */
+    atomic_uint touch_head, touch_tail;	/* samples put and taken so far */
+    struct text_item greeting;		/* drawn where the screen was touched last, no text before */
     struct  ft_ctx *fctx;
     pthread_mutex_t mutex;
+    sem_t wake;				/* posted for app_thread waiting between lines */
     pthread_t app_thread;
-    int should_run;
+    int should_run;			/* cleared by app_stop(), and by app_thread when it quits */
+    int source_done;			/* no lines left, app_thread only shows touches and redraws */
+    long period;			/* ns between lines, 0 for as fast as they can be drawn */
+    struct text_source *source;		/* where lines come from, numbers in words by default */
+    struct app_stats *stats;		/* 0 unless benchmarking */
+    atomic_ullong counters[FT_STATS];	/* see ft_get_stats() */
+    uint64_t stats_period;		/* ns between dumps of the counters to the log, 0 for none */
+    struct metrics *metrics;		/* page published for monitors, 0 for none */
 };
 
+/* App core, see main.c */
+extern struct ctx *app_create(int dpi, int fmt);
+extern int app_start(struct ctx *ctx, struct surface *s, int width, int height, int stride);
+extern void app_touch(struct ctx *ctx, const struct touch *t, int n);
+extern void app_redraw(struct ctx *ctx);
+extern void app_pause(struct ctx *ctx);
+extern void app_resume(struct ctx *ctx);
+extern void app_stop(struct ctx *ctx);
+extern void app_destroy(struct ctx *ctx);
+
+/* Metrics page other processes can read, see metrics.c and metrics.h */
+struct metrics;
+extern struct metrics *metrics_create(const char *file);
+extern void metrics_frame(struct ctx *ctx, uint64_t ns);
+extern void metrics_destroy(struct metrics *m);
+
+/* Add "n" to counter "k", by the thread that draws only */
+static inline void stat_add(atomic_ullong *counters, int k, unsigned long long n)
+{
+    atomic_store_explicit(&counters[k], atomic_load_explicit(&counters[k], memory_order_relaxed) + n,
+	    memory_order_relaxed);
+}
+
+/* Row of ctx->buffer that holds screen row "y" */
+static inline int buffer_row(const struct ctx *c, int y)
+{
+    int k = y - c->band_y;
+    if(k < 0 || k >= c->band_rows) return y;
+    k += c->band_head;
+    return c->band_y + (k >= c->band_rows ? k - c->band_rows : k);
+}
+
+extern void damage_add(struct damage *d, int top, int bottom);
+
+/* Record that the w x h rectangle at x, y of the screen has to go out with the next frame */
+static inline void mark_dirty(struct ctx *c, int x, int y, int w, int h)
+{
+    struct damage *d = &c->dirty;
+    struct span *s;
+    if(!d->n) {
+	d->left = x;
+	d->right = x + w;
+	damage_add(d, y, y + h);
+	return;
+    }
+    if(x < d->left) d->left = x;
+    if(x + w > d->right) d->right = x + w;
+    s = &d->spans[d->n - 1];
+    if(y <= s->bottom && y + h >= s->top) {	/* most marks touch the last span */
+	if(y < s->top) s->top = y;
+	if(y + h > s->bottom) s->bottom = y + h;
+    } else damage_add(d, y, y + h);
+}
+
 extern int ft_init(struct ctx *ctx);
 extern void ft_quit(struct ctx *ctx);
 
 /* "file" is full path to ttf font file, "size" is its size in points */
 extern int ft_set_face(struct ctx *ctx, const char *file, int size);
 
+/* Counters of the text engine as they are now, from any thread; the gauges are what is
+   cached now, the others count from ft_init(). ft_format_stats() writes them as a line
+   of name=value pairs. */
+extern void ft_get_stats(struct ctx *c, struct ft_stats *st);
+extern int ft_format_stats(const struct ft_stats *st, char *buf, size_t size);
+extern const char *const ft_stat_names[FT_STATS];
+
 extern int ft_get_line_height(struct ctx *c);
 extern int ft_get_string_metrics(struct ctx *c, const char *str, int target_width, int *target_lines);
 extern int ft_render_string(struct ctx *ctx, const char *str, int start_x, int start_y, int width);
+extern int ft_get_advance(struct ctx *c, uint32_t ch);
+
+/* Width in pixels of the widest line of "str" drawn unwrapped */
+extern int ft_max_string_width(struct ctx *c, const char *str);
+
+/* Draw text only within "r", which is cut to the buffer; a null "r" is all of it */
+extern void ft_set_clip(struct ctx *c, const struct rect *r);
+
+/* Cell size for fixed pitch grids and a char's coverage in a cell, see grid.c */
+extern int ft_get_cell_size(struct ctx *c, int *width, int *height, int *ascent);
+extern int ft_render_cell(struct ctx *c, uint32_t ch, uint8_t *cov, int width, int height, int ascent);
+
+/* Append a face to the chain tried for chars the current face has no glyphs for */
+extern int ft_add_fallback(struct ctx *c, const char *file);
+
+/* Glyph positions per pixel, 1 to 4; 1 means whole pixels and hinted advances */
+extern int ft_set_subpixel(struct ctx *c, int phases);
+
+/* Apply pair kerning from the face (on by default) */
+extern int ft_set_kerning(struct ctx *c, int on);
+
+/* Draw text at "size" points from distance fields rendered at the face size (0 = off) */
+extern int ft_set_sdf_size(struct ctx *c, int size);
+
+/* Line break opportunities after UAX #14, see linebreak.c */
+enum { LB_NONE, LB_ALLOW, LB_MUST };
+struct lb_state { uint8_t last, base, ri, zwj, hl_hy, started; uint16_t range; };
+extern void lb_init(struct lb_state *st);
+extern int lb_next(struct lb_state *st, uint32_t ch);
+
+/* Whether "ch" ends a line by itself: newlines, form feeds, line and paragraph separators */
+static inline int lb_hard(uint32_t ch)
+{
+    return (ch >= 0x0a && ch <= 0x0d) || ch == 0x85 || ch == 0x2028 || ch == 0x2029;
+}
+
+/* Fixed pitch grid of character cells drawn into ctx->buffer, see grid.c.
+   Cells hold a char and an attribute with foreground and background colors out of 16. */
+#define GRID_ATTR(fg, bg)	((fg) | (bg) << 4)
+#define GRID_ATTR_DEFAULT	GRID_ATTR(7, 0)
+#define GRID_CELL(ch, attr)	((uint32_t) (ch) | (uint32_t) (attr) << 21)
+#define GRID_CHAR(v)		((v) & 0x1fffff)
+#define GRID_FG(v)		((v) >> 21 & 15)
+#define GRID_BG(v)		((v) >> 25 & 15)
+struct grid;
+extern struct grid *grid_create(struct ctx *c, int x, int y, int rows, int cols);
+extern void grid_destroy(struct grid *g);
+extern void grid_cell_size(const struct grid *g, int *width, int *height);
+extern void grid_put(struct grid *g, int row, int col, uint32_t ch, int attr);
+extern int grid_print(struct grid *g, int row, int col, const char *s, int attr);
+extern void grid_clear(struct grid *g, int row, int n, int attr);
+extern void grid_scroll(struct grid *g, int n);
+extern int grid_draw(struct grid *g);
+
+/* UTF-8 text files shown a viewport at a time, indexed into screen lines in the background, see doc.c */
+struct doc;
+extern struct doc *doc_open(struct ctx *c, const char *file, int width);
+extern void doc_close(struct doc *d);
+extern int doc_pump(struct doc *d);
+extern unsigned doc_lines(struct doc *d, int *done);
+extern size_t doc_line_offset(struct doc *d, unsigned k);
+extern unsigned doc_find(struct doc *d, size_t offs);
+extern int doc_draw(struct doc *d, unsigned first, int x, int y, int rows);
+extern int doc_draw_at(struct doc *d, size_t offs, int x, int y, int rows);
+extern int doc_set_width(struct doc *d, int width);
+extern int doc_refresh(struct doc *d);
+
+#ifdef SHAPING
+/* Shape text with HarfBuzz when it is available (on by default) */
+extern int ft_set_shaping(struct ctx *c, int on);
+
+/* HarfBuzz shaper for one face file and size, see shape.c */
+struct shaper;
+struct shaped_glyph {
+    uint32_t gid, cluster;
+    int32_t x_advance, x_offset, y_offset;	/* 26.6 */
+};
+extern struct shaper *shaper_create(const char *file, int ppem);
+extern void shaper_destroy(struct shaper *sh);
+extern int shaper_levels(const uint32_t *text, int len, uint8_t *levels);
+extern int shaper_run_end(const uint32_t *text, int len, const uint8_t *levels, int start, uint32_t *script);
+extern int shaper_run(struct shaper *sh, const uint32_t *text, int len, uint32_t script, int rtl,
+	const struct shaped_glyph **glyphs);
+#endif
+
+#ifdef SHARED_ATLAS
+/* Publish glyphs cached so far for the current face/size/dpi to other processes */
+extern int ft_share_glyphs(struct ctx *c);
+
+/* Shared glyph atlas segment, see atlas.c */
+struct atlas;
+struct atlas_glyph {
+    uint32_t gid;			/* glyph index in the face */
+    int32_t dx;				/* subpixel offset, 26.6 */
+    int32_t advance;			/* 26.6, glyphs wider than 511 pixels do not fit 16 bits */
+    uint32_t offs;			/* bitmap offset in the data area */
+    int16_t width, rows, pitch;
+    int16_t left, top;
+};
+extern struct atlas *atlas_attach(const char *face, int size, int dpi, int phases);
+extern struct atlas *atlas_publish(const char *face, int size, int dpi, int phases,
+	const struct atlas_glyph *glyphs, int n, const uint8_t *data, size_t data_size);
+extern void atlas_detach(struct atlas *at);
+extern const struct atlas_glyph *atlas_lookup(const struct atlas *at, uint32_t gid, int dx);
+extern const uint8_t *atlas_data(const struct atlas *at, const struct atlas_glyph *g);
+#endif
 
 
 extern void *fake_dlopen(const char *filename, int flags);
@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "main.h"
+#include "metrics.h"
+
+/* Metrics page.
+   app_thread publishes its frame times, the text engine counters and the fake_dlopen()
+   timings in a page other processes can map: a memfd named METRICS_NAME they find
+   in /proc/<pid>/fd, or a file. It updates the page once a frame under a sequence
+   count, which is odd while it does, so readers (metrics_read()) copy it again when
+   it changed under them and never hold the writer up. See metrics_cli.c for one. */
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC		0x0001U
+#endif
+
+_Static_assert(FT_STATS <= METRICS_COUNTERS, "no room for the text engine counters");
+
+struct metrics {
+    struct metrics_page *page;
+    int fd;			/* memfd kept open, so it can be found, -1 for a file */
+};
+
+static atomic_ullong dlopen_calls, dlopen_failed, dlopen_ns, dlopen_max_ns;
+
+void metrics_dlopen(uint64_t ns, int failed)
+{
+    unsigned long long max = atomic_load_explicit(&dlopen_max_ns, memory_order_relaxed);
+	atomic_fetch_add_explicit(&dlopen_calls, 1, memory_order_relaxed);
+	if(failed) atomic_fetch_add_explicit(&dlopen_failed, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&dlopen_ns, ns, memory_order_relaxed);
+	while(ns > max && !atomic_compare_exchange_weak_explicit(&dlopen_max_ns, &max, ns,
+		memory_order_relaxed, memory_order_relaxed));
+}
+
+/* A page in "file", or in a memfd for a null "file" */
+
+struct metrics *metrics_create(const char *file)
+{
+    struct metrics *m = (struct metrics *) calloc(1, sizeof(struct metrics));
+    struct metrics_page *p;
+    int fd, k;
+
+	if(!m) {
+	    log_error("no memory for metrics");
+	    return 0;
+	}
+	if(file) fd = open(file, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	else {
+#ifdef __NR_memfd_create
+	    fd = syscall(__NR_memfd_create, METRICS_NAME, MFD_CLOEXEC);	/* no wrapper in older bionic */
+#else
+	    fd = -1;
+	    errno = ENOSYS;
+#endif
+	}
+	if(fd < 0) {
+	    log_error("failed to create metrics page %s: %s", file ? file : METRICS_NAME, strerror(errno));
+	    free(m);
+	    return 0;
+	}
+	if(ftruncate(fd, sizeof(struct metrics_page)) != 0
+	    || (p = (struct metrics_page *) mmap(0, sizeof(struct metrics_page), PROT_READ | PROT_WRITE,
+		    MAP_SHARED, fd, 0)) == MAP_FAILED) {
+	    log_error("failed to map metrics page: %s", strerror(errno));
+	    close(fd);
+	    free(m);
+	    return 0;
+	}
+	p->version = METRICS_VERSION;
+	p->size = sizeof(struct metrics_page);
+	p->pid = getpid();
+	p->ncounters = FT_STATS;
+	for(k = 0; k < FT_STATS; k++) strncpy(p->names[k], ft_stat_names[k], sizeof(p->names[k]) - 1);
+	p->updated = metrics_ns();
+	atomic_store_explicit(&p->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	p->magic = METRICS_MAGIC;	/* last, so a reader does not take a page being set up */
+	m->page = p;
+	if(file) close(fd);
+	m->fd = file ? -1 : fd;
+	log_info("%s: %s", __func__, file ? file : METRICS_NAME);
+
+    return m;
+}
+
+/* Record a frame of app_thread, which took "ns" from vsync to present */
+
+void metrics_frame(struct ctx *ctx, uint64_t ns)
+{
+    struct metrics_page *p = ctx->metrics->page;
+    unsigned seq = atomic_load_explicit(&p->seq, memory_order_relaxed);
+    uint64_t us = ns / 1000;
+    int b = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    struct ft_stats st;
+
+	ft_get_stats(ctx, &st);
+	atomic_store_explicit(&p->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	p->updated = metrics_ns();
+	p->frames = ctx->presented;
+	p->late = ctx->missed;
+	p->frame_hist[b < METRICS_HIST ? b : METRICS_HIST - 1]++;
+	p->dlopen_calls = atomic_load_explicit(&dlopen_calls, memory_order_relaxed);
+	p->dlopen_failed = atomic_load_explicit(&dlopen_failed, memory_order_relaxed);
+	p->dlopen_ns = atomic_load_explicit(&dlopen_ns, memory_order_relaxed);
+	p->dlopen_max_ns = atomic_load_explicit(&dlopen_max_ns, memory_order_relaxed);
+	memcpy(p->counters, st.n, sizeof(st.n));
+	atomic_store_explicit(&p->seq, seq + 2, memory_order_release);
+}
+
+void metrics_destroy(struct metrics *m)
+{
+    if(!m) return;
+    munmap(m->page, sizeof(struct metrics_page));
+    if(m->fd >= 0) close(m->fd);
+    free(m);
+}
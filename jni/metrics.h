@@ -0,0 +1,61 @@
+#ifndef __METRICS_H_INCLUDED
+#define __METRICS_H_INCLUDED
+
+/* Metrics page, see metrics.c. Shared with metrics_cli.c, which reads it from other processes,
+   so everything in it has a fixed size and place. A writer only adds fields at the end,
+   and bumps METRICS_VERSION when it changes what is there. */
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#define METRICS_MAGIC		0x4d325454	/* "TT2M" */
+#define METRICS_VERSION		1
+#define METRICS_NAME		"test2-metrics"	/* of the memfd, see /proc/<pid>/fd */
+#define METRICS_HIST		32		/* frame time buckets */
+#define METRICS_COUNTERS	32		/* text engine counters there is room for */
+
+struct metrics_page {
+    uint32_t magic, version;
+    uint32_t size;			/* of the page as the writer knows it */
+    int32_t pid;
+    atomic_uint seq;			/* odd while the writer updates the page */
+    uint32_t ncounters;			/* used of counters[] */
+    uint64_t updated;			/* CLOCK_MONOTONIC ns of the last update */
+    uint64_t frames, late;		/* presented by app_thread, and late for their vsync */
+    uint32_t frame_hist[METRICS_HIST];	/* frames by time from vsync to present: k for up to 2^k us */
+    uint64_t dlopen_calls, dlopen_failed;	/* fake_dlopen() */
+    uint64_t dlopen_ns, dlopen_max_ns;	/* total time in it, and its longest call */
+    uint64_t counters[METRICS_COUNTERS];	/* of ft_get_stats() */
+    char names[METRICS_COUNTERS][24];	/* and their names */
+};
+_Static_assert(sizeof(struct metrics_page) == 1232, "metrics page layout");
+
+static inline uint64_t metrics_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Copy "page" to "out" as the writer left it after an update; 0 if it was in the middle
+   of one every time it was tried, e.g. when it died in it. The writer never waits. */
+static inline int metrics_read(const struct metrics_page *page, struct metrics_page *out)
+{
+    unsigned seq;
+    int k;
+	for(k = 0; k < 1000; k++) {
+	    seq = atomic_load_explicit(&page->seq, memory_order_acquire);
+	    if(seq & 1) continue;
+	    memcpy((void *) out, (const void *) page, sizeof(*out));
+	    atomic_thread_fence(memory_order_acquire);
+	    if(atomic_load_explicit(&page->seq, memory_order_relaxed) == seq) return 1;
+	}
+    return 0;
+}
+
+/* Record a fake_dlopen() call that took "ns", from any thread */
+extern void metrics_dlopen(uint64_t ns, int failed);
+
+#endif
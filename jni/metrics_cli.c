@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "metrics.h"
+
+/* Prints the metrics page of a running app (see metrics.c), once or every "seconds":
+	test2_metrics pid|file [seconds]
+   The memfd of a pid is found in /proc/<pid>/fd, which takes its user or root. */
+
+/* Open the page of process "arg", or file "arg" when it is not a number */
+
+static int open_page(const char *arg)
+{
+    static const char name[] = "/memfd:" METRICS_NAME " ";	/* then "(deleted)" */
+    char path[300], link[256];
+    struct dirent *e;
+    ssize_t n;
+    DIR *d;
+    int fd = -1;
+
+	if(arg[strspn(arg, "0123456789")]) return open(arg, O_RDONLY | O_CLOEXEC);
+	snprintf(path, sizeof(path), "/proc/%s/fd", arg);
+	if(!(d = opendir(path))) return -1;
+	while(fd < 0 && (e = readdir(d))) {
+	    snprintf(path, sizeof(path), "/proc/%s/fd/%s", arg, e->d_name);
+	    if((n = readlink(path, link, sizeof(link) - 1)) < 0) continue;
+	    link[n] = 0;
+	    if(strncmp(link, name, sizeof(name) - 1) == 0) fd = open(path, O_RDONLY | O_CLOEXEC);
+	}
+	closedir(d);
+	if(fd < 0 && !e) errno = ENOENT;
+    return fd;
+}
+
+/* Frame time in us "pct" percent of the frames took at most, to a power of 2 */
+
+static unsigned long percentile(const struct metrics_page *m, int pct)
+{
+    uint64_t total = 0, n = 0;
+    int k;
+	for(k = 0; k < METRICS_HIST; k++) total += m->frame_hist[k];
+	for(k = 0; k < METRICS_HIST; k++)
+	    if((n += m->frame_hist[k]) * 100 >= total * pct) break;
+    return 1ul << (k < METRICS_HIST ? k : METRICS_HIST - 1);
+}
+
+static uint64_t counter(const struct metrics_page *m, const char *name)
+{
+    unsigned k;
+	for(k = 0; k < m->ncounters && k < METRICS_COUNTERS; k++)
+	    if(strncmp(m->names[k], name, sizeof(m->names[k])) == 0) return m->counters[k];
+    return 0;
+}
+
+static void print_page(const struct metrics_page *m)
+{
+    uint64_t hits = counter(m, "glyph_hits"), misses = counter(m, "glyph_misses");
+    unsigned k;
+
+	printf("pid %d, updated %.3f s ago\n", m->pid, (metrics_ns() - m->updated) / 1e9);
+	printf("frames: %llu presented, %llu late for their vsync, vsync to present p50 <= %lu us, p99 <= %lu us\n",
+		(unsigned long long) m->frames, (unsigned long long) m->late, percentile(m, 50), percentile(m, 99));
+	printf("glyph cache: %.2f%% hits\n", hits + misses ? 100.0 * hits / (hits + misses) : 0);
+	printf("fake_dlopen: %llu calls, %llu failed, %.3f ms in all, %.3f ms the longest\n",
+		(unsigned long long) m->dlopen_calls, (unsigned long long) m->dlopen_failed,
+		m->dlopen_ns / 1e6, m->dlopen_max_ns / 1e6);
+	for(k = 0; k < m->ncounters && k < METRICS_COUNTERS; k++)
+	    printf("  %-20.*s %llu\n", (int) sizeof(m->names[k]), m->names[k], (unsigned long long) m->counters[k]);
+}
+
+int main(int argc, char **argv)
+{
+    const struct metrics_page *page;
+    struct metrics_page m;
+    double every = argc > 2 ? atof(argv[2]) : 0;
+    struct timespec ts = { (time_t) every, (every - (time_t) every) * 1e9 };
+    struct stat st;
+    int fd;
+
+	if(argc < 2 || argc > 3) {
+	    fprintf(stderr, "usage: %s pid|file [seconds]\n", argv[0]);
+	    return 1;
+	}
+	if((fd = open_page(argv[1])) < 0) {
+	    fprintf(stderr, "no metrics page for %s: %s\n", argv[1], strerror(errno));
+	    return 1;
+	}
+	if(fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(struct metrics_page)
+	    || (page = (const struct metrics_page *) mmap(0, sizeof(struct metrics_page), PROT_READ,
+		    MAP_SHARED, fd, 0)) == MAP_FAILED) {
+	    fprintf(stderr, "%s: no metrics page there\n", argv[1]);
+	    return 1;
+	}
+	close(fd);
+	if(page->magic != METRICS_MAGIC || page->version != METRICS_VERSION || page->size < sizeof(struct metrics_page)) {
+	    fprintf(stderr, "%s: not a metrics page of version %d\n", argv[1], METRICS_VERSION);
+	    return 1;
+	}
+	for(;;) {
+	    if(metrics_read(page, &m)) print_page(&m);
+	    else printf("pid %d: the page is being updated, or its writer died doing so\n", page->pid);
+	    if(every <= 0) break;
+	    fflush(stdout);
+	    nanosleep(&ts, 0);
+	}
+
+    return 0;
+}
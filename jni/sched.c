@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "main.h"
+
+/* Frame clocks.
+   app_thread waits on a clock for what it has to show next and then for the vsync the
+   frame goes out with, so there is at most one frame a display period however many lines,
+   touches and redraw requests came in. The monotonic clock has vsyncs every "period" ns
+   from when it was made, or none. The virtual one only moves on when it is waited on, so
+   runs on it are the same every time. The Choreographer clock is in android.c. */
+
+static inline uint64_t mono_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct mono_clock {
+    struct frame_clock c;
+    uint64_t origin;			/* vsyncs are a whole number of periods after it */
+};
+
+static uint64_t mono_now(struct frame_clock *c)
+{
+    (void) c;
+    return mono_ns();
+}
+
+static int mono_sleep(struct frame_clock *c, uint64_t t, sem_t *wake)
+{
+    struct timespec ts;
+    uint64_t now, ns;
+    int r;
+
+	while((now = mono_ns()) < t) {
+	    if(t == CLOCK_NEVER) r = sem_wait(wake);
+	    else {	/* sem_timedwait() only takes CLOCK_REALTIME */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ns = ts.tv_nsec + (t - now);
+		ts.tv_sec += ns / 1000000000ull;
+		ts.tv_nsec = ns % 1000000000ull;
+		r = sem_timedwait(wake, &ts);
+	    }
+	    if(r == 0) return 0;
+	    if(errno != EINTR && errno != ETIMEDOUT) {
+		log_error("%s: %s", __func__, strerror(errno));
+		break;
+	    }
+	}
+    return 1;
+}
+
+static uint64_t mono_vsync(struct frame_clock *c)
+{
+    struct mono_clock *mc = (struct mono_clock *) c;
+    uint64_t now = mono_ns(), t;
+    struct timespec ts;
+
+	if(!c->period) return now;
+	t = now + c->period - (now - mc->origin) % c->period;
+	ts.tv_sec = t / 1000000000ull;
+	ts.tv_nsec = t % 1000000000ull;
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR);
+    return t;
+}
+
+static void clock_destroy(struct frame_clock *c)
+{
+    free(c);
+}
+
+struct frame_clock *mono_clock_create(long period)
+{
+    struct mono_clock *mc = (struct mono_clock *) calloc(1, sizeof(struct mono_clock));
+	if(!mc) {
+	    log_error("no memory for clock");
+	    return 0;
+	}
+	mc->c.period = period;
+	mc->c.now = mono_now;
+	mc->c.sleep = mono_sleep;
+	mc->c.vsync = mono_vsync;
+	mc->c.destroy = clock_destroy;
+	mc->origin = mono_ns();
+
+    return &mc->c;
+}
+
+/* Virtual time: waiting for a time or a vsync jumps to it at once, unless "wake" was
+   posted before. Waiting for CLOCK_NEVER is the one wait that blocks. */
+
+struct virtual_clock {
+    struct frame_clock c;
+    uint64_t now;
+};
+
+static uint64_t virtual_now(struct frame_clock *c)
+{
+    return ((struct virtual_clock *) c)->now;
+}
+
+static int virtual_sleep(struct frame_clock *c, uint64_t t, sem_t *wake)
+{
+    struct virtual_clock *vc = (struct virtual_clock *) c;
+
+	if(vc->now >= t) return 1;
+	if(sem_trywait(wake) == 0) return 0;
+	if(t == CLOCK_NEVER) {
+	    while(sem_wait(wake) != 0 && errno == EINTR);
+	    return 0;
+	}
+	vc->now = t;
+    return 1;
+}
+
+static uint64_t virtual_vsync(struct frame_clock *c)
+{
+    struct virtual_clock *vc = (struct virtual_clock *) c;
+	if(c->period) vc->now += c->period - vc->now % c->period;
+    return vc->now;
+}
+
+struct frame_clock *virtual_clock_create(long period)
+{
+    struct virtual_clock *vc = (struct virtual_clock *) calloc(1, sizeof(struct virtual_clock));
+	if(!vc) {
+	    log_error("no memory for clock");
+	    return 0;
+	}
+	vc->c.period = period;
+	vc->c.now = virtual_now;
+	vc->c.sleep = virtual_sleep;
+	vc->c.vsync = virtual_vsync;
+	vc->c.destroy = clock_destroy;
+
+    return &vc->c;
+}
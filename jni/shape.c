@@ -0,0 +1,346 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "main.h"
+
+/* Complex script shaping with the system HarfBuzz.
+   libharfbuzz_ng.so is already loaded by the framework, so it is reached through fake_dlopen()
+   like libft2.so. The NDK has no HarfBuzz headers, hence the subset of its API declared below. */
+
+typedef struct hb_blob_t hb_blob_t;
+typedef struct hb_face_t hb_face_t;
+typedef struct hb_font_t hb_font_t;
+typedef struct hb_buffer_t hb_buffer_t;
+typedef struct hb_feature_t hb_feature_t;
+typedef struct hb_unicode_funcs_t hb_unicode_funcs_t;
+typedef uint32_t hb_codepoint_t;
+typedef int32_t hb_position_t;
+typedef uint32_t hb_script_t;
+typedef void (*hb_destroy_func_t)(void *user_data);
+
+typedef enum {
+    HB_MEMORY_MODE_DUPLICATE,
+    HB_MEMORY_MODE_READONLY,
+    HB_MEMORY_MODE_WRITABLE,
+    HB_MEMORY_MODE_READONLY_MAY_MAKE_WRITABLE
+} hb_memory_mode_t;
+
+typedef enum {
+    HB_DIRECTION_INVALID = 0,
+    HB_DIRECTION_LTR = 4,
+    HB_DIRECTION_RTL,
+    HB_DIRECTION_TTB,
+    HB_DIRECTION_BTT
+} hb_direction_t;
+
+#define HB_TAG(a, b, c, d) ((hb_script_t) (a) << 24 | (hb_script_t) (b) << 16 | (c) << 8 | (d))
+#define HB_SCRIPT_COMMON	HB_TAG('Z', 'y', 'y', 'y')
+#define HB_SCRIPT_INHERITED	HB_TAG('Z', 'i', 'n', 'h')
+#define HB_SCRIPT_UNKNOWN	HB_TAG('Z', 'z', 'z', 'z')
+
+/* hb_unicode_general_category_t, the ones told apart here */
+enum {
+    HB_UNICODE_GENERAL_CATEGORY_LOWERCASE_LETTER = 5,	/* to UPPERCASE_LETTER (9): letters */
+    HB_UNICODE_GENERAL_CATEGORY_SPACING_MARK = 10,
+    HB_UNICODE_GENERAL_CATEGORY_ENCLOSING_MARK,
+    HB_UNICODE_GENERAL_CATEGORY_NON_SPACING_MARK,
+    HB_UNICODE_GENERAL_CATEGORY_DECIMAL_NUMBER
+};
+
+typedef struct {
+    hb_codepoint_t codepoint;	/* glyph index after shaping */
+    uint32_t mask;
+    uint32_t cluster;
+    uint32_t var1, var2;
+} hb_glyph_info_t;
+
+typedef struct {
+    hb_position_t x_advance, y_advance;
+    hb_position_t x_offset, y_offset;
+    uint32_t var;
+} hb_glyph_position_t;
+
+extern hb_blob_t *hb_blob_create(const char *data, unsigned int length, hb_memory_mode_t mode,
+	void *user_data, hb_destroy_func_t destroy);
+extern void hb_blob_destroy(hb_blob_t *blob);
+extern hb_face_t *hb_face_create(hb_blob_t *blob, unsigned int index);
+extern void hb_face_destroy(hb_face_t *face);
+extern hb_font_t *hb_font_create(hb_face_t *face);
+extern void hb_font_destroy(hb_font_t *font);
+extern void hb_font_set_scale(hb_font_t *font, int x_scale, int y_scale);
+extern hb_buffer_t *hb_buffer_create(void);
+extern void hb_buffer_destroy(hb_buffer_t *buffer);
+extern void hb_buffer_clear_contents(hb_buffer_t *buffer);
+extern void hb_buffer_add_utf32(hb_buffer_t *buffer, const uint32_t *text, int text_length,
+	unsigned int item_offset, int item_length);
+extern void hb_buffer_guess_segment_properties(hb_buffer_t *buffer);
+extern void hb_buffer_set_direction(hb_buffer_t *buffer, hb_direction_t direction);
+extern void hb_buffer_set_script(hb_buffer_t *buffer, hb_script_t script);
+extern hb_glyph_info_t *hb_buffer_get_glyph_infos(hb_buffer_t *buffer, unsigned int *length);
+extern hb_glyph_position_t *hb_buffer_get_glyph_positions(hb_buffer_t *buffer, unsigned int *length);
+extern void hb_shape(hb_font_t *font, hb_buffer_t *buffer, const hb_feature_t *features, unsigned int num_features);
+extern hb_unicode_funcs_t *hb_unicode_funcs_get_default(void);
+extern int hb_unicode_general_category(hb_unicode_funcs_t *ufuncs, hb_codepoint_t unicode);
+extern hb_script_t hb_unicode_script(hb_unicode_funcs_t *ufuncs, hb_codepoint_t unicode);
+extern hb_direction_t hb_script_get_horizontal_direction(hb_script_t script);
+
+static struct {
+    void *lib;			/* handle to libharfbuzz_ng.so */
+#define ADD_FUNC(A) typeof(&A) A
+#include "hb_functions.inc"
+} hb;
+
+static pthread_once_t hb_once = PTHREAD_ONCE_INIT;
+
+static void hb_load(void)
+{
+#ifdef __arm__
+    hb.lib = fake_dlopen("/system/lib/libharfbuzz_ng.so", RTLD_NOW);
+#else
+    hb.lib = fake_dlopen("/system/lib64/libharfbuzz_ng.so", RTLD_NOW);
+#endif
+    log_info("fake_dlopen for libharfbuzz_ng.so returned %p", hb.lib);
+    if(!hb.lib) return;
+
+#define ADD_FUNC(A) do { \
+   hb.A = (typeof(&A)) fake_dlsym(hb.lib, #A); 				\
+   if(!hb.A) { 								\
+	log_error("no " #A " in libharfbuzz_ng.so");			\
+	fake_dlclose(hb.lib);						\
+	hb.lib = 0;							\
+	return; 							\
+   }									\
+} while(0)
+#include "hb_functions.inc"
+}
+
+/* Shape results are cached per shaper, that is per face file and size, in a direct mapped
+   table keyed by the text of the run and its script and direction, see shaper_run_end(). */
+
+#define SHAPE_CACHE	256
+
+struct shape_entry {
+    uint32_t hash;
+    hb_script_t script;
+    hb_direction_t dir;
+    int len;			/* text length */
+    uint32_t *text;
+    int nglyphs;
+    struct shaped_glyph *glyphs;
+};
+
+struct shaper {
+    void *data;			/* mapped font file */
+    size_t size;
+    hb_blob_t *blob;
+    hb_face_t *face;
+    hb_font_t *font;
+    hb_buffer_t *buf;
+    struct shape_entry cache[SHAPE_CACHE];
+};
+
+/* "ppem" is the pixel size in 26.6 so that positions come out in 26.6 pixels */
+
+struct shaper *shaper_create(const char *file, int ppem)
+{
+    struct shaper *sh;
+    struct stat st;
+    int fd;
+
+	pthread_once(&hb_once, hb_load);
+	if(!hb.lib) return 0;
+
+	sh = (struct shaper *) calloc(1, sizeof(struct shaper));
+	if(!sh) {
+	    log_error("no memory for shaper");
+	    return 0;
+	}
+	fd = open(file, O_RDONLY);
+	if(fd < 0 || fstat(fd, &st) != 0 || st.st_size <= 0) {
+	    log_error("failed to open %s", file);
+	    if(fd >= 0) close(fd);
+	    free(sh);
+	    return 0;
+	}
+	sh->size = st.st_size;
+	sh->data = mmap(0, sh->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(sh->data == MAP_FAILED) {
+	    log_error("mmap() failed for %s", file);
+	    free(sh);
+	    return 0;
+	}
+	sh->blob = hb.hb_blob_create((const char *) sh->data, sh->size, HB_MEMORY_MODE_READONLY, 0, 0);
+	sh->face = hb.hb_face_create(sh->blob, 0);
+	sh->font = hb.hb_font_create(sh->face);
+	hb.hb_font_set_scale(sh->font, ppem, ppem);
+	sh->buf = hb.hb_buffer_create();
+	log_debug("shaper for %s at %d/64 ppem created", file, ppem);
+
+    return sh;
+}
+
+void shaper_destroy(struct shaper *sh)
+{
+    int k;
+    if(!sh) return;
+    for(k = 0; k < SHAPE_CACHE; k++) {
+	free(sh->cache[k].text);
+	free(sh->cache[k].glyphs);
+    }
+    hb.hb_buffer_destroy(sh->buf);
+    hb.hb_font_destroy(sh->font);
+    hb.hb_face_destroy(sh->face);
+    hb.hb_blob_destroy(sh->blob);
+    munmap(sh->data, sh->size);
+    free(sh);
+}
+
+/* Runs.
+   A paragraph is shaped a run at a time, a run being chars of one script at one bidi level.
+   Levels are resolved with a subset of the Unicode bidi algorithm (UAX #9) that has no
+   explicit embeddings, isolates or bracket pairs: the paragraph takes the direction of its
+   first strong char, letters are strong in the direction of their script, marks take the
+   class of the char before them, digits go right to left after a right to left char, and
+   the neutral chars between two strong ones take their direction when it is the same, the
+   paragraph's otherwise. Chars of the common and inherited scripts join the run around them. */
+
+enum { BIDI_L, BIDI_R, BIDI_EN, BIDI_N, BIDI_NSM };
+
+static int bidi_class(hb_unicode_funcs_t *uf, uint32_t c)
+{
+    int cat;
+	if(c == 0x200e) return BIDI_L;			/* LRM */
+	if(c == 0x200f || c == 0x61c) return BIDI_R;	/* RLM, ALM */
+	cat = hb.hb_unicode_general_category(uf, c);
+	if(cat == HB_UNICODE_GENERAL_CATEGORY_NON_SPACING_MARK || cat == HB_UNICODE_GENERAL_CATEGORY_ENCLOSING_MARK)
+	    return BIDI_NSM;
+	if(cat == HB_UNICODE_GENERAL_CATEGORY_DECIMAL_NUMBER) return BIDI_EN;
+	if(cat < HB_UNICODE_GENERAL_CATEGORY_LOWERCASE_LETTER || cat > HB_UNICODE_GENERAL_CATEGORY_SPACING_MARK) return BIDI_N;
+    return hb.hb_script_get_horizontal_direction(hb.hb_unicode_script(uf, c)) == HB_DIRECTION_RTL ? BIDI_R : BIDI_L;
+}
+
+/* Bidi levels of "len" chars of the paragraph "text" into "levels": 0 left to right,
+   1 right to left, 2 left to right within that. Returns the paragraph level, 0 or 1. */
+
+int shaper_levels(const uint32_t *text, int len, uint8_t *levels)
+{
+    hb_unicode_funcs_t *uf = hb.hb_unicode_funcs_get_default();
+    int k, j, base = -1, prev, next, strong;
+
+	for(k = 0; k < len; k++) {
+	    levels[k] = bidi_class(uf, text[k]);
+	    if(base < 0 && levels[k] <= BIDI_R) base = levels[k];
+	}
+	if(base < 0) base = BIDI_L;
+	/* marks and digits; "strong" is the last strong class, the paragraph's at its start */
+	for(k = 0, prev = strong = base; k < len; prev = levels[k++]) {
+	    if(levels[k] == BIDI_NSM) levels[k] = prev;
+	    if(levels[k] == BIDI_EN && strong == BIDI_L) levels[k] = BIDI_L;
+	    if(levels[k] <= BIDI_R) strong = levels[k];
+	}
+	/* neutrals, digits counting as right to left */
+	for(k = 0, prev = base; k < len; k = j) {
+	    if(levels[k] != BIDI_N) {
+		prev = levels[k++] == BIDI_L ? BIDI_L : BIDI_R;
+		j = k;
+		continue;
+	    }
+	    for(j = k; j < len && levels[j] == BIDI_N; j++) ;
+	    next = j == len ? base : levels[j] == BIDI_L ? BIDI_L : BIDI_R;
+	    for(; k < j; k++) levels[k] = prev == next ? prev : base;
+	}
+	for(k = 0; k < len; k++) levels[k] = levels[k] == BIDI_R ? 1 : levels[k] == BIDI_EN ? 2 : 2 * base;
+
+    return base;
+}
+
+/* End of the run of "text" that starts at char "start", with "levels" from shaper_levels(),
+   and its script into "script" */
+
+int shaper_run_end(const uint32_t *text, int len, const uint8_t *levels, int start, uint32_t *script)
+{
+    hb_unicode_funcs_t *uf = hb.hb_unicode_funcs_get_default();
+    hb_script_t sc, run = HB_SCRIPT_COMMON;
+    int k;
+
+	for(k = start; k < len && levels[k] == levels[start]; k++) {
+	    sc = hb.hb_unicode_script(uf, text[k]);
+	    if(sc == HB_SCRIPT_COMMON || sc == HB_SCRIPT_INHERITED || sc == HB_SCRIPT_UNKNOWN || sc == run) continue;
+	    if(run != HB_SCRIPT_COMMON) break;
+	    run = sc;
+	}
+	*script = run;
+
+    return k;
+}
+
+/* Shape "len" chars of "text" in "script", right to left if "rtl". The glyphs returned are
+   valid until the next call; they come in visual order, so right to left runs are reversed. */
+
+int shaper_run(struct shaper *sh, const uint32_t *text, int len, uint32_t script, int rtl, const struct shaped_glyph **glyphs)
+{
+    uint32_t hash = 2166136261u;
+    hb_direction_t dir = rtl ? HB_DIRECTION_RTL : HB_DIRECTION_LTR;
+    hb_glyph_info_t *info;
+    hb_glyph_position_t *pos;
+    struct shape_entry *e;
+    unsigned int k, n;
+
+	for(k = 0; k < (unsigned) len; k++) hash = (hash ^ text[k]) * 16777619u;
+	hash = (hash ^ script) * 16777619u;
+	hash = (hash ^ dir) * 16777619u;
+	e = &sh->cache[hash % SHAPE_CACHE];
+	if(e->text && e->hash == hash && e->script == script && e->dir == dir && e->len == len
+		&& memcmp(e->text, text, len * sizeof(uint32_t)) == 0) {
+	    *glyphs = e->glyphs;
+	    return e->nglyphs;
+	}
+
+	hb.hb_buffer_clear_contents(sh->buf);
+	hb.hb_buffer_add_utf32(sh->buf, text, len, 0, len);
+	hb.hb_buffer_set_script(sh->buf, script);
+	hb.hb_buffer_set_direction(sh->buf, dir);
+	hb.hb_buffer_guess_segment_properties(sh->buf);	/* the language */
+	hb.hb_shape(sh->font, sh->buf, 0, 0);
+	info = hb.hb_buffer_get_glyph_infos(sh->buf, &n);
+	pos = hb.hb_buffer_get_glyph_positions(sh->buf, &n);
+	free(e->text);
+	free(e->glyphs);
+	e->text = (uint32_t *) malloc(len * sizeof(uint32_t));
+	e->glyphs = (struct shaped_glyph *) malloc((n ? n : 1) * sizeof(struct shaped_glyph));
+	if(!e->text || !e->glyphs) {
+	    log_error("no memory for shape cache");
+	    free(e->text);
+	    free(e->glyphs);
+	    e->text = 0;
+	    e->glyphs = 0;
+	    return -1;
+	}
+	memcpy(e->text, text, len * sizeof(uint32_t));
+	e->hash = hash;
+	e->script = script;
+	e->dir = dir;
+	e->len = len;
+	e->nglyphs = n;
+	for(k = 0; k < n; k++) {
+	    e->glyphs[k].gid = info[k].codepoint;
+	    e->glyphs[k].cluster = info[k].cluster;
+	    e->glyphs[k].x_advance = pos[k].x_advance;
+	    e->glyphs[k].x_offset = pos[k].x_offset;
+	    e->glyphs[k].y_offset = pos[k].y_offset;
+	}
+	*glyphs = e->glyphs;
+
+    return n;
+}
+
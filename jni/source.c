@@ -0,0 +1,409 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "main.h"
+
+/* Text sources.
+   app_thread takes its lines from a text source: the numbers in words it has always shown,
+   the lines of a file, random words or whatever comes in on a file descriptor.
+   A line is good until the next one is asked for. */
+
+/* Numbers in words.
+   Numerals in the English language are spoken in triples each consisting 
+   of the number of hundreds (if any) possibly followed by "and" and the lesser number, e.g.:
+   909,168,442 is "nine hundred and nine million one hundred and sixty-eight thousand four hundred and forty-two".
+   The words for all the triples are built once, so a number is at most seven appends
+   of a triple and a scale word, each a memcpy() of a known length. */
+
+/* Terrible bug corrected: https://groups.google.com/d/msg/alt.usage.english/4t0PAe9-QGc/H2Jb2SJQBgAJ */
+
+static const char *low_nums[] = { 0, "one", "two", "three", "four", "five", "six", "seven", "eight", "nine", "ten",
+	"eleven", "twelve", "thirteen", "fourteen", "fifteen", "sixteen", "seventeen", "eighteen", "nineteen" };
+static const char *ten_multiples[] = { 0, 0, "twenty", "thirty", "forty", "fifty", "sixty", "seventy", "eighty", "ninety" };
+
+struct word {
+    const char *s;
+    int len;
+};
+#define WORD(S)	{ S, sizeof(S) - 1 }
+
+/* Scale of triple k from the right: "quintillion" ... "thousand", "" */
+static const struct word scales[] = { WORD(""), WORD(" thousand"), WORD(" million"), WORD(" billion"),
+	WORD(" trillion"), WORD(" quadrillion"), WORD(" quintillion") };
+
+#define TRIPLE_MAX	32		/* "seven hundred and seventy-seven" and a NUL */
+static char triples[1000][TRIPLE_MAX];
+static uint8_t triple_len[1000];
+static pthread_once_t triples_once = PTHREAD_ONCE_INIT;
+
+static void build_triples(void)
+{
+    int num, hi, rest;
+    char *c;
+
+	for(num = 1; num < 1000; num++) {
+	    c = triples[num];
+	    hi = num/100;
+	    rest = num % 100;
+	    if(hi) c += sprintf(c, "%s hundred%s", low_nums[hi], rest ? " and " : "");
+	    if(rest > 19 && rest % 10) c += sprintf(c, "%s-%s", ten_multiples[rest/10], low_nums[rest % 10]);
+	    else if(rest > 19) c += sprintf(c, "%s", ten_multiples[rest/10]);
+	    else if(rest) c += sprintf(c, "%s", low_nums[rest]);
+	    triple_len[num] = c - triples[num];
+	}
+}
+
+/* Words for "num" without its last triple into "out", which has room for NUM2WORDS_MAX chars.
+   The result ends with a space if the last triple is not 0. */
+
+static int words_above(uint64_t num, char *out)
+{
+    unsigned groups[7], k, n, g;
+    char *c = out;
+
+	for(n = 0, num /= 1000; num; n++, num /= 1000) groups[n] = num % 1000;
+	for(k = n; k-- > 0; ) {
+	    if(!(g = groups[k])) continue;
+	    memcpy(c, triples[g], triple_len[g]);
+	    c += triple_len[g];
+	    memcpy(c, scales[k + 1].s, scales[k + 1].len);
+	    c += scales[k + 1].len;
+	    *c++ = ' ';
+	}
+    return c - out;
+}
+
+/* Append the last triple of "num" to "len" chars of words_above() in "out" and terminate it */
+
+static int words_last(uint64_t num, char *out, int len)
+{
+    unsigned g = num % 1000;
+	if(!num) {
+	    memcpy(out, "zero", 5);
+	    return 4;
+	}
+	if(!g) len--;		/* no space after the last scale word */
+	memcpy(out + len, triples[g], triple_len[g]);
+	len += triple_len[g];
+	out[len] = 0;
+    return len;
+}
+
+/* "num" in words into "buf" of "size" chars, cut short if it does not fit.
+   Returns the length of the words, as snprintf() does. */
+
+int num2words(uint64_t num, char *buf, size_t size)
+{
+    char tmp[NUM2WORDS_MAX + 1], *out = size > NUM2WORDS_MAX ? buf : tmp;
+    int len;
+
+	pthread_once(&triples_once, build_triples);
+	len = words_last(num, out, words_above(num, out));
+	if(out == tmp && size) {
+	    if((size_t) len < size) memcpy(buf, tmp, len + 1);
+	    else {
+		memcpy(buf, tmp, size - 1);
+		buf[size - 1] = 0;
+	    }
+	}
+    return len;
+}
+
+/* Words for "count" numbers from "first" on into "arena" of "size" chars, one after
+   another, each terminated. words[k] is set to the words of first + k.
+   Numbers sharing all but the last triple share the work for the rest of it.
+   Returns how many numbers fit. */
+
+unsigned num2words_range(uint64_t first, unsigned count, char *arena, size_t size, const char **words)
+{
+    char above[NUM2WORDS_MAX + 1];
+    uint64_t num;
+    unsigned k;
+    int n = 0, len;
+    char *c = arena, *end = arena + size;
+
+	pthread_once(&triples_once, build_triples);
+	for(k = 0, num = first; k < count; k++, num++) {
+	    if(k == 0 || num % 1000 == 0) n = words_above(num, above);
+	    if(end - c < NUM2WORDS_MAX + 1) break;	/* might not fit */
+	    memcpy(c, above, n);
+	    len = words_last(num, c, n);
+	    words[k] = c;
+	    c += len + 1;
+	    if(num == UINT64_MAX) {
+		k++;
+		break;
+	    }
+	}
+    return k;
+}
+
+/* 0, 1, 2... in words, made a batch at a time */
+
+#define NUMBERS_BATCH	256
+
+struct numbers_source {
+    struct text_source src;
+    uint64_t next;
+    unsigned k, n;			/* next of the n words in the arena */
+    const char *words[NUMBERS_BATCH];
+    char arena[NUMBERS_BATCH * 64];
+};
+
+static const char *numbers_next(struct text_source *src)
+{
+    struct numbers_source *ns = (struct numbers_source *) src;
+	if(ns->k == ns->n) {
+	    ns->n = num2words_range(ns->next, NUMBERS_BATCH, ns->arena, sizeof(ns->arena), ns->words);
+	    ns->next += ns->n;
+	    ns->k = 0;
+	}
+    return ns->words[ns->k++];
+}
+
+static void source_destroy(struct text_source *src)
+{
+    free(src);
+}
+
+struct text_source *numbers_source_create(void)
+{
+    struct numbers_source *ns = (struct numbers_source *) calloc(1, sizeof(struct numbers_source));
+	if(!ns) {
+	    log_error("no memory for text source");
+	    return 0;
+	}
+	ns->src.next = numbers_next;
+	ns->src.destroy = source_destroy;
+
+    return &ns->src;
+}
+
+/* Lines of a file, up to its end */
+
+struct file_source {
+    struct text_source src;
+    FILE *f;
+    char *line;
+    size_t size;
+};
+
+static const char *file_next(struct text_source *src)
+{
+    struct file_source *fs = (struct file_source *) src;
+    ssize_t len = getline(&fs->line, &fs->size, fs->f);
+	if(len < 0) return 0;
+	if(len && fs->line[len - 1] == '\n') fs->line[--len] = 0;
+
+    return len ? fs->line : " ";	/* an empty line still takes one */
+}
+
+static void file_destroy(struct text_source *src)
+{
+    struct file_source *fs = (struct file_source *) src;
+	fclose(fs->f);
+	free(fs->line);
+	free(fs);
+}
+
+struct text_source *file_source_create(const char *file)
+{
+    struct file_source *fs = (struct file_source *) calloc(1, sizeof(struct file_source));
+	if(!fs) {
+	    log_error("no memory for text source");
+	    return 0;
+	}
+	fs->f = fopen(file, "r");
+	if(!fs->f) {
+	    log_error("failed to open %s", file);
+	    free(fs);
+	    return 0;
+	}
+	fs->src.next = file_next;
+	fs->src.destroy = file_destroy;
+
+    return &fs->src;
+}
+
+/* Random words of letters from a few scripts, 1 to 12 of them a line. CJK and kana
+   are there to reach the fallback faces. */
+
+static const struct { uint32_t first, last; } random_ranges[] = {
+    { 'a', 'z' }, { 'A', 'Z' }, { 0xe0, 0xff },		/* Latin */
+    { 0x3b1, 0x3c9 },					/* Greek */
+    { 0x430, 0x44f }, { 0x410, 0x42f },			/* Cyrillic */
+    { 0x3041, 0x3096 },					/* Hiragana */
+    { 0x4e00, 0x9fff },					/* CJK */
+};
+#define RANDOM_RANGES	(sizeof(random_ranges)/sizeof(random_ranges[0]))
+
+struct random_source {
+    struct text_source src;
+    uint64_t state;
+    char line[12 * 11 * 3 + 1];		/* words of up to 10 chars of up to 3 bytes */
+};
+
+static uint32_t random_u32(struct random_source *rs)		/* xorshift64* */
+{
+	rs->state ^= rs->state >> 12;
+	rs->state ^= rs->state << 25;
+	rs->state ^= rs->state >> 27;
+    return (rs->state * 2685821657736338717ull) >> 32;
+}
+
+static char *put_utf8(char *p, uint32_t c)
+{
+	if(c < 0x80) *p++ = c;
+	else if(c < 0x800) {
+	    *p++ = 0xc0 | c >> 6;
+	    *p++ = 0x80 | (c & 0x3f);
+	} else {
+	    *p++ = 0xe0 | c >> 12;
+	    *p++ = 0x80 | (c >> 6 & 0x3f);
+	    *p++ = 0x80 | (c & 0x3f);
+	}
+    return p;
+}
+
+static const char *random_next(struct text_source *src)
+{
+    struct random_source *rs = (struct random_source *) src;
+    char *p = rs->line;
+    int words = 1 + random_u32(rs) % 12, len, k;
+
+	while(words--) {
+	    /* a word keeps to one script, like real text mostly does */
+	    unsigned r = random_u32(rs) % RANDOM_RANGES;
+	    uint32_t n = random_ranges[r].last - random_ranges[r].first + 1;
+	    for(len = 1 + random_u32(rs) % 10, k = 0; k < len; k++)
+		p = put_utf8(p, random_ranges[r].first + random_u32(rs) % n);
+	    if(words) *p++ = ' ';
+	}
+	*p = 0;
+
+    return rs->line;
+}
+
+struct text_source *random_source_create(unsigned seed)
+{
+    struct random_source *rs = (struct random_source *) calloc(1, sizeof(struct random_source));
+	if(!rs) {
+	    log_error("no memory for text source");
+	    return 0;
+	}
+	rs->state = 0x9e3779b97f4a7c15ull ^ seed;
+	rs->src.next = random_next;
+	rs->src.destroy = source_destroy;
+
+    return &rs->src;
+}
+
+/* Lines streaming in on a file descriptor: a pipe, a socket or a file.
+   All that has arrived is read each time app_thread asks, so the writer never waits on
+   the screen, and only the last STREAM_LINES lines are kept: those before can never be
+   shown, as app_thread shows at most a screenful per frame. Memory stays the same
+   however fast the lines come. */
+
+#define STREAM_LINES	256		/* more than fit on any screen */
+#define STREAM_LINE_MAX	1024		/* longer lines are cut */
+#define STREAM_READ_MAX	(1 << 20)	/* bytes read per fill(), so a writer faster than
+					   the reader cannot keep it from drawing */
+struct fd_source {
+    struct text_source src;
+    int fd, eof;
+    unsigned head, tail;		/* lines tail to head - 1 are ready, line head is being read */
+    int len;				/* of line head */
+    unsigned dropped;			/* lines overwritten before being taken */
+    char buf[16384];
+    char lines[STREAM_LINES][STREAM_LINE_MAX + 1];
+};
+
+static void end_line(struct fd_source *fs)
+{
+    char *line = fs->lines[fs->head % STREAM_LINES];
+	if(fs->len && line[fs->len - 1] == '\r') fs->len--;
+	if(!fs->len) line[fs->len++] = ' ';	/* an empty line still takes one */
+	line[fs->len] = 0;
+	fs->len = 0;
+	if(++fs->head - fs->tail == STREAM_LINES) {	/* slot head has to be free */
+	    fs->tail++;
+	    fs->dropped++;
+	}
+}
+
+static int fd_fill(struct text_source *src, int ms)
+{
+    struct fd_source *fs = (struct fd_source *) src;
+    struct pollfd pfd = { fs->fd, POLLIN, 0 };
+    ssize_t k, n;
+    size_t total = 0;
+
+	while(!fs->eof && total < STREAM_READ_MAX && poll(&pfd, 1, ms) > 0) {
+	    ms = 0;		/* only the first poll waits */
+	    n = read(fs->fd, fs->buf, sizeof(fs->buf));
+	    if(n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+	    if(n <= 0) {
+		if(n < 0) log_error("reading text failed: %s", strerror(errno));
+		if(fs->len) end_line(fs);
+		fs->eof = 1;
+		break;
+	    }
+	    total += n;
+	    for(k = 0; k < n; k++) {
+		if(fs->buf[k] == '\n') end_line(fs);
+		else if(fs->len < STREAM_LINE_MAX) fs->lines[fs->head % STREAM_LINES][fs->len++] = fs->buf[k];
+	    }
+	}
+	n = fs->head - fs->tail;
+
+    return !n && fs->eof ? -1 : n;
+}
+
+static int fd_take(struct text_source *src, const char **lines, int max, unsigned *dropped)
+{
+    struct fd_source *fs = (struct fd_source *) src;
+    int k, n = fs->head - fs->tail;
+	if(n > max) {
+	    fs->dropped += n - max;
+	    fs->tail += n - max;
+	    n = max;
+	}
+	for(k = 0; k < n; k++) lines[k] = fs->lines[fs->tail++ % STREAM_LINES];
+	*dropped = fs->dropped;
+	fs->dropped = 0;
+
+    return n;
+}
+
+/* Line by line, oldest first */
+
+static const char *fd_next(struct text_source *src)
+{
+    struct fd_source *fs = (struct fd_source *) src;
+	while(fs->head == fs->tail && fd_fill(src, -1) >= 0);
+    return fs->head != fs->tail ? fs->lines[fs->tail++ % STREAM_LINES] : 0;
+}
+
+struct text_source *fd_source_create(int fd)
+{
+    struct fd_source *fs = (struct fd_source *) calloc(1, sizeof(struct fd_source));
+	if(!fs) {
+	    log_error("no memory for text source");
+	    return 0;
+	}
+	fs->fd = fd;
+	fs->src.next = fd_next;
+	fs->src.fill = fd_fill;
+	fs->src.take = fd_take;
+	fs->src.destroy = source_destroy;
+
+    return &fs->src;
+}
+
@@ -0,0 +1,150 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "main.h"
+
+/* Render targets.
+   draw_frame() locks a surface for the rectangle it is about to change, draws into
+   the buffer it gets and posts it. The age of the buffer tells what else in it is stale:
+   1 means it holds the previous frame, n that it was last shown n frames ago, and 0
+   that its content is undefined and all of it has to be drawn.
+   The Android window surface is in android.c. */
+
+/* Memory buffers, "n" of them used round robin like a window's buffer queue */
+
+struct mem_surface {
+    struct surface s;
+    int width, height, fmt, bpp;
+    int n, cur;			/* buffer count, the one to lock next */
+    unsigned frame;		/* frames posted */
+    unsigned limit;		/* frames to take, the ones after are dropped; 0 for all */
+    unsigned *posted;		/* frame each buffer was last posted as, 0 for never */
+    uint8_t **bits;
+    const char *dump;		/* file name pattern for frames posted */
+};
+
+static int mem_lock(struct surface *s, struct surface_buffer *buf, struct rect *dirty)
+{
+    struct mem_surface *ms = (struct mem_surface *) s;
+	buf->bits = ms->bits[ms->cur];
+	buf->width = ms->width;
+	buf->height = ms->height;
+	buf->stride = ms->width;
+	buf->fmt = ms->fmt;
+	buf->age = ms->posted[ms->cur] ? ms->frame - ms->posted[ms->cur] + 1 : 0;
+	(void) dirty;
+
+    return 0;
+}
+
+/* Binary PPM of buffer "k" */
+
+static void mem_write_ppm(struct mem_surface *ms, int k)
+{
+    char name[PATH_MAX];
+    uint8_t *row, *p;
+    FILE *f;
+    int x, y;
+
+	snprintf(name, sizeof(name), ms->dump, ms->frame);
+	if(!(f = fopen(name, "wb"))) {
+	    log_error("failed to create %s", name);
+	    return;
+	}
+	row = (uint8_t *) malloc(ms->width * 3);
+	fprintf(f, "P6\n%d %d\n255\n", ms->width, ms->height);
+	for(y = 0; row && y < ms->height; y++) {
+	    p = ms->bits[k] + y * ms->width * ms->bpp;
+	    for(x = 0; x < ms->width; x++, p += ms->bpp) {
+		if(ms->fmt == WINDOW_FORMAT_RGB_565) {
+		    unsigned v = p[0] | p[1] << 8;
+		    row[3 * x] = (v >> 11) * 255 / 31;
+		    row[3 * x + 1] = (v >> 5 & 0x3f) * 255 / 63;
+		    row[3 * x + 2] = (v & 0x1f) * 255 / 31;
+		} else memcpy(row + 3 * x, p, 3);
+	    }
+	    fwrite(row, 3, ms->width, f);
+	}
+	free(row);
+	if(fclose(f) != 0) log_error("failed to write %s", name);
+}
+
+static void mem_post(struct surface *s)
+{
+    struct mem_surface *ms = (struct mem_surface *) s;
+	if(ms->limit && ms->frame >= ms->limit) return;
+	ms->posted[ms->cur] = ++ms->frame;
+	if(ms->dump) mem_write_ppm(ms, ms->cur);
+	if(++ms->cur == ms->n) ms->cur = 0;
+}
+
+static void mem_destroy(struct surface *s)
+{
+    struct mem_surface *ms = (struct mem_surface *) s;
+    int k;
+	for(k = 0; k < ms->n; k++) free(ms->bits[k]);
+	free(ms->bits);
+	free(ms->posted);
+	free(ms);
+}
+
+struct surface *mem_surface_create(int width, int height, int fmt, int n)
+{
+    struct mem_surface *ms = (struct mem_surface *) calloc(1, sizeof(struct mem_surface));
+    int k;
+	if(!ms) goto nomem;
+	ms->s.lock = mem_lock;
+	ms->s.post = mem_post;
+	ms->s.destroy = mem_destroy;
+	ms->width = width;
+	ms->height = height;
+	ms->fmt = fmt;
+	ms->bpp = fmt == WINDOW_FORMAT_RGB_565 ? 2 : 4;
+	ms->n = n;
+	ms->posted = (unsigned *) calloc(n, sizeof(unsigned));
+	ms->bits = (uint8_t **) calloc(n, sizeof(uint8_t *));
+	if(!ms->posted || !ms->bits) goto nomem;
+	for(k = 0; k < n; k++) {
+	    ms->bits[k] = (uint8_t *) malloc(width * height * ms->bpp);	/* undefined until drawn, like a window's */
+	    if(!ms->bits[k]) goto nomem;
+	}
+	return &ms->s;
+
+    nomem:
+	log_error("no memory for %d x %d surface", width, height);
+	if(ms && ms->bits) mem_destroy(&ms->s);
+	else if(ms) {
+	    free(ms->posted);
+	    free(ms);
+	}
+	return 0;
+}
+
+/* The buffer posted last, for dumping frames */
+
+const void *mem_surface_front(struct surface *s)
+{
+    struct mem_surface *ms = (struct mem_surface *) s;
+    return ms->frame ? ms->bits[(ms->cur + ms->n - 1) % ms->n] : 0;
+}
+
+unsigned mem_surface_frames(struct surface *s)
+{
+    return ((struct mem_surface *) s)->frame;
+}
+
+void mem_surface_dump(struct surface *s, const char *pattern)
+{
+    ((struct mem_surface *) s)->dump = pattern;
+}
+
+void mem_surface_limit(struct surface *s, unsigned frames)
+{
+    ((struct mem_surface *) s)->limit = frames;
+}
+
@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/prctl.h>
+#ifdef __ANDROID__
+#include <dlfcn.h>
+#endif
+
+#include "main.h"
+
+/* Tracing.
+   Each thread records into a ring of its own, made the first time it hits a trace point
+   and kept for the life of the process, so recording takes no lock: a scope is one
+   complete event written when it ends, with its start and duration in CLOCK_MONOTONIC ns.
+   When the ring is full the oldest events go. Counts of TRACE_COUNT() events are kept per
+   thread and written as counter events each time an outermost scope ends, so they show
+   per call of it. trace_stop() writes all rings out in the Chrome trace format that
+   chrome://tracing and ui.perfetto.dev open; events recorded while it does may be lost.
+   On Android scopes and counts are also passed on to ATrace when libandroid has it. */
+
+#define TRACE_EVENTS	(1 << 16)	/* per thread, a power of 2 */
+#define TRACE_COUNTERS	8		/* distinct TRACE_COUNT() names per thread */
+
+struct trace_event {
+    const char *name;
+    uint64_t ts, dur;			/* start and duration, for counters the count in dur */
+    char ph;				/* 'X' for a scope, 'C' for a count */
+};
+
+struct trace_ring {
+    struct trace_ring *next;		/* all rings, newest first */
+    int tid, depth;			/* thread id, scopes open */
+    char thread[16];
+    atomic_uint head;			/* events recorded so far */
+    struct {
+	const char *name;
+	uint64_t n;
+    } counters[TRACE_COUNTERS];
+    struct trace_event events[TRACE_EVENTS];
+};
+
+atomic_int trace_on;
+static const char *trace_file;
+static uint64_t trace_t0;
+static _Atomic(struct trace_ring *) rings;
+static __thread struct trace_ring *ring;
+
+#ifdef __ANDROID__
+static void (*atrace_begin)(const char *name);
+static void (*atrace_end)(void);
+static void (*atrace_counter)(const char *name, int64_t value);
+#endif
+
+static inline uint64_t trace_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static struct trace_ring *get_ring(void)
+{
+    struct trace_ring *r = ring;
+	if(r) return r;
+	if(!(r = (struct trace_ring *) calloc(1, sizeof(struct trace_ring)))) return 0;
+	r->tid = syscall(SYS_gettid);
+	if(prctl(PR_GET_NAME, r->thread) != 0) r->thread[0] = 0;	/* 16 bytes with the 0 */
+	r->next = atomic_load(&rings);
+	while(!atomic_compare_exchange_weak(&rings, &r->next, r));
+	ring = r;
+    return r;
+}
+
+static inline void record(struct trace_ring *r, const char *name, uint64_t ts, uint64_t dur, char ph)
+{
+    unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    struct trace_event *e = &r->events[head % TRACE_EVENTS];
+	e->name = name;
+	e->ts = ts;
+	e->dur = dur;
+	e->ph = ph;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+uint64_t trace_begin(const char *name)
+{
+    struct trace_ring *r = get_ring();
+	if(!r) return 0;
+	r->depth++;
+#ifdef __ANDROID__
+	if(atrace_begin) atrace_begin(name);
+#endif
+    return trace_ns();
+}
+
+void trace_end(const char *name, uint64_t t0)
+{
+    struct trace_ring *r = ring;
+    uint64_t t = trace_ns();
+    int k;
+
+#ifdef __ANDROID__
+	if(atrace_end) atrace_end();
+#endif
+	record(r, name, t0, t - t0, 'X');
+	if(--r->depth) return;
+	for(k = 0; k < TRACE_COUNTERS && r->counters[k].name; k++) {
+	    if(!r->counters[k].n) continue;
+	    record(r, r->counters[k].name, t, r->counters[k].n, 'C');
+#ifdef __ANDROID__
+	    if(atrace_counter) atrace_counter(r->counters[k].name, r->counters[k].n);
+#endif
+	    r->counters[k].n = 0;
+	}
+}
+
+void trace_count(const char *name)
+{
+    struct trace_ring *r = get_ring();
+    int k;
+	if(!r) return;
+	for(k = 0; k < TRACE_COUNTERS; k++) {
+	    if(!r->counters[k].name) r->counters[k].name = name;
+	    if(r->counters[k].name == name) {
+		r->counters[k].n++;
+		return;
+	    }
+	}
+}
+
+int trace_start(const char *file)
+{
+#ifdef __ANDROID__
+    void *lib = dlopen("libandroid.so", RTLD_NOW);
+	if(lib) {
+	    atrace_begin = (void (*)(const char *)) dlsym(lib, "ATrace_beginSection");
+	    atrace_end = (void (*)(void)) dlsym(lib, "ATrace_endSection");
+	    atrace_counter = (void (*)(const char *, int64_t)) dlsym(lib, "ATrace_setCounter");
+	    if(!atrace_end) atrace_begin = 0;
+	}
+#endif
+	trace_file = file;
+	trace_t0 = trace_ns();
+	atomic_store(&trace_on, 1);
+	if(file) log_info("%s: tracing to %s", __func__, file);
+    return 0;
+}
+
+/* Write the events in ring "r", trace point names are literals that need no escaping */
+
+static void write_events(FILE *f, struct trace_ring *r, int *first)
+{
+    unsigned head = atomic_load_explicit(&r->head, memory_order_acquire);
+    unsigned k = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+    pid_t pid = getpid();
+
+	if(r->thread[0]) {
+	    fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+		    *first ? "" : ",", pid, r->tid, r->thread);
+	    *first = 0;
+	}
+	for(; k < head; k++) {
+	    const struct trace_event *e = &r->events[k % TRACE_EVENTS];
+	    if(e->ts < trace_t0) continue;	/* from an earlier trace_start() */
+	    fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,", *first ? "" : ",",
+		    e->name, e->ph, (e->ts - trace_t0) / 1e3, pid, r->tid);
+	    if(e->ph == 'X') fprintf(f, "\"dur\":%.3f}", e->dur / 1e3);
+	    else fprintf(f, "\"args\":{\"n\":%llu}}", (unsigned long long) e->dur);
+	    *first = 0;
+	}
+}
+
+void trace_stop(void)
+{
+    struct trace_ring *r;
+    int first = 1;
+    FILE *f;
+
+	if(!atomic_exchange(&trace_on, 0)) return;
+	if(!trace_file) return;
+	if(!(f = fopen(trace_file, "w"))) {
+	    log_error("failed to create %s", trace_file);
+	    return;
+	}
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for(r = atomic_load(&rings); r; r = r->next) write_events(f, r, &first);
+	fprintf(f, "\n]}\n");
+	if(fclose(f) != 0) log_error("failed to write %s", trace_file);
+	else log_info("%s: trace written to %s", __func__, trace_file);
+}
@@ -0,0 +1,43 @@
+#ifndef __TRACE_H_INCLUDED
+#define __TRACE_H_INCLUDED
+
+/* Trace points, see trace.c. Apart from main.h for fake_dlfcn.c, which has its own struct ctx.
+   TRACE_SCOPE() times the rest of the block it is in, TRACE_COUNT() counts an event
+   that is too frequent to time. Without TRACING they are nothing, with it and tracing off
+   a scope costs a test of trace_on and one of its start time at the end. */
+
+#ifdef TRACING
+#include <stdint.h>
+#include <stdatomic.h>
+
+extern atomic_int trace_on;
+/* Record trace points, to be written to "file" as Chrome trace JSON by trace_stop().
+   On Android they also go out as ATrace sections for systrace and Perfetto. */
+extern int trace_start(const char *file);
+extern void trace_stop(void);
+extern uint64_t trace_begin(const char *name);
+extern void trace_end(const char *name, uint64_t t0);
+extern void trace_count(const char *name);
+
+struct trace_scope {
+    const char *name;
+    uint64_t t0;			/* 0 when tracing was off at the start */
+};
+
+static inline void trace_scope_end(struct trace_scope *s)
+{
+    if(__builtin_expect(s->t0 != 0, 0)) trace_end(s->name, s->t0);
+}
+
+#define TRACE_ON()		__builtin_expect(atomic_load_explicit(&trace_on, memory_order_relaxed), 0)
+#define TRACE_VAR_(line)	trace_scope_##line
+#define TRACE_VAR(line)		TRACE_VAR_(line)
+#define TRACE_SCOPE(name)	struct trace_scope TRACE_VAR(__LINE__) __attribute__((cleanup(trace_scope_end))) \
+					= { name, TRACE_ON() ? trace_begin(name) : 0 }
+#define TRACE_COUNT(name)	do { if(TRACE_ON()) trace_count(name); } while(0)
+#else
+#define TRACE_SCOPE(name)
+#define TRACE_COUNT(name)	do { } while(0)
+#endif
+
+#endif